@@ -0,0 +1,27 @@
+#!/bin/sh
+# Generates N synthetic VM config files and times `qemu-run --check` over
+# all of them in a single process, i.e. the config parser alone.
+# Usage: bench/config-parse.sh [count] [qemu-run binary]
+set -e
+count=${1:-100000}
+bin=${2:-./qemu-run.bin}
+dir=$(mktemp -d "${TMPDIR:-/tmp}/qemu-run-bench.XXXXXX")
+trap 'rm -rf "$dir"' EXIT INT TERM
+
+awk -v count="$count" -v dir="$dir" 'BEGIN {
+    split("x32 x64", sys, " ")
+    split("e1000 virtio-net-pci rtl8139 no", net, " ")
+    for (i = 0; i < count; i++) {
+        f = sprintf("%s/%06d.ini", dir, i)
+        printf("# generated config %d\n", i) > f
+        printf("sys=%s\ncpu=host\ncores=%d\nmem=%dG\n", sys[i % 2 + 1],
+               i % 16 + 1, i % 64 + 1) > f
+        printf("acc=yes\nvga=virtio\nsnd=no\nboot=c\nnet=%s\n",
+               net[i % 4 + 1]) > f
+        printf("fwd_ports=%d:22\nipv4=yes\nipv6=no\nheadless=yes\n",
+               2200 + i % 1000) > f
+        printf("disk=disk%d.qcow2;data%d.raw;scratch.img\n", i, i) > f
+        close(f)
+    }
+}'
+find "$dir" -name '*.ini' | "$bin" --check
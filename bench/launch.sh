@@ -0,0 +1,136 @@
+#!/bin/sh
+# Launcher benchmark: generates a synthetic QEMURUN_VM_PATH tree, puts
+# bench/qemu-stub.sh on PATH as qemu-system-*, and measures the index
+# build, VM lookup, config parsing and command line build of qemu-run,
+# with no KVM (or QEMU) needed. Per launch phases come from launch traces
+# (QEMURUN_TRACE) aggregated with --trace-summary.
+#
+# Results go to stdout as "<metric> <value> <unit>" and are compared with
+# bench/baseline.txt: any time metric over it by more than
+# BENCH_TOLERANCE percent (default 25), and by more than the timer noise
+# (100 us, 2 ms), fails the run. --save writes the results as the new
+# baseline instead; baselines only compare on the same host.
+#
+# Usage: bench/launch.sh [--save] [vms] [roots] [disks per VM] [binary]
+set -e
+save=0
+if [ "$1" = "--save" ]; then
+    save=1
+    shift
+fi
+vms=${1:-1000}
+roots=${2:-8}
+disks=${3:-4}
+bin=${4:-./qemu-run.bin}
+case $bin in
+/*) ;;
+*) bin=$PWD/$bin ;;
+esac
+bench=$(cd "$(dirname "$0")" && pwd)
+baseline=${BENCH_BASELINE:-$bench/baseline.txt}
+tolerance=${BENCH_TOLERANCE:-25}
+samples=$((vms < 200 ? vms : 200))
+dir=$(mktemp -d "${TMPDIR:-/tmp}/qemu-run-bench.XXXXXX")
+trap 'rm -rf "$dir"' EXIT INT TERM
+
+now_ms() {
+    echo $(($(date +%s%N) / 1000000))
+}
+
+# Tree: VMs spread over the roots, half with "config", half "config.ini"
+# (the fallback probe), each with its disks as empty files. They are small
+# enough for --fleet to admit them on any host.
+mkdir -p "$dir/bin" "$dir/cache" "$dir/traces"
+for sys in i386 x86_64; do
+    cp "$bench/qemu-stub.sh" "$dir/bin/qemu-system-$sys"
+    chmod +x "$dir/bin/qemu-system-$sys"
+done
+awk -v vms="$vms" -v roots="$roots" -v dir="$dir" 'BEGIN {
+    for (i = 0; i < vms; i++) {
+        printf("%s/root%d/vm%05d\n", dir, i % roots, i)
+    }
+}' > "$dir/vms.txt"
+xargs mkdir -p < "$dir/vms.txt"
+awk -v vms="$vms" -v roots="$roots" -v disks="$disks" -v dir="$dir" 'BEGIN {
+    split("e1000 virtio-net-pci rtl8139 no", net, " ")
+    for (i = 0; i < vms; i++) {
+        vm = sprintf("%s/root%d/vm%05d", dir, i % roots, i)
+        list = ""
+        for (d = 0; d < disks; d++) {
+            list = list (d ? ";" : "") sprintf("disk%d.qcow2", d)
+            printf("") > (vm "/" sprintf("disk%d.qcow2", d))
+            close(vm "/" sprintf("disk%d.qcow2", d))
+        }
+        f = vm (i % 2 ? "/config.ini" : "/config")
+        printf("sys=x64\ncores=1\nmem=%dM\nnet=%s\nheadless=yes\n",
+               128 + i % 4 * 64, net[i % 4 + 1]) > f
+        printf("fwd_ports=auto:22\nmonitor_port=auto\ndisk=%s\n", list) > f
+        printf("disk_cache=none\ndisk_aio=threads\n") > f
+        close(f)
+    }
+}'
+path=
+i=0
+while [ "$i" -lt "$roots" ]; do
+    mkdir -p "$dir/root$i"
+    path=${path:+$path:}$dir/root$i
+    i=$((i + 1))
+done
+
+export QEMURUN_VM_PATH="$path" XDG_CACHE_HOME="$dir/cache" \
+    XDG_RUNTIME_DIR="$dir" QEMU_STUB_LOG="$dir/argv.log" \
+    PATH="$dir/bin:$PATH"
+results=$dir/results.txt
+
+t=$(now_ms)
+"$bin" --list > /dev/null
+echo "index_build $(($(now_ms) - t)) ms" >> "$results"
+t=$(now_ms)
+"$bin" --list > /dev/null
+echo "index_warm $(($(now_ms) - t)) ms" >> "$results"
+
+find "$dir" -name 'config*' | "$bin" --check |
+    awk '{ printf("check_all %s ms\n", $7) }' >> "$results"
+
+# Single launches, spread over every root: the last root's VMs are the
+# slowest to find.
+seq=$(awk -v n="$samples" -v vms="$vms" \
+    'BEGIN { for (i = 0; i < n; i++) printf("vm%05d\n", int(i * vms / n)) }')
+t=$(now_ms)
+for vm in $seq; do
+    QEMURUN_TRACE="$dir/traces" "$bin" "$vm" > /dev/null
+done
+echo "launch_each $((($(now_ms) - t) * 1000 / samples)) us" >> "$results"
+QEMURUN_TRACE="$dir/traces" "$bin" --trace-summary |
+    awk 'NR > 1 && $1 != "qemu_init" && $1 != "launch" {
+        printf("phase_%s_p50 %.0f us\n", $1, $4 * 1000)
+        printf("phase_%s_p95 %.0f us\n", $1, $5 * 1000)
+    }' >> "$results"
+
+t=$(now_ms)
+# shellcheck disable=SC2086
+"$bin" --fleet $seq > /dev/null
+echo "fleet_start $(($(now_ms) - t)) ms" >> "$results"
+launches=$(grep -c '^$' "$dir/argv.log")
+echo "stub_launches $launches count" >> "$results"
+
+cat "$results"
+if [ "$save" = 1 ]; then
+    cp "$results" "$baseline"
+    echo "Saved as the baseline in $baseline"
+    exit 0
+fi
+if [ ! -f "$baseline" ]; then
+    echo "No baseline yet, make one with: bench/launch.sh --save"
+    exit 0
+fi
+awk -v tol="$tolerance" '
+    NR == FNR { base[$1] = $2; next }
+    ($1 in base) && $3 != "count" {
+        pct = base[$1] > 0 ? ($2 - base[$1]) * 100 / base[$1] : 0
+        slow = pct > tol && $2 - base[$1] > ($3 == "us" ? 100 : 2)
+        printf("%-24s %10s -> %10s %s %+6.1f%%%s\n", $1, base[$1], $2, $3,
+               pct, slow ? "  SLOWER" : "")
+        failed += slow
+    }
+    END { exit failed ? 1 : 0 }' "$baseline" "$results"
@@ -0,0 +1,37 @@
+#!/bin/sh
+# Stands in for qemu-system-* during benchmarks: records the argument
+# vector, one argument per line and a blank line per launch, and exits.
+# It answers the capability probe like a QEMU 9.0 with the pc, q35 and
+# microvm machines and virtiofs, so launches read the caps cache as they
+# would with a real QEMU; probes are not launches.
+case " $* " in
+*" -qmp stdio "*)
+    echo '{"QMP": {"version": {"qemu": {"micro": 0, "minor": 0,' \
+        '"major": 9}, "package": ""}, "capabilities": []}}'
+    while read -r line; do
+        id=${line##*\"id\": }
+        id=${id%%\}*}
+        case $line in
+        *'"query-version"'*)
+            ret='{"qemu": {"micro": 0, "minor": 0, "major": 9}}' ;;
+        *'"query-machines"'*)
+            ret='[{"name": "pc"}, {"name": "q35"}, {"name": "microvm"}]' ;;
+        *'"qom-list-types"'*)
+            ret='[{"name": "vhost-user-fs-pci"}, {"name": "e1000"}]' ;;
+        *'"query-qmp-schema"'*)
+            ret='[{"name": "threads"}, {"name": "native"}]' ;;
+        *) ret='{}' ;;
+        esac
+        echo "{\"return\": $ret, \"id\": $id}"
+        case $line in
+        *'"quit"'*) exit 0 ;;
+        esac
+    done
+    exit 0 ;;
+esac
+{
+    for arg in "$@"; do
+        printf '%s\n' "$arg"
+    done
+    echo
+} >> "${QEMU_STUB_LOG:-/dev/null}"
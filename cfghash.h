@@ -0,0 +1,74 @@
+#ifndef QEMU_RUN_CFGHASH_H
+#define QEMU_RUN_CFGHASH_H
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/* Seeded FNV-1a, shared by genhashes.c (which searches the seeds of the
+ * perfect hash) and qemu-run.c (which uses them), so both always agree. */
+static inline unsigned int cfg_hash(const char *str, size_t len,
+                                    unsigned int seed) {
+    unsigned int hash = 2166136261u ^ (seed * 16777619u);
+    for (size_t pos = 0; pos < len; pos++) {
+        hash = (hash ^ (unsigned char)str[pos]) * 16777619u;
+    }
+    return hash & 0xFFFFFFFF;
+}
+
+/* Value types of the config keys, inferred from qemu-run.defaults or
+ * given there explicitly as "key:type=value". */
+enum { CFG_STR, CFG_BOOL, CFG_INT, CFG_SIZE, CFG_LIST, CFG_ENDLIST };
+
+/* Converts a value to the number stored next to it in its typed slot:
+ * CFG_BOOL 0/1, CFG_INT the value, CFG_SIZE bytes (plain numbers are MiB,
+ * like QEMU's -m) and CFG_LIST the number of ';' separated items.
+ * Returns 0 if the value does not fit the type. */
+static inline int cfg_convert(int type, const char *val, long long *out_num) {
+    char *end;
+    *out_num = 0;
+    switch (type) {
+    case CFG_BOOL:
+        if (!strcasecmp(val, "yes") || !strcasecmp(val, "on") ||
+            !strcasecmp(val, "true") || !strcmp(val, "1")) {
+            *out_num = 1;
+            return 1;
+        }
+        return !val[0] || !strcasecmp(val, "no") || !strcasecmp(val, "off") ||
+               !strcasecmp(val, "false") || !strcmp(val, "0");
+    case CFG_INT:
+        *out_num = strtoll(val, &end, 10);
+        return !*end;
+    case CFG_SIZE:
+        *out_num = strtoll(val, &end, 10);
+        switch (*end ? *end++ | 0x20 : 'm') {
+        case 'k':
+            *out_num <<= 10;
+            break;
+        case 'm':
+            *out_num <<= 20;
+            break;
+        case 'g':
+            *out_num <<= 30;
+            break;
+        case 't':
+            *out_num <<= 40;
+            break;
+        default:
+            return 0;
+        }
+        return !*end || ((*end | 0x20) == 'b' && !end[1]);
+    case CFG_LIST:
+        for (const char *item = val; *item; item++) {
+            if (*item != ';' && (item == val || item[-1] == ';')) {
+                (*out_num)++;
+            }
+        }
+        return 1;
+    default:
+        return 1;
+    }
+}
+
+#endif // QEMU_RUN_CFGHASH_H
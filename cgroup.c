@@ -0,0 +1,332 @@
+/* Resource limits: every VM with one of the cgroup_* keys set runs in
+ * its own cgroup v2, so one busy guest cannot starve the others.
+ *
+ * cgroup_cpu_max= caps the CPU time, in CPUs ("1.5") or percent ("150%").
+ * cgroup_mem_max= caps the memory of QEMU and its helpers, guest RAM
+ * included. cgroup_io_max= caps the disks holding the VM images, as a ','
+ * separated list of riops=, wiops=, rbps= and wbps= ("riops=2000,wbps=50M").
+ * cgroup_weight= (1-10000, 100 by default) is the VM's share of CPU and
+ * disk time when the host is busy.
+ *
+ * When systemd manages the cgroup tree, QEMU is started through
+ * systemd-run as a transient scope with these limits, a --user scope for
+ * users other than root. Without systemd, and with cgroup2 mounted on
+ * CGROUP_ROOT and writable, the VM goes in qemu-run/<vm name> below the
+ * launcher's own cgroup, so it stays within what was delegated to it. The
+ * launcher enters it just before it starts QEMU, so helpers like virtiofsd
+ * are counted too. Empty VM cgroups are removed the next time one is
+ * made. */
+
+#define CGROUP_ROOT "/sys/fs/cgroup"
+#define CGROUP_PERIOD 100000
+#define CGROUP_MAX_DEVS 8
+
+typedef struct {
+    long long cpu_quota, weight, io[4]; /**< io: riops wiops rbps wbps */
+    unsigned int devs[CGROUP_MAX_DEVS][2];
+    int dev_count;
+} st_cgroup_limits;
+
+static const char *cgroup_io_keys[] = {"riops", "wiops", "rbps", "wbps"};
+
+bool cgroup_requested(void) {
+    return cfg[KEY_CGROUP_CPU_MAX].val[0] || cfg[KEY_CGROUP_MEM_MAX].num ||
+           cfg[KEY_CGROUP_IO_MAX].val[0] || cfg[KEY_CGROUP_WEIGHT].num;
+}
+
+/* The cgroup of this process, from the cgroup2 line of /proc/self/cgroup. */
+static bool cgroup_own(char *out_dir, size_t size) {
+    char line[PATH_MAX];
+    bool found = 0;
+    FILE *fh = fopen("/proc/self/cgroup", "r");
+    while (fh && !found && fgets(line, sizeof(line), fh)) {
+        line[strcspn(line, "\n")] = '\0';
+        if (strncmp(line, "0::/", 4) == 0) {
+            found = snprintf(out_dir, size, CGROUP_ROOT "%s",
+                             strcmp(line + 3, "/") == 0 ? "" : line + 3) <
+                    (int)size;
+        }
+    }
+    if (fh) {
+        fclose(fh);
+    }
+    return found;
+}
+
+/* Whether qemu-run makes the cgroups itself, below its own one: never on
+ * a systemd host, whose tree only systemd may change. */
+static bool cgroup_direct(void) {
+    char own[PATH_MAX], fpath[PATH_MAX + 32];
+    if (filetype("/run/systemd/system", FT_PATH) ||
+        !filetype(CGROUP_ROOT "/cgroup.controllers", FT_FILE) ||
+        !cgroup_own(own, sizeof(own))) {
+        return 0;
+    }
+    snprintf(fpath, sizeof(fpath), "%s/cgroup.subtree_control", own);
+    return access(fpath, W_OK) == 0;
+}
+
+/* The whole disk holding fpath, as major:minor; partitions are mapped to
+ * their disk, since io.max only takes those. False for virtual devices. */
+static bool cgroup_disk_of(const char *fpath, unsigned int out_dev[2]) {
+    struct stat st;
+    char sys[PATH_MAX + 16], real[PATH_MAX], line[32];
+    FILE *fh;
+    if (stat(fpath, &st) != 0 || major(st.st_dev) == 0) {
+        return 0;
+    }
+    snprintf(sys, sizeof(sys), "/sys/dev/block/%u:%u", major(st.st_dev),
+             minor(st.st_dev));
+    if (!realpath(sys, real)) {
+        return 0;
+    }
+    snprintf(sys, sizeof(sys), "%s/partition", real);
+    if (filetype(sys, FT_FILE)) {
+        snprintf(sys, sizeof(sys), "%s/../dev", real);
+    } else {
+        snprintf(sys, sizeof(sys), "%s/dev", real);
+    }
+    if (!(fh = fopen(sys, "r"))) {
+        return 0;
+    }
+    bool ok = fgets(line, sizeof(line), fh) &&
+              sscanf(line, "%u:%u", &out_dev[0], &out_dev[1]) == 2;
+    fclose(fh);
+    return ok;
+}
+
+static void cgroup_io_devices(st_cgroup_limits *lim) {
+    char disk_fpath[PATH_MAX];
+    unsigned int dev[2];
+    for (int i = 0; i < cfg[KEY_DISK].num; i++) {
+        bool seen = 0;
+        cfg_list_item(KEY_DISK, i, disk_fpath, sizeof(disk_fpath));
+        if (!cgroup_disk_of(disk_fpath, dev)) {
+            printf("qemu-run: Warning: %s is not on a block device "
+                   "cgroup_io_max= can limit\n",
+                   disk_fpath);
+            continue;
+        }
+        for (int j = 0; j < lim->dev_count; j++) {
+            seen = seen || (lim->devs[j][0] == dev[0] &&
+                            lim->devs[j][1] == dev[1]);
+        }
+        if (!seen && lim->dev_count < CGROUP_MAX_DEVS) {
+            lim->devs[lim->dev_count][0] = dev[0];
+            lim->devs[lim->dev_count++][1] = dev[1];
+        }
+    }
+}
+
+/* Checks the cgroup_* keys and turns them into limits, once per VM. */
+static const st_cgroup_limits *cgroup_limits(void) {
+    static st_cgroup_limits limits, *lim;
+    const char *cpu = cfg[KEY_CGROUP_CPU_MAX].val;
+    char *end, item[BUFF_AVG];
+    const char *io = cfg[KEY_CGROUP_IO_MAX].val;
+    if (lim) {
+        return lim;
+    }
+    lim = &limits;
+    if (cpu[0]) {
+        double cpus = strtod(cpu, &end);
+        if (*end == '%') {
+            cpus /= 100;
+            end++;
+        }
+        if (*end || cpus <= 0) {
+            printf("qemu-run: cgroup_cpu_max=%s is not a CPU count like 1.5 "
+                   "or a percentage like 150%%\n",
+                   cpu);
+            fatal(ERR_CGROUP);
+        }
+        lim->cpu_quota = (long long)(cpus * CGROUP_PERIOD);
+        lim->cpu_quota = lim->cpu_quota < 1000 ? 1000 : lim->cpu_quota;
+    }
+    lim->weight = cfg[KEY_CGROUP_WEIGHT].num;
+    if (cfg[KEY_CGROUP_WEIGHT].val[0] && (lim->weight < 1 ||
+                                          lim->weight > 10000)) {
+        printf("qemu-run: cgroup_weight=%s is not between 1 and 10000\n",
+               cfg[KEY_CGROUP_WEIGHT].val);
+        fatal(ERR_CGROUP);
+    }
+    while (*io) {
+        size_t len = strcspn(io, ","), k = 0;
+        long long num = 0;
+        snprintf(item, sizeof(item), "%.*s", (int)len, io);
+        io += len + (io[len] == ',');
+        for (; k < 4; k++) {
+            size_t klen = strlen(cgroup_io_keys[k]);
+            if (strncmp(item, cgroup_io_keys[k], klen) == 0 &&
+                item[klen] == '=') {
+                break;
+            }
+        }
+        if (k == 4 ||
+            !cfg_convert(k < 2 ? CFG_INT : CFG_SIZE,
+                         item + strlen(cgroup_io_keys[k]) + 1, &num) ||
+            num <= 0) {
+            printf("qemu-run: cgroup_io_max: %s is not riops=, wiops=, rbps= "
+                   "or wbps= with a positive value\n",
+                   item);
+            fatal(ERR_CGROUP);
+        }
+        lim->io[k] = num;
+    }
+    if (lim->io[0] || lim->io[1] || lim->io[2] || lim->io[3]) {
+        cgroup_io_devices(lim);
+    }
+    return lim;
+}
+
+static bool cgroup_write(const char *dir, const char *file,
+                         const char *value) {
+    char fpath[PATH_MAX];
+    int fd;
+    bool ok;
+    snprintf(fpath, sizeof(fpath), "%s/%s", dir, file);
+    if ((fd = open(fpath, O_WRONLY | O_CLOEXEC)) < 0) {
+        return 0;
+    }
+    ok = write(fd, value, strlen(value)) == (ssize_t)strlen(value);
+    close(fd);
+    return ok;
+}
+
+/* Removes the cgroups of VMs that are gone: rmdir fails on the others. */
+static void cgroup_sweep(const char *base) {
+    char fpath[PATH_MAX * 2];
+    struct dirent *de;
+    DIR *dh = opendir(base);
+    if (!dh) {
+        return;
+    }
+    while ((de = readdir(dh))) {
+        if (de->d_name[0] != '.' && de->d_type == DT_DIR) {
+            snprintf(fpath, sizeof(fpath), "%s/%s", base, de->d_name);
+            rmdir(fpath);
+        }
+    }
+    closedir(dh);
+}
+
+/* Runs in the launcher, right before it starts QEMU. */
+void cgroup_enter(const char *vm_name) {
+    const st_cgroup_limits *lim;
+    char own[PATH_MAX], base[PATH_MAX + 16], dir[PATH_MAX * 2],
+        val[BUFF_AVG], *c;
+    bool ok = 1;
+    if (!cgroup_requested() || !cgroup_direct() ||
+        !cgroup_own(own, sizeof(own))) {
+        return;
+    }
+    DPRINT_S();
+    lim = cgroup_limits();
+    snprintf(base, sizeof(base), "%s/qemu-run", own);
+    mkdir(base, 0755);
+    for (int i = 0; i < 2; i++) { // Each on its own, io may be missing.
+        const char *parent = i ? base : own;
+        cgroup_write(parent, "cgroup.subtree_control", "+cpu");
+        cgroup_write(parent, "cgroup.subtree_control", "+memory");
+        cgroup_write(parent, "cgroup.subtree_control", "+io");
+    }
+    cgroup_sweep(base);
+    snprintf(dir, sizeof(dir), "%s/%s", base, vm_name[0] ? vm_name : "vm");
+    for (c = dir + strlen(base) + 1; *c; c++) {
+        *c = *c == '/' ? '-' : *c; // A nested VM name is still one cgroup.
+    }
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        printf("qemu-run: Cannot create the cgroup %s\n", dir);
+        fatal(ERR_CGROUP);
+    }
+    if (lim->cpu_quota) {
+        snprintf(val, sizeof(val), "%lld %d", lim->cpu_quota, CGROUP_PERIOD);
+        ok = ok && cgroup_write(dir, "cpu.max", val);
+    }
+    if (cfg[KEY_CGROUP_MEM_MAX].num) {
+        snprintf(val, sizeof(val), "%lld", cfg[KEY_CGROUP_MEM_MAX].num);
+        ok = ok && cgroup_write(dir, "memory.max", val);
+    }
+    if (lim->weight) {
+        snprintf(val, sizeof(val), "%lld", lim->weight);
+        ok = ok && cgroup_write(dir, "cpu.weight", val);
+        snprintf(val, sizeof(val), "default %lld", lim->weight);
+        ok = ok && cgroup_write(dir, "io.weight", val);
+    }
+    for (int i = 0; i < lim->dev_count; i++) {
+        int len = snprintf(val, sizeof(val), "%u:%u", lim->devs[i][0],
+                           lim->devs[i][1]);
+        for (int k = 0; k < 4; k++) {
+            if (lim->io[k]) {
+                len += snprintf(val + len, sizeof(val) - len, " %s=%lld",
+                                cgroup_io_keys[k], lim->io[k]);
+            }
+        }
+        ok = ok && cgroup_write(dir, "io.max", val);
+    }
+    if (!ok || !cgroup_write(dir, "cgroup.procs", "0")) {
+        printf("qemu-run: Cannot set the limits of the cgroup %s, are the "
+               "cpu, memory and io controllers available?\n",
+               dir);
+        fatal(ERR_CGROUP);
+    }
+}
+
+/* Without direct access to cgroups, starts QEMU through systemd-run in a
+ * transient scope; runs before the QEMU binary is pushed. */
+void program_build_cgroup(st_argv *out_args) {
+    const st_cgroup_limits *lim;
+    char val[BUFF_AVG], found[PATH_MAX];
+    static const char *io_props[] = {"IOReadIOPSMax=", "IOWriteIOPSMax=",
+                                     "IOReadBandwidthMax=",
+                                     "IOWriteBandwidthMax="};
+    if (!cgroup_requested()) {
+        return;
+    }
+    DPRINT_S();
+    lim = cgroup_limits(); // Also checks the keys before launch.
+    if (cgroup_direct()) {
+        return;
+    }
+    if (!get_binary_full_path("systemd-run", found, NULL)) {
+        puts("qemu-run: The cgroup_* keys need root or systemd-run");
+        fatal(ERR_CGROUP);
+    }
+    argv_push(out_args, "systemd-run");
+    if (getuid() != 0) {
+        argv_push(out_args, "--user");
+    }
+    argv_push(out_args, "--scope");
+    argv_push(out_args, "--quiet");
+    argv_push(out_args, "--collect");
+    if (lim->cpu_quota) {
+        snprintf(val, sizeof(val), "CPUQuota=%lld%%",
+                 lim->cpu_quota * 100 / CGROUP_PERIOD);
+        argv_push(out_args, "-p");
+        argv_push(out_args, val);
+    }
+    if (cfg[KEY_CGROUP_MEM_MAX].num) {
+        snprintf(val, sizeof(val), "MemoryMax=%lld",
+                 cfg[KEY_CGROUP_MEM_MAX].num);
+        argv_push(out_args, "-p");
+        argv_push(out_args, val);
+    }
+    if (lim->weight) {
+        snprintf(val, sizeof(val), "%lld", lim->weight);
+        argv_push(out_args, "-p");
+        argv_pushx(out_args, "CPUWeight=", val, NULL);
+        argv_push(out_args, "-p");
+        argv_pushx(out_args, "IOWeight=", val, NULL);
+    }
+    for (int i = 0; i < lim->dev_count; i++) {
+        for (int k = 0; k < 4; k++) {
+            if (lim->io[k]) {
+                snprintf(val, sizeof(val), "/dev/block/%u:%u %lld",
+                         lim->devs[i][0], lim->devs[i][1], lim->io[k]);
+                argv_push(out_args, "-p");
+                argv_pushx(out_args, io_props[k], val, NULL);
+            }
+        }
+    }
+    argv_push(out_args, "--");
+}
@@ -0,0 +1,622 @@
+/* Daemon mode: qemu-run --daemon keeps running and starts, stops and
+ * tracks VMs on request, over DAEMON_SOCKET in the runtime folder
+ * ($XDG_RUNTIME_DIR/qemu-run). A request is one line, its reply one JSON
+ * document, and then the connection is closed:
+ *
+ *     start <vm>  {"name": "vm", "state": "running", "pid": 1234, ...}
+ *     stop <vm>   {"name": "vm", "state": "stopping", ...}
+ *     status      [{"name": "vm", "state": "running", ...}, ...]
+ *
+ * Failed requests reply {"error": "..."}. qemu-run <vm> --start, qemu-run
+ * <vm> --stop and qemu-run --status send them; plain qemu-run <vm> still
+ * runs the VM itself, in its own environment.
+ *
+ * Where each VM lives and its config file are kept in memory, and inotify
+ * on the QEMURUN_VM_PATH roots and on the VM folders tells when to look
+ * them up or read them again, so a start is a fork(). The VM runs in that
+ * child, in a session of its own, as qemu-run <vm> would run it, with its
+ * output in DAEMON_LOG in the VM folder. One epoll loop serves requests,
+ * inotify, and the children exiting (through a signalfd).
+ *
+ * restart=on-failure starts a VM again when it exits with an error,
+ * restart=always whenever it exits without being stopped; it waits 1 s,
+ * then twice as long after every new exit, up to a minute, and gives up
+ * after restart_max= tries in a row. A VM that stayed up for
+ * DAEMON_STABLE_MS starts counting again from zero.
+ *
+ * Stopping the daemon leaves its VMs running. */
+
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+
+#define DAEMON_SOCKET "daemon.sock"
+#define DAEMON_LOG "qemu-run.log"
+#define DAEMON_START_MS 10000
+#define DAEMON_STABLE_MS 60000
+#define DAEMON_BACKOFF_MAX_MS 60000
+#define DAEMON_MAX_ROOTS 64
+
+enum {
+    DAEMON_STOPPED,
+    DAEMON_RUNNING,
+    DAEMON_STOPPING,
+    DAEMON_RESTARTING,
+    DAEMON_FAILED
+};
+
+static const char *daemon_states[] = {"stopped", "running", "stopping",
+                                      "restarting", "failed"};
+
+enum { RESTART_NO, RESTART_ON_FAILURE, RESTART_ALWAYS };
+
+typedef struct {
+    char *name, dir[PATH_MAX], cfg_file[BUFF_AVG], *cfg_buf;
+    size_t cfg_cap;
+    bool resolved, cfg_loaded;
+    int wd, state, status, restart, restart_max, restarts;
+    pid_t pid;
+    double started, restart_at;
+} st_daemon_vm;
+
+typedef struct {
+    st_daemon_vm *vms;
+    int count, cap;
+    int epoll_fd, listen_fd, inotify_fd, signal_fd;
+    int client_fd; // The request being served, -1 between requests.
+    int root_wds[DAEMON_MAX_ROOTS], nroots;
+    sigset_t old_mask;
+    st_config defaults[KEY_ENDLIST];
+} st_daemon;
+
+static bool daemon_socket_path(char *out, size_t size) {
+    if (!runtime_dir(out, size)) {
+        return 0;
+    }
+    snprintf(out + strlen(out), size - strlen(out), "/" DAEMON_SOCKET);
+    return 1;
+}
+
+static st_daemon_vm *daemon_vm(st_daemon *d, const char *name) {
+    for (int i = 0; i < d->count; i++) {
+        if (strcmp(d->vms[i].name, name) == 0) {
+            return &d->vms[i];
+        }
+    }
+    if (d->count == d->cap) {
+        d->cap = d->cap ? d->cap * 2 : 16;
+        if (!(d->vms = realloc(d->vms, d->cap * sizeof(st_daemon_vm)))) {
+            fatal(ERR_MEM);
+        }
+    }
+    memset(&d->vms[d->count], 0, sizeof(st_daemon_vm));
+    d->vms[d->count].name = l_str_dup(name);
+    d->vms[d->count].wd = -1;
+    return &d->vms[d->count++];
+}
+
+/* Finds the VM folder and config file, through the VM index, and watches
+ * the folder for config changes. */
+static bool daemon_resolve(st_daemon *d, st_daemon_vm *vm) {
+    static const char *cfg_files[] = {"config", "config.ini"};
+    char fpath[PATH_MAX + BUFF_AVG];
+    bool found = 0;
+    if (vm->resolved) {
+        return 1;
+    }
+    if (!vmindex_lookup(vm->name, vm->dir, sizeof(vm->dir), vm->cfg_file,
+                        sizeof(vm->cfg_file), &found) ||
+        !found) {
+        return 0;
+    }
+    snprintf(fpath, sizeof(fpath), "%s/%s", vm->dir, vm->cfg_file);
+    for (size_t i = 0; !filetype(fpath, FT_FILE) && i < 2; i++) {
+        strcpy(vm->cfg_file, cfg_files[i]);
+        snprintf(fpath, sizeof(fpath), "%s/%s", vm->dir, vm->cfg_file);
+    }
+    if (!filetype(fpath, FT_FILE)) {
+        return 0;
+    }
+    vm->wd = inotify_add_watch(d->inotify_fd, vm->dir,
+                               IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE |
+                                   IN_DELETE | IN_DELETE_SELF |
+                                   IN_MOVE_SELF);
+    vm->resolved = 1;
+    vm->cfg_loaded = 0;
+    return 1;
+}
+
+/* Reads the config into the VM's buffer, and its restart policy. */
+static bool daemon_load_config(st_daemon *d, st_daemon_vm *vm) {
+    char fpath[PATH_MAX + BUFF_AVG], *copy;
+    const char *policy;
+    if (vm->cfg_loaded) {
+        return 1;
+    }
+    snprintf(fpath, sizeof(fpath), "%s/%s", vm->dir, vm->cfg_file);
+    if (!read_file(fpath, &vm->cfg_buf, &vm->cfg_cap)) {
+        return 0;
+    }
+    copy = l_str_dup(vm->cfg_buf); // Parsing splits it in place.
+    program_parse_config(copy, fpath, 0);
+    policy = cfg[KEY_RESTART].val;
+    vm->restart = strcmp(policy, "always") == 0       ? RESTART_ALWAYS
+                  : strcmp(policy, "on-failure") == 0 ? RESTART_ON_FAILURE
+                                                      : RESTART_NO;
+    if (vm->restart == RESTART_NO && strcmp(policy, "no") != 0) {
+        printf("[daemon] %s: restart=%s is not no, on-failure or always\n",
+               vm->name, policy);
+    }
+    vm->restart_max = (int)cfg[KEY_RESTART_MAX].num;
+    memcpy(cfg, d->defaults, sizeof(cfg));
+    free(copy);
+    vm->cfg_loaded = 1;
+    return 1;
+}
+
+/* Runs in the forked child: the same steps as qemu-run <vm>, from the
+ * config already in memory. Says "B" on rep_fd once the command line is
+ * built, or "E<errno>" if QEMU is not found; EOF means it runs. rep_fd is
+ * closed before the helpers fork, as they do not exec to drop it, so an
+ * exec that fails after that shows up as an exit of 127. */
+static void daemon_child(st_daemon *d, st_daemon_vm *vm, int rep_fd) {
+    st_argv args = {0};
+    int fd;
+    sigprocmask(SIG_SETMASK, &d->old_mask, NULL);
+    signal(SIGPIPE, SIG_DFL);
+    setsid();
+    close(d->listen_fd);
+    close(d->epoll_fd);
+    close(d->inotify_fd);
+    close(d->signal_fd);
+    if (d->client_fd >= 0) { // A supervisor does not exec to drop it.
+        close(d->client_fd);
+    }
+    if (chdir(vm->dir) != 0) {
+        _exit(1);
+    }
+    if ((fd = open(DAEMON_LOG, O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0) {
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+        close(fd);
+    }
+    if ((fd = open("/dev/null", O_RDONLY)) >= 0) {
+        dup2(fd, STDIN_FILENO);
+        close(fd);
+    }
+    program_set_default_cfg_values();
+    program_parse_config(vm->cfg_buf, vm->cfg_file, 0);
+    program_build_cmd_line(vm->name, &args);
+    program_build_restore(&args);
+    if (write(rep_fd, "B", 1) != 1) {
+        _exit(1);
+    }
+    // Not args.v[0], which is systemd-run when QEMU runs in a scope.
+    if (!get_binary_full_path((char *)qemu_binary(), NULL, NULL)) {
+        dprintf(rep_fd, "E%d", ENOENT);
+        _exit(127);
+    }
+    close(rep_fd);
+    ports_write();
+    cgroup_enter(vm->name);
+    prefetch_start();
+    puts("QEMU Command line arguments:");
+    argv_print(stdout, &args, 0);
+    fflush(stdout);
+    if (program_needs_supervisor()) {
+        _exit(program_run_supervised(&args));
+    }
+    execvp(args.v[0], args.v);
+    _exit(127);
+}
+
+/* Forks the VM and waits until it runs or fails. Returns 0 with the
+ * reason in err if it does not start. */
+static bool daemon_start(st_daemon *d, st_daemon_vm *vm, char *err,
+                         size_t err_size) {
+    char rep[32] = {0};
+    size_t len = 0;
+    bool building = 0;
+    int fds[2];
+    if (vm->state == DAEMON_RUNNING || vm->state == DAEMON_STOPPING) {
+        snprintf(err, err_size, "already %s", daemon_states[vm->state]);
+        return 0;
+    }
+    if (!daemon_resolve(d, vm)) {
+        snprintf(err, err_size, "no such VM, or it has no config file");
+        return 0;
+    }
+    if (!daemon_load_config(d, vm)) {
+        snprintf(err, err_size, "cannot read %s/%s", vm->dir, vm->cfg_file);
+        return 0;
+    }
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        snprintf(err, err_size, "%s", strerror(errno));
+        return 0;
+    }
+    fflush(stdout);
+    if ((vm->pid = fork()) < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        snprintf(err, err_size, "%s", strerror(errno));
+        vm->pid = 0;
+        return 0;
+    }
+    if (vm->pid == 0) {
+        close(fds[0]);
+        daemon_child(d, vm, fds[1]);
+    }
+    close(fds[1]);
+    vm->started = now_ms();
+    for (ssize_t r = 1; r > 0 && len < sizeof(rep) - 1;) {
+        struct pollfd pfd = {.fd = fds[0], .events = POLLIN};
+        if (poll(&pfd, 1, DAEMON_START_MS) <= 0) {
+            building = !len; // Still at it after that long: let it be.
+            break;
+        }
+        if ((r = read(fds[0], rep + len, sizeof(rep) - 1 - len)) > 0) {
+            len += r;
+        }
+    }
+    close(fds[0]);
+    if (!building && (rep[0] != 'B' || rep[1] == 'E')) {
+        vm->state = DAEMON_FAILED; // Reaped, not restarted.
+        snprintf(err, err_size, "%s, see %s/" DAEMON_LOG,
+                 rep[1] == 'E' ? strerror(atoi(rep + 2))
+                               : "invalid configuration",
+                 vm->dir);
+        return 0;
+    }
+    vm->state = DAEMON_RUNNING;
+    printf("[daemon] %s: started, pid %ld\n", vm->name, (long)vm->pid);
+    return 1;
+}
+
+/* QEMU quits on SIGTERM as it does on a QMP quit; the whole session
+ * gets it, the supervisor and its helpers included. */
+static bool daemon_stop(st_daemon_vm *vm, char *err, size_t err_size) {
+    if (vm->state == DAEMON_RESTARTING) {
+        vm->state = DAEMON_STOPPED;
+        return 1;
+    }
+    if (vm->state != DAEMON_RUNNING || vm->pid <= 0) {
+        snprintf(err, err_size, "not running");
+        return 0;
+    }
+    vm->state = DAEMON_STOPPING;
+    kill(-vm->pid, SIGTERM);
+    printf("[daemon] %s: stopping\n", vm->name);
+    return 1;
+}
+
+static void daemon_reap(st_daemon *d) {
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (int i = 0; i < d->count; i++) {
+            st_daemon_vm *vm = &d->vms[i];
+            double now = now_ms(), delay;
+            if (vm->pid != pid) {
+                continue;
+            }
+            vm->pid = 0;
+            vm->status = WIFEXITED(status) ? WEXITSTATUS(status)
+                                           : 128 + WTERMSIG(status);
+            if (vm->state == DAEMON_STOPPING) {
+                vm->state = DAEMON_STOPPED;
+            }
+            if (vm->state != DAEMON_RUNNING) {
+                break;
+            }
+            if (now - vm->started >= DAEMON_STABLE_MS) {
+                vm->restarts = 0;
+            }
+            if ((vm->restart == RESTART_ALWAYS ||
+                 (vm->restart == RESTART_ON_FAILURE && vm->status != 0)) &&
+                vm->restarts < vm->restart_max) {
+                delay = vm->restarts < 6 ? 1000 << vm->restarts
+                                         : DAEMON_BACKOFF_MAX_MS;
+                delay = delay < DAEMON_BACKOFF_MAX_MS ? delay
+                                                      : DAEMON_BACKOFF_MAX_MS;
+                vm->restarts++;
+                vm->restart_at = now + delay;
+                vm->state = DAEMON_RESTARTING;
+                printf("[daemon] %s: exited with status %d, restarting in "
+                       "%.0f s\n",
+                       vm->name, vm->status, delay / 1000);
+            } else {
+                vm->state = vm->status ? DAEMON_FAILED : DAEMON_STOPPED;
+                printf("[daemon] %s: exited with status %d\n", vm->name,
+                       vm->status);
+            }
+            break;
+        }
+    }
+}
+
+/* Drains the signalfd. Returns 1 on SIGINT or SIGTERM. */
+static bool daemon_signals(st_daemon *d) {
+    struct signalfd_siginfo info;
+    bool quit = 0;
+    while (read(d->signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        quit |= info.ssi_signo != SIGCHLD;
+    }
+    daemon_reap(d);
+    return quit;
+}
+
+/* A VM folder coming or going under a root may change any lookup, and a
+ * write in a VM folder may be its config. */
+static void daemon_inotify(st_daemon *d) {
+    char buf[BUFF_MAX] __attribute__((aligned(8)));
+    ssize_t len;
+    while ((len = read(d->inotify_fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + len;) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            bool root = 0;
+            for (int i = 0; i < d->nroots; i++) {
+                root |= ev->wd == d->root_wds[i];
+            }
+            for (int i = 0; i < d->count; i++) {
+                st_daemon_vm *vm = &d->vms[i];
+                if (root || (ev->wd == vm->wd &&
+                             ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF |
+                                         IN_IGNORED))) {
+                    if (vm->wd >= 0 && !(ev->mask & IN_IGNORED)) {
+                        inotify_rm_watch(d->inotify_fd, vm->wd);
+                    }
+                    vm->wd = -1;
+                    vm->resolved = vm->cfg_loaded = 0;
+                } else if (ev->wd == vm->wd && ev->len &&
+                           strcmp(ev->name, vm->cfg_file) == 0) {
+                    vm->cfg_loaded = 0;
+                    if (ev->mask & (IN_DELETE | IN_CREATE | IN_MOVED_TO)) {
+                        vm->resolved = 0; // config may now be config.ini
+                    }
+                }
+            }
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+}
+
+static void daemon_print_vm(FILE *fh, const st_daemon_vm *vm) {
+    fputs("{\"name\": ", fh);
+    json_print_str(fh, vm->name);
+    fprintf(fh, ", \"state\": \"%s\"", daemon_states[vm->state]);
+    if (vm->resolved) {
+        fputs(", \"dir\": ", fh);
+        json_print_str(fh, vm->dir);
+    }
+    if (vm->pid > 0) {
+        fprintf(fh, ", \"pid\": %ld, \"uptime_s\": %.1f", (long)vm->pid,
+                (now_ms() - vm->started) / 1000);
+    } else if (vm->state != DAEMON_FAILED || vm->status) {
+        fprintf(fh, ", \"exit_status\": %d", vm->status);
+    }
+    fprintf(fh, ", \"restarts\": %d}", vm->restarts);
+}
+
+/* Answers one request. The reply is short, so a client that does not
+ * read it only holds the daemon up for the send timeout. */
+static void daemon_serve(st_daemon *d) {
+    struct timeval timeout = {.tv_sec = 1};
+    char line[BUFF_AVG * 2] = {0}, err[PATH_MAX * 2] = "", *name;
+    size_t len = 0;
+    st_daemon_vm *vm = NULL;
+    double t = now_ms();
+    bool ok = 0;
+    FILE *fh;
+    int fd = accept4(d->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    while (len < sizeof(line) - 1 && !strchr(line, '\n')) {
+        ssize_t r = read(fd, line + len, sizeof(line) - 1 - len);
+        if (r <= 0) {
+            break;
+        }
+        len += r;
+    }
+    line[strcspn(line, "\r\n")] = '\0';
+    if (!(fh = fdopen(fd, "w"))) {
+        close(fd);
+        return;
+    }
+    d->client_fd = fd;
+    name = strchr(line, ' ');
+    if (name && (!name[1] || strchr(name + 1, '/') ||
+                 strlen(name + 1) >= BUFF_AVG)) {
+        snprintf(err, sizeof(err), "invalid VM name");
+    } else if (strcmp(line, "status") == 0) {
+        fputs("[", fh);
+        for (int i = 0; i < d->count; i++) {
+            fputs(i ? ",\n " : "", fh);
+            daemon_print_vm(fh, &d->vms[i]);
+        }
+        fputs("]\n", fh);
+        d->client_fd = -1;
+        fclose(fh);
+        return;
+    } else if (name && strncmp(line, "start ", 6) == 0) {
+        vm = daemon_vm(d, name + 1);
+        vm->restarts = 0;
+        ok = daemon_start(d, vm, err, sizeof(err));
+    } else if (name && strncmp(line, "stop ", 5) == 0) {
+        vm = daemon_vm(d, name + 1);
+        ok = daemon_stop(vm, err, sizeof(err));
+    } else {
+        snprintf(err, sizeof(err), "unknown request, expected start <vm>, "
+                                   "stop <vm> or status");
+    }
+    if (ok) {
+        daemon_print_vm(fh, vm);
+        fputs("\n", fh);
+    } else {
+        fputs("{\"error\": ", fh);
+        json_print_str(fh, err);
+        fputs("}\n", fh);
+    }
+    if (vm) {
+        printf("[daemon] %s %s: %s (%.1f ms)\n", line, ok ? "done" : "failed",
+               ok ? daemon_states[vm->state] : err, now_ms() - t);
+    }
+    if (vm && vm == &d->vms[d->count - 1] && !vm->resolved && !vm->pid) {
+        free(vm->name); // Not a VM: forget it.
+        free(vm->cfg_buf);
+        d->count--;
+    }
+    d->client_fd = -1;
+    fclose(fh);
+}
+
+static int daemon_listen(void) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    char fpath[PATH_MAX];
+    int fd;
+    if (!daemon_socket_path(fpath, sizeof(fpath)) ||
+        strlen(fpath) >= sizeof(addr.sun_path)) {
+        fatal(ERR_DAEMON);
+    }
+    strcpy(addr.sun_path, fpath);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        fatal(ERR_DAEMON);
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        fatal(ERR_DAEMON); // Somebody answers: a daemon is running.
+    }
+    unlink(fpath); // Left over by one that did not exit cleanly.
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(fd, 64) != 0) {
+        printf("qemu-run: Cannot listen on %s: %s\n", fpath, strerror(errno));
+        fatal(ERR_DAEMON);
+    }
+    printf("[daemon] Listening on %s\n", fpath);
+    return fd;
+}
+
+static void daemon_watch_roots(st_daemon *d) {
+    st_vmindex ix;
+    if (!vmindex_open(&ix, 1)) {
+        fatal(ERR_INDEX);
+    }
+    for (uint32_t i = 0; i < ix.hdr->nroots && d->nroots < DAEMON_MAX_ROOTS;
+         i++) {
+        int wd = inotify_add_watch(d->inotify_fd, ix.str + ix.roots[i].path_off,
+                                   IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                                       IN_MOVED_TO | IN_ONLYDIR);
+        if (wd >= 0) {
+            d->root_wds[d->nroots++] = wd;
+        }
+    }
+    vmindex_close(&ix);
+}
+
+static void daemon_add(st_daemon *d, int fd) {
+    struct epoll_event ev = {.events = EPOLLIN, .data.fd = fd};
+    if (fd < 0 || epoll_ctl(d->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        fatal(ERR_DAEMON);
+    }
+}
+
+int program_run_daemon(void) {
+    static st_daemon d;
+    struct epoll_event evs[8];
+    char fpath[PATH_MAX];
+    int running = 0;
+    sigset_t mask;
+    DPRINT_S();
+    memcpy(d.defaults, cfg, sizeof(cfg));
+    d.client_fd = -1;
+    d.listen_fd = daemon_listen();
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, &d.old_mask);
+    signal(SIGPIPE, SIG_IGN);
+    d.signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    d.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    d.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (d.epoll_fd < 0) {
+        fatal(ERR_DAEMON);
+    }
+    daemon_add(&d, d.listen_fd);
+    daemon_add(&d, d.signal_fd);
+    daemon_add(&d, d.inotify_fd);
+    daemon_watch_roots(&d);
+    fflush(stdout);
+    for (bool quit = 0; !quit;) {
+        double now = now_ms(), next = -1;
+        int n;
+        for (int i = 0; i < d.count; i++) {
+            st_daemon_vm *vm = &d.vms[i];
+            char err[PATH_MAX * 2];
+            if (vm->state != DAEMON_RESTARTING) {
+                continue;
+            }
+            if (vm->restart_at <= now) {
+                vm->state = DAEMON_STOPPED;
+                if (!daemon_start(&d, vm, err, sizeof(err))) {
+                    printf("[daemon] %s: cannot restart: %s\n", vm->name,
+                           err);
+                }
+            } else if (next < 0 || vm->restart_at < next) {
+                next = vm->restart_at;
+            }
+        }
+        fflush(stdout);
+        n = epoll_wait(d.epoll_fd, evs, 8,
+                       next < 0 ? -1 : (int)(next - now) + 1);
+        for (int i = 0; i < n; i++) {
+            if (evs[i].data.fd == d.listen_fd) {
+                daemon_serve(&d);
+            } else if (evs[i].data.fd == d.inotify_fd) {
+                daemon_inotify(&d);
+            } else {
+                quit |= daemon_signals(&d);
+            }
+        }
+    }
+    if (daemon_socket_path(fpath, sizeof(fpath))) {
+        unlink(fpath);
+    }
+    for (int i = 0; i < d.count; i++) {
+        running += d.vms[i].pid > 0;
+    }
+    printf("[daemon] Stopped, %d VMs left running\n", running);
+    return 0;
+}
+
+/* The client side: sends "<request> [vm]" to the daemon and prints its
+ * reply. Returns -1 if no daemon runs, else 1 if the request failed. */
+int daemon_request(const char *request, const char *vm_name) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    char fpath[PATH_MAX], buf[BUFF_MAX];
+    bool failed = 0, first = 1;
+    ssize_t len;
+    int fd;
+    if (!daemon_socket_path(fpath, sizeof(fpath)) ||
+        strlen(fpath) >= sizeof(addr.sun_path) ||
+        (fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        return -1;
+    }
+    strcpy(addr.sun_path, fpath);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        puts("qemu-run: No daemon is running, start one with --daemon");
+        return -1;
+    }
+    dprintf(fd, "%s%s%s\n", request, vm_name ? " " : "",
+            vm_name ? vm_name : "");
+    shutdown(fd, SHUT_WR);
+    while ((len = read(fd, buf, sizeof(buf))) > 0) {
+        failed |= first && len >= 9 && memcmp(buf, "{\"error\":", 9) == 0;
+        first = 0;
+        fwrite(buf, 1, len, stdout);
+    }
+    close(fd);
+    return failed || first ? 1 : 0;
+}
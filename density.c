@@ -0,0 +1,124 @@
+/* Memory density controller: with mem_density=yes, the supervisor keeps
+ * sizing the guest's balloon (see memory.c) for as long as the VM runs,
+ * so idle guests only hold on to the host RAM they actually use.
+ *
+ * Every DENSITY_INTERVAL_MS it reads the guest's memory stats from its
+ * balloon driver and the host memory pressure, from PSI in
+ * /proc/pressure/memory (or MemAvailable without PSI), and gives the
+ * guest what it uses plus some headroom: a generous one while the host
+ * is fine, a thin one once host tasks stall on memory. Growing happens
+ * at once, shrinking a step per round, so the guest has time to give
+ * pages back. mem= is the ceiling, an eighth of it the floor. Guests
+ * that report no stats (no driver yet, paused) are left alone.
+ * The QMP session only lasts a round, so qemu-run <vm> qmp and --metrics
+ * get through in between. */
+
+#define DENSITY_INTERVAL_MS 5000
+#define DENSITY_PSI_STALL 5.0 // "some avg10", % of time tasks waited on RAM
+
+bool density_requested(void) {
+    return cfg[KEY_MEM_DENSITY].num;
+}
+
+static bool density_host_pressure(void) {
+    long long total = 0, avail = -1, kb;
+    double avg10;
+    char line[BUFF_AVG];
+    FILE *fh = fopen("/proc/pressure/memory", "r");
+    if (fh) {
+        bool stalled = fscanf(fh, "some avg10=%lf", &avg10) == 1 &&
+                       avg10 >= DENSITY_PSI_STALL;
+        fclose(fh);
+        return stalled;
+    }
+    if (!(fh = fopen("/proc/meminfo", "r"))) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), fh)) {
+        if (sscanf(line, "MemTotal: %lld kB", &kb) == 1) {
+            total = kb;
+        } else if (sscanf(line, "MemAvailable: %lld kB", &kb) == 1) {
+            avail = kb;
+        }
+    }
+    fclose(fh);
+    return avail >= 0 && avail < total / 10;
+}
+
+/* The guest RAM to leave, for a guest with actual bytes using used. */
+static long long density_target(long long actual, long long used,
+                                bool pressure) {
+    long long mem = cfg[KEY_MEM].num,
+              headroom = pressure ? mem / 16 : mem / 4,
+              target;
+    if (headroom < (pressure ? 128 : 256) << 20) {
+        headroom = (pressure ? 128LL : 256LL) << 20;
+    }
+    target = used + headroom;
+    if (target < actual - mem / 8) {
+        target = actual - mem / 8;
+    }
+    if (target < mem / 8) {
+        target = mem / 8;
+    }
+    return target < mem ? target : mem;
+}
+
+/* One QMP session: turns the guest stats on if needed, then resizes. */
+static void density_round(pid_t qemu_pid, bool *polling) {
+    st_qmp q;
+    char args[BUFF_AVG], *reply;
+    const char *ret;
+    long long actual = 0, avail = -1, target,
+              mem = cfg[KEY_MEM].num;
+    if (!qmp_connect(&q, QMP_SOCKET, qemu_pid, 2000)) {
+        return; // Someone else holds the QMP session, try next round.
+    }
+    if (!*polling) {
+        snprintf(args, sizeof(args),
+                 "{\"path\": \"/machine/peripheral/" DENSITY_BALLOON "\", "
+                 "\"property\": \"guest-stats-polling-interval\", "
+                 "\"value\": %d}",
+                 DENSITY_INTERVAL_MS / 1000);
+        reply = qmp_execute(&q, "qom-set", args, 5000);
+        *polling = reply && json_member(reply, "return");
+    }
+    reply = qmp_execute(&q, "query-balloon", NULL, 5000);
+    if (reply && (ret = json_member(reply, "return"))) {
+        json_int(ret, "actual", &actual);
+    }
+    reply = qmp_execute(&q, "qom-get",
+                        "{\"path\": \"/machine/peripheral/" DENSITY_BALLOON
+                        "\", \"property\": \"guest-stats\"}",
+                        5000);
+    if (reply && (ret = json_member(reply, "return")) &&
+        (ret = json_member(ret, "stats"))) {
+        json_int(ret, "stat-available-memory", &avail);
+    }
+    if (actual > 0 && avail >= 0 && avail <= actual) {
+        target = density_target(actual, actual - avail,
+                                density_host_pressure());
+        if (target - actual >= mem / 32 || actual - target >= mem / 32) {
+            DPRINT("Balloon %lld MiB -> %lld MiB", actual >> 20,
+                   target >> 20);
+            snprintf(args, sizeof(args), "{\"value\": %lld}", target);
+            qmp_execute(&q, "balloon", args, 5000);
+        }
+    }
+    qmp_close(&q);
+}
+
+/* Runs in the supervisor until QEMU exits. */
+void density_run(pid_t qemu_pid) {
+    bool polling = 0;
+    DPRINT_S();
+    while (!pid_exited(qemu_pid)) {
+        density_round(qemu_pid, &polling);
+        for (int i = 0; i < DENSITY_INTERVAL_MS / 100; i++) {
+            if (pid_exited(qemu_pid)) {
+                return;
+            }
+            usleep(100000);
+        }
+    }
+}
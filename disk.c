@@ -0,0 +1,451 @@
+/* Hard disks: the classic "-drive index=N,file=...", or, once any of the
+ * disk_cache=, disk_aio=, disk_queues=, disk_iothread=, disk_iops= or
+ * disk_bps= keys is set, a -blockdev chain plus a virtio-blk-pci device,
+ * optionally served by its own iothread with one queue per vCPU, and by
+ * io_uring unless disk_aio= says otherwise, where QEMU and the host have it.
+ * disk_iops= and disk_bps= cap a disk's total operations and bytes per
+ * second through a QEMU throttle group of its own (0 for no cap).
+ *
+ * Those keys are ';' separated lists matching the disk= list; a shorter
+ * list repeats its last item, so "disk_aio=native" covers every disk.
+ *
+ * Either way every image's format is passed on, so QEMU probes nothing.
+ * The file name decides it (.raw and .iso are raw, .qcow2, .vmdk, .vdi,
+ * .vhd and .vhdx what they say). Other images, .img ones included, are
+ * told by their header once, and the answer kept in DISK_FORMATS_FILE in
+ * the VM folder: a guest can write anything at the start of a raw disk,
+ * so its header is never trusted again. Backing files get the format
+ * their qcow2 image names. For qcow2 images that includes the backing
+ * files, and an L2 cache big enough to map the whole image: the default
+ * one only covers a few GiB, and random reads past it cost a metadata
+ * read each. */
+
+/* Copies item idx of a ';' separated config list into out, or its last
+ * item if the list is shorter, "" for an empty list. */
+void cfg_list_item(int key, int idx, char *out, size_t size) {
+    const char *item = cfg[key].val, *next;
+    while (idx-- > 0 && (next = strchr(item, ';')) && next[1]) {
+        item = next + 1;
+    }
+    snprintf(out, size, "%.*s", (int)strcspn(item, ";"), item);
+}
+
+bool disk_tuned(void) {
+    return cfg[KEY_DISK_CACHE].val[0] || cfg[KEY_DISK_AIO].val[0] ||
+           cfg[KEY_DISK_QUEUES].val[0] || cfg[KEY_DISK_IOTHREAD].val[0] ||
+           cfg[KEY_DISK_IOPS].val[0] || cfg[KEY_DISK_BPS].val[0];
+}
+
+/* Whether QEMU was built with io_uring and the host lets us use it. */
+static bool disk_io_uring(void) {
+#ifdef __linux__
+    char val[8] = "0";
+    FILE *fh;
+    if (!qemu_has(CAP_IO_URING)) {
+        return 0;
+    }
+    if ((fh = fopen("/proc/sys/kernel/io_uring_disabled", "r"))) {
+        if (!fgets(val, sizeof(val), fh)) {
+            val[0] = '0';
+        }
+        fclose(fh);
+    }
+    return val[0] == '0' || (val[0] == '1' && geteuid() == 0);
+#else
+    return 0;
+#endif
+}
+
+#define DISK_MAX_CHAIN 16 // The image and its qcow2 backing files.
+#define DISK_FORMATS_FILE "formats"
+#define DISK_QCOW2_BACKING_FORMAT 0xe2792acaULL // Header extension type.
+
+static const char *disk_formats[] = {"raw", "qcow2", "vmdk",
+                                     "vdi", "vpc", "vhdx"};
+static const struct {
+    const char *ext, *format;
+} disk_exts[] = {{"raw", "raw"},   {"iso", "raw"}, {"qcow2", "qcow2"},
+                 {"vmdk", "vmdk"}, {"vdi", "vdi"}, {"vhd", "vpc"},
+                 {"vhdx", "vhdx"}};
+
+typedef struct {
+    const char *format, *backing_format; // NULL: the header names none.
+    long long size, l2_cache; // l2_cache: bytes to map all of a qcow2.
+    char backing[PATH_MAX];   // "" without, or one qemu-run cannot open.
+} st_disk_image;
+
+/* The entry of disk_formats[] that is len bytes at name, NULL if none. */
+static const char *disk_known_format(const char *name, size_t len) {
+    for (size_t i = 0; i < sizeof(disk_formats) / sizeof(disk_formats[0]);
+         i++) {
+        if (strlen(disk_formats[i]) == len &&
+            strncmp(name, disk_formats[i], len) == 0) {
+            return disk_formats[i];
+        }
+    }
+    return NULL;
+}
+
+static unsigned long long disk_be(const unsigned char *p, int len) {
+    unsigned long long val = 0;
+    for (int i = 0; i < len; i++) {
+        val = val << 8 | p[i];
+    }
+    return val;
+}
+
+/* Reads the qcow2 header: size, the L2 cache that covers all of it, and
+ * the backing file, relative to the image's folder, and its format. */
+static void disk_qcow2(FILE *fh, const char *fpath, st_disk_image *out) {
+    unsigned char hdr[104] = {0}, ext[8];
+    unsigned long long backing_at, backing_len, bits, entry, at = 72, len;
+    const char *slash = strrchr(fpath, '/');
+    char name[PATH_MAX];
+    if (fseek(fh, 0, SEEK_SET) != 0 || fread(hdr, 1, 72, fh) != 72) {
+        return;
+    }
+    if (disk_be(hdr + 4, 4) >= 3) {
+        if (fread(hdr + 72, 1, 32, fh) != 32) {
+            return;
+        }
+        at = disk_be(hdr + 100, 4);
+    }
+    for (int i = 0; i < 64 && fseek(fh, (long)at, SEEK_SET) == 0 &&
+                    fread(ext, 1, 8, fh) == 8 && disk_be(ext, 4);
+         i++) {
+        len = disk_be(ext + 4, 4);
+        if (disk_be(ext, 4) == DISK_QCOW2_BACKING_FORMAT &&
+            len < sizeof(name) && fread(name, 1, len, fh) == len) {
+            out->backing_format = disk_known_format(name, len);
+        }
+        at += 8 + ((len + 7) & ~7ULL);
+    }
+    backing_at = disk_be(hdr + 8, 8);
+    backing_len = disk_be(hdr + 16, 4);
+    bits = disk_be(hdr + 20, 4);
+    out->size = (long long)disk_be(hdr + 24, 8);
+    entry = disk_be(hdr + 72, 8) & (1 << 4) ? 16 : 8; // Extended L2.
+    if (bits >= 9 && bits <= 21 && out->size > 0) {
+        unsigned long long cluster = 1ULL << bits,
+                           map = ((unsigned long long)out->size + cluster -
+                                  1) >> bits;
+        map = (map * entry + cluster - 1) & ~(cluster - 1);
+        out->l2_cache = (long long)(map < 2 * cluster ? 2 * cluster : map);
+    }
+    if (!backing_at || !backing_len || backing_len >= sizeof(name) ||
+        fseek(fh, (long)backing_at, SEEK_SET) != 0 ||
+        fread(name, 1, backing_len, fh) != backing_len) {
+        return;
+    }
+    name[backing_len] = '\0';
+    if (name[0] == '/' || !slash) {
+        snprintf(out->backing, sizeof(out->backing), "%s", name);
+    } else if (snprintf(out->backing, sizeof(out->backing), "%.*s/%s",
+                        (int)(slash - fpath), fpath,
+                        name) >= (int)sizeof(out->backing)) {
+        out->backing[0] = '\0';
+    }
+    if (!filetype(out->backing, FT_FILE)) { // nbd:, json: and the like.
+        out->backing[0] = '\0';
+    }
+}
+
+/* The format the file name gives, NULL if it says nothing. */
+static const char *disk_named_format(const char *fpath) {
+    const char *ext = strrchr(fpath, '.');
+    if (!ext || strchr(ext, '/')) {
+        return NULL;
+    }
+    for (size_t i = 0; i < sizeof(disk_exts) / sizeof(disk_exts[0]); i++) {
+        if (stricmp(ext + 1, disk_exts[i].ext) == 0) {
+            return disk_exts[i].format;
+        }
+    }
+    return NULL;
+}
+
+/* The format kept in DISK_FORMATS_FILE, NULL if there is none. */
+static const char *disk_recorded_format(const char *fpath) {
+    char line[PATH_MAX + 16];
+    const char *format = NULL;
+    FILE *fh = fopen(DISK_FORMATS_FILE, "r");
+    while (fh && !format && fgets(line, sizeof(line), fh)) {
+        size_t len = strcspn(line, " ");
+        line[strcspn(line, "\n")] = '\0';
+        if (line[len] == ' ' && strcmp(line + len + 1, fpath) == 0) {
+            format = disk_known_format(line, len);
+        }
+    }
+    if (fh) {
+        fclose(fh);
+    }
+    return format;
+}
+
+/* Tells the image format by its header. NULL if it cannot be read. */
+static const char *disk_sniff(const char *fpath) {
+    unsigned char hdr[512] = {0};
+    const char *format = "raw";
+    size_t len = 0;
+    FILE *fh = fopen(fpath, "rb");
+    if (!fh) {
+        return NULL;
+    }
+    len = fread(hdr, 1, sizeof(hdr), fh);
+    if (len >= 4 && memcmp(hdr, "QFI\xfb", 4) == 0) {
+        format = "qcow2";
+    } else if (len >= 8 && memcmp(hdr, "vhdxfile", 8) == 0) {
+        format = "vhdx";
+    } else if (len >= 4 && (memcmp(hdr, "KDMV", 4) == 0 ||
+                            memcmp(hdr, "COWD", 4) == 0 ||
+                            memcmp(hdr, "# Disk DescriptorFile", 21) == 0)) {
+        format = "vmdk";
+    } else if (len >= 0x44 && hdr[0x40] == 0x7f && hdr[0x41] == 0x10 &&
+               hdr[0x42] == 0xda && hdr[0x43] == 0xbe) {
+        format = "vdi";
+    } else if (len >= 8 && memcmp(hdr, "conectix", 8) == 0) {
+        format = "vpc"; // Dynamic VHD, the footer copied up front.
+    } else if (fseek(fh, -512, SEEK_END) == 0 && fread(hdr, 1, 8, fh) == 8 &&
+               memcmp(hdr, "conectix", 8) == 0) {
+        format = "vpc"; // Fixed VHD: raw data, then the footer.
+    }
+    fclose(fh);
+    return format;
+}
+
+/* Appends the sniffed format of fpath to DISK_FORMATS_FILE, under an
+ * flock() as launches of the same VM may sniff it at once. Returns the
+ * format on record, the first one written, or NULL if it cannot be. */
+static const char *disk_record_format(const char *fpath, const char *format) {
+    const char *recorded;
+    FILE *fh;
+#ifdef __NIX__
+    int fd = open(DISK_FORMATS_FILE, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+                  0644);
+    if (fd < 0 || flock(fd, LOCK_EX) != 0 || !(fh = fdopen(fd, "a"))) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+#else
+    if (!(fh = fopen(DISK_FORMATS_FILE, "a"))) {
+        return NULL;
+    }
+#endif
+    if (!(recorded = disk_recorded_format(fpath))) {
+        fprintf(fh, "%s %s\n", format, fpath);
+        recorded = format;
+    }
+    return fclose(fh) == 0 ? recorded : NULL;
+}
+
+/* The image format: for a backing file the one its qcow2 image names,
+ * else by file name, then as recorded, then by its header, which is
+ * recorded for the next launches. A qcow2 image gets its header read
+ * for the L2 cache and backing file, unless its sniffed format could not
+ * be recorded. */
+static void disk_image(const char *fpath, const char *format,
+                      st_disk_image *out) {
+    const char *sniffed;
+    unsigned char magic[4];
+    FILE *fh;
+    memset(out, 0, sizeof(st_disk_image));
+    if (!(out->format = format) && !(out->format = disk_named_format(fpath)) &&
+        !(out->format = disk_recorded_format(fpath))) {
+        if (!(sniffed = disk_sniff(fpath))) {
+            out->format = "raw"; // Cannot be read: nothing to record yet.
+            return;
+        }
+        if (!(out->format = disk_record_format(fpath, sniffed))) {
+            out->format = sniffed;
+            return;
+        }
+    }
+    if (strcmp(out->format, "qcow2") == 0 && (fh = fopen(fpath, "rb"))) {
+        if (fread(magic, 1, 4, fh) == 4 && memcmp(magic, "QFI\xfb", 4) == 0) {
+            disk_qcow2(fh, fpath, out);
+        }
+        fclose(fh);
+    }
+}
+
+/* The image and then its backing files, as far as they can be opened. */
+static int disk_chain(const char *fpath, st_disk_image *out) {
+    int n = 0;
+    disk_image(fpath, NULL, &out[n++]);
+    while (out[n - 1].backing[0] && n < DISK_MAX_CHAIN) {
+        disk_image(out[n - 1].backing, out[n - 1].backing_format, &out[n]);
+        n++;
+    }
+    DPRINT("%s: %s, %d image(s) in its chain", fpath, out[0].format, n);
+    return n;
+}
+
+const char *disk_format(const char *fpath) {
+    st_disk_image img;
+    disk_image(fpath, NULL, &img);
+    return img.format;
+}
+
+/* The format of every image in the chain for a -drive, as dotted options:
+ * format=qcow2,l2-cache-size=N,backing.driver=raw and so on. */
+static void disk_drive_chain(st_argv *out_args, const char *fpath) {
+    st_disk_image chain[DISK_MAX_CHAIN];
+    char prefix[DISK_MAX_CHAIN * 8 + 1] = "", num[24];
+    int n = disk_chain(fpath, chain);
+    for (int i = 0; i < n; i++) {
+        argv_catx(out_args, ",", prefix, i ? "driver=" : "format=",
+                  chain[i].format, NULL);
+        if (chain[i].l2_cache) {
+            snprintf(num, sizeof(num), "%lld", chain[i].l2_cache);
+            argv_catx(out_args, ",", prefix, "l2-cache-size=", num, NULL);
+        }
+        strcat(prefix, "backing.");
+    }
+}
+
+void program_build_disk(st_argv *out_args, const char *fpath, int disk_n,
+                        int *drive_index) {
+    char cache[BUFF_AVG], aio[BUFF_AVG], queues[BUFF_AVG], iothread[BUFF_AVG],
+        iops[BUFF_AVG], bps[BUFF_AVG], id[24], num[24];
+    bool direct = 0, no_flush = 0, write_cache = 1;
+    long long use_iothread = 0, iops_max = 0, bps_max = 0;
+    st_disk_image chain[DISK_MAX_CHAIN];
+    int n;
+    if (!disk_tuned()) {
+        l_int_to_str(*drive_index, id);
+        argv_push(out_args, "-drive");
+        if (machine_microvm()) { // No PCI bus for if=virtio to plug into.
+            argv_pushx(out_args, "if=none,id=drive", id, ",file=", NULL);
+            argv_catx_escaped(out_args, fpath);
+            disk_drive_chain(out_args, fpath);
+            argv_push(out_args, "-device");
+            argv_pushx(out_args, "virtio-blk-device,drive=drive", id, NULL);
+        } else {
+            argv_pushx(out_args, "index=", id, ",file=", NULL);
+            argv_catx_escaped(out_args, fpath);
+            disk_drive_chain(out_args, fpath);
+            argv_catx(out_args, cfg[KEY_HDD_VIRTIO].num ? ",if=virtio" : "",
+                      NULL);
+        }
+        (*drive_index)++;
+        return;
+    }
+    cfg_list_item(KEY_DISK_CACHE, disk_n, cache, sizeof(cache));
+    cfg_list_item(KEY_DISK_AIO, disk_n, aio, sizeof(aio));
+    cfg_list_item(KEY_DISK_QUEUES, disk_n, queues, sizeof(queues));
+    cfg_list_item(KEY_DISK_IOTHREAD, disk_n, iothread, sizeof(iothread));
+    cfg_list_item(KEY_DISK_IOPS, disk_n, iops, sizeof(iops));
+    cfg_list_item(KEY_DISK_BPS, disk_n, bps, sizeof(bps));
+    if (!cache[0]) {
+        strcpy(cache, strcmp(aio, "native") == 0 ? "none" : "writeback");
+    }
+    if (strcmp(cache, "none") == 0) {
+        direct = 1;
+    } else if (strcmp(cache, "writethrough") == 0) {
+        write_cache = 0;
+    } else if (strcmp(cache, "directsync") == 0) {
+        direct = 1;
+        write_cache = 0;
+    } else if (strcmp(cache, "unsafe") == 0) {
+        no_flush = 1;
+    } else if (strcmp(cache, "writeback") != 0) {
+        printf("qemu-run: disk_cache=%s is not none, writeback, "
+               "writethrough, directsync or unsafe\n",
+               cache);
+        fatal(ERR_DISK);
+    }
+    if (aio[0] && strcmp(aio, "io_uring") != 0 &&
+        strcmp(aio, "native") != 0 && strcmp(aio, "threads") != 0) {
+        printf("qemu-run: disk_aio=%s is not io_uring, native or threads\n",
+               aio);
+        fatal(ERR_DISK);
+    }
+    if (strcmp(aio, "native") == 0 && !direct) {
+        printf("qemu-run: disk_aio=native needs disk_cache=none or "
+               "directsync\n");
+        fatal(ERR_DISK);
+    }
+    if (strcmp(aio, "io_uring") == 0 && !disk_io_uring()) {
+        printf("qemu-run: Warning: No io_uring in %s or on this host, "
+               "using disk_aio=threads\n",
+               qemu_binary());
+        strcpy(aio, "threads");
+    } else if (!aio[0] && qemu_has(CAP_PROBED) && disk_io_uring()) {
+        strcpy(aio, "io_uring"); // The fastest one there is.
+    }
+    if (!cfg_convert(CFG_BOOL, iothread, &use_iothread)) {
+        printf("qemu-run: disk_iothread=%s is not yes or no\n", iothread);
+        fatal(ERR_DISK);
+    }
+    if ((iops[0] && (!cfg_convert(CFG_INT, iops, &iops_max) ||
+                     iops_max < 0)) ||
+        (bps[0] && (!cfg_convert(CFG_SIZE, bps, &bps_max) || bps_max < 0))) {
+        printf("qemu-run: disk_iops=%s or disk_bps=%s is not a rate\n", iops,
+               bps);
+        fatal(ERR_DISK);
+    }
+    if (!queues[0]) {
+        strcpy(queues, cfg[KEY_CORES].val);
+    }
+    l_int_to_str(disk_n, id);
+    if (use_iothread) {
+        argv_push(out_args, "-object");
+        argv_pushx(out_args, "iothread,id=iothread", id, NULL);
+    }
+    n = disk_chain(fpath, chain);
+    for (int i = n - 1; i >= 0; i--) { // Backing files first, read-only.
+        char node[48], cache_opts[64];
+        snprintf(node, sizeof(node), i ? "%sb%d" : "%s", id, i);
+        snprintf(cache_opts, sizeof(cache_opts), "%s%s%s",
+                 direct ? ",cache.direct=on" : ",cache.direct=off",
+                 no_flush ? ",cache.no-flush=on" : "",
+                 i ? ",read-only=on" : "");
+        argv_push(out_args, "-blockdev");
+        argv_pushx(out_args, "driver=file,node-name=file", node, ",filename=",
+                   NULL);
+        argv_catx_escaped(out_args, i ? chain[i - 1].backing : fpath);
+        argv_catx(out_args, aio[0] ? ",aio=" : "", aio, cache_opts, NULL);
+        argv_push(out_args, "-blockdev");
+        argv_pushx(out_args, "driver=", chain[i].format, ",node-name=disk",
+                   node, ",file=file", node, cache_opts, NULL);
+        if (chain[i].l2_cache) {
+            snprintf(num, sizeof(num), "%lld", chain[i].l2_cache);
+            argv_catx(out_args, ",l2-cache-size=", num, NULL);
+        }
+        if (i + 1 < n) {
+            snprintf(num, sizeof(num), "%db%d", disk_n, i + 1);
+            argv_catx(out_args, ",backing=disk", num, NULL);
+        }
+    }
+    if (iops_max || bps_max) {
+        argv_push(out_args, "-object");
+        argv_pushx(out_args, "throttle-group,id=throttle", id, NULL);
+        if (iops_max) {
+            snprintf(num, sizeof(num), "%lld", iops_max);
+            argv_catx(out_args, ",x-iops-total=", num, NULL);
+        }
+        if (bps_max) {
+            snprintf(num, sizeof(num), "%lld", bps_max);
+            argv_catx(out_args, ",x-bps-total=", num, NULL);
+        }
+        argv_push(out_args, "-blockdev");
+        argv_pushx(out_args, "driver=throttle,node-name=throttled", id,
+                   ",throttle-group=throttle", id, ",file=disk", id, NULL);
+    }
+    argv_push(out_args, "-device");
+    if (cfg[KEY_HDD_VIRTIO].num || machine_microvm()) {
+        argv_pushx(out_args, virtio_dev("virtio-blk-pci"), ",drive=",
+                   iops_max || bps_max ? "throttled" : "disk", id,
+                   ",num-queues=", queues, NULL);
+        if (use_iothread) {
+            argv_catx(out_args, ",iothread=iothread", id, NULL);
+        }
+    } else {
+        argv_pushx(out_args, "ide-hd,drive=",
+                   iops_max || bps_max ? "throttled" : "disk", id, NULL);
+    }
+    argv_catx(out_args, write_cache ? ",write-cache=on" : ",write-cache=off",
+              NULL);
+}
@@ -0,0 +1,171 @@
+/* Ephemeral VMs: qemu-run --ephemeral <template> [--count N]
+ *
+ * Every instance gets its own folder in ephemeral_dir= ($TMPDIR or /tmp
+ * by default, /dev/shm keeps it all in RAM), holding a qcow2 overlay per
+ * template disk, backed by that disk, and the template config resolved
+ * to absolute paths. QEMU runs from that folder, so each instance has its
+ * own qmp.sock; the template disks are never written to. The folder is
+ * removed once QEMU exits. */
+
+static char ephemeral_exit_dir[PATH_MAX];
+static pid_t ephemeral_exit_pid;
+
+/* Turns a path relative to the template folder into an absolute one. */
+static char *ephemeral_abspath(const char *tmpl_dir, const char *fpath) {
+    char *out;
+    if (!fpath[0] || fpath[0] == '/') {
+        return l_str_dup(fpath);
+    }
+    if (!(out = malloc(strlen(tmpl_dir) + strlen(fpath) + 2))) {
+        fatal(ERR_MEM);
+    }
+    sprintf(out, "%s/%s", tmpl_dir, fpath);
+    return out;
+}
+
+static bool ephemeral_overlay(const char *backing, const char *overlay) {
+    char *argv[] = {"qemu-img", "create", "-q", "-f", "qcow2", "-b",
+                    (char *)backing, "-F", (char *)disk_format(backing),
+                    (char *)overlay, NULL};
+    int status;
+    pid_t pid = fork();
+    if (pid == 0) {
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    return pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+           WEXITSTATUS(status) == 0;
+}
+
+static void ephemeral_cleanup(const char *dir) {
+    char fpath[PATH_MAX];
+    struct dirent *de;
+    DIR *dh = opendir(dir);
+    while (dh && (de = readdir(dh))) {
+        if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0) {
+            snprintf(fpath, sizeof(fpath), "%s/%s", dir, de->d_name);
+            unlink(fpath);
+        }
+    }
+    if (dh) {
+        closedir(dh);
+    }
+    rmdir(dir);
+}
+
+/* A fatal() once the instance folder exists leaves through exit(). Forked
+ * helpers that fail to exec do too, and must not take the folder along. */
+static void ephemeral_on_exit(void) {
+    if (ephemeral_exit_pid == getpid()) {
+        ephemeral_cleanup(ephemeral_exit_dir);
+    }
+}
+
+/* Creates the instance folder, overlays and resolved config, and leaves
+ * the config pointing at them. Returns with the instance folder as cwd. */
+static void ephemeral_prepare(const char *tmpl_name, char *out_dir,
+                              char *out_name) {
+    static const int path_keys[] = {KEY_FLOPPY, KEY_CDROM,  KEY_SHARED,
+                                    KEY_KERNEL, KEY_INITRD, KEY_EFI_CODE,
+                                    KEY_EFI_VARS};
+    char tmpl_dir[PATH_MAX], vm_cfg_file[BUFF_AVG], fpath[PATH_MAX + 24];
+    const char *base;
+    char *disks = NULL, *item;
+    size_t disks_len = 0;
+    FILE *fh;
+    program_find_vm_and_chdir(tmpl_name, vm_cfg_file);
+    program_set_default_cfg_values();
+    program_load_config(vm_cfg_file);
+    if (!getcwd(tmpl_dir, sizeof(tmpl_dir))) {
+        fatal(ERR_CHDIR_VM_DIR);
+    }
+    base = cfg[KEY_EPHEMERAL_DIR].val;
+    if (!base[0] && !(base = getenv("TMPDIR"))) {
+        base = "/tmp";
+    }
+    snprintf(out_dir, PATH_MAX, "%s/qemu-run-%s.XXXXXX", base, tmpl_name);
+    if (!mkdtemp(out_dir)) {
+        printf("qemu-run: Cannot create %s: %s\n", out_dir, strerror(errno));
+        fatal(ERR_EPHEMERAL);
+    }
+    snprintf(ephemeral_exit_dir, sizeof(ephemeral_exit_dir), "%s", out_dir);
+    ephemeral_exit_pid = getpid();
+    atexit(ephemeral_on_exit);
+    sprintf(out_name, "%s%s", tmpl_name, strrchr(out_dir, '.'));
+    for (size_t i = 0; i < sizeof(path_keys) / sizeof(path_keys[0]); i++) {
+        int key = path_keys[i];
+        cfg_put(key, ephemeral_abspath(tmpl_dir, cfg[key].val));
+    }
+    ports_make_auto();
+    item = cfg[KEY_DISK].val;
+    for (int n = 0; *item; n++) {
+        size_t len = strcspn(item, ";");
+        char *backing;
+        snprintf(fpath, sizeof(fpath), "%.*s", (int)len, item);
+        backing = ephemeral_abspath(tmpl_dir, fpath);
+        snprintf(fpath, sizeof(fpath), "%s/disk%d.qcow2", out_dir, n);
+        if (filetype(backing, FT_FILE) && !ephemeral_overlay(backing, fpath)) {
+            fatal(ERR_EPHEMERAL);
+        }
+        if (!filetype(backing, FT_FILE)) {
+            fpath[0] = '\0'; // Keep the slot, so disk_* lists still line up.
+        }
+        free(backing);
+        disks = realloc(disks, disks_len + strlen(fpath) + 2);
+        if (!disks) {
+            fatal(ERR_MEM);
+        }
+        disks_len += sprintf(disks + disks_len, "%s%s", n ? ";" : "", fpath);
+        item += len + (item[len] == ';');
+    }
+    cfg_put(KEY_DISK, disks ? disks : "");
+    if (chdir(out_dir) != 0 || !(fh = fopen("config", "w"))) {
+        fatal(ERR_EPHEMERAL);
+    }
+    for (int i = 0; i < KEY_ENDLIST; i++) {
+        fprintf(fh, "%s=%s\n", cfg[i].key, cfg[i].val);
+    }
+    fclose(fh);
+}
+
+/* Runs one instance to completion. Runs in its own process. */
+static int ephemeral_run(const char *tmpl_name) {
+    char dir[PATH_MAX], name[BUFF_AVG * 2];
+    st_argv args = {0};
+    double t = now_ms();
+    int rc;
+    ephemeral_prepare(tmpl_name, dir, name);
+    program_build_cmd_line(name, &args);
+    ports_write();
+#ifdef __linux__
+    cgroup_enter(name);
+#endif
+    printf("[ephemeral] %s: ready in %.1f ms, in %s\n", name, now_ms() - t,
+           dir);
+    fflush(stdout);
+    rc = program_run_supervised(&args);
+    ephemeral_cleanup(dir);
+    printf("[ephemeral] %s: exited with status %d\n", name, rc);
+    fflush(stdout);
+    return rc;
+}
+
+int program_run_ephemeral(const char *tmpl_name, int count) {
+    int status, failed = 0;
+    DPRINT_S();
+    signal(SIGINT, SIG_IGN); // Each instance cleans up after its QEMU.
+    for (int i = 0; i < count; i++) {
+        pid_t pid;
+        fflush(stdout);
+        if ((pid = fork()) < 0) {
+            fatal(ERR_EXEC);
+        }
+        if (pid == 0) {
+            _exit(ephemeral_run(tmpl_name));
+        }
+    }
+    while (wait(&status) > 0) {
+        failed += !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,330 @@
+/* Fleet mode: qemu-run --fleet vm1 vm2 ... | qemu-run --all
+ *
+ * Every VM is resolved by its own forked child (lookup, defaults, config
+ * and argv building all run in parallel), which reports its cores= and
+ * mem= demand back through a pipe and then waits for a go byte. The parent
+ * admits VMs largest-first against the host cores and RAM, so the host is
+ * never oversubscribed, and admits queued VMs as running ones exit. */
+
+enum {
+    FLEET_RESOLVING,
+    FLEET_WAITING,
+    FLEET_STARTING,
+    FLEET_RUNNING,
+    FLEET_FAILED,
+    FLEET_EXITED
+};
+
+typedef struct {
+    char *name;
+    pid_t pid;
+    int go_fd,  /**< Parent -> child: one byte admits the VM, EOF drops it */
+        rep_fd; /**< Child -> parent: demand, then EOF on exec */
+    int state, status, cores;
+    unsigned long long mem_mb;
+    double t_fork, t_exec;
+    char rep[64];
+    size_t rep_len;
+} st_fleet_vm;
+
+typedef struct {
+    st_fleet_vm *vms;
+    int count, cap;
+    int free_cores;
+    unsigned long long free_mem_mb;
+} st_fleet;
+
+static void fleet_add(st_fleet *f, const char *name) {
+    for (int i = 0; i < f->count; i++) {
+        if (strcmp(f->vms[i].name, name) == 0) {
+            return;
+        }
+    }
+    if (f->count == f->cap) {
+        f->cap = f->cap ? f->cap * 2 : 16;
+        f->vms = realloc(f->vms, f->cap * sizeof(st_fleet_vm));
+        if (!f->vms) {
+            fatal(ERR_MEM);
+        }
+    }
+    memset(&f->vms[f->count], 0, sizeof(st_fleet_vm));
+    f->vms[f->count].name = l_str_dup(name);
+    f->vms[f->count].go_fd = f->vms[f->count].rep_fd = -1;
+    f->count++;
+}
+
+/* Collects every VM that has a config file, through the VM index.
+ * Earlier roots win, just like a normal lookup. */
+static void fleet_add_all(st_fleet *f) {
+    st_vmindex ix;
+    if (!vmindex_open(&ix, 1)) {
+        fatal(ERR_INDEX);
+    }
+    for (uint32_t i = 0; i < ix.hdr->nslots; i++) {
+        if (ix.slots[i].name_off && ix.slots[i].cfg_off) {
+            fleet_add(f, ix.str + ix.slots[i].name_off);
+        }
+    }
+    vmindex_close(&ix);
+}
+
+/* Runs in the forked child: resolve, report the demand, wait to be
+ * admitted and exec. Any fatal() simply closes the report pipe early. */
+static void fleet_child(st_fleet_vm *vm) {
+    char vm_cfg_file[BUFF_AVG], go = 0;
+    st_argv args = {0};
+    program_find_vm_and_chdir(vm->name, vm_cfg_file);
+    program_set_default_cfg_values();
+    program_load_config(vm_cfg_file);
+    program_build_cmd_line(vm->name, &args);
+    program_build_restore(&args);
+    dprintf(vm->rep_fd, "%d %llu\n", (int)cfg[KEY_CORES].num,
+            (unsigned long long)cfg[KEY_MEM].num >> 20);
+    if (read(vm->go_fd, &go, 1) != 1) {
+        _exit(0); // Never admitted.
+    }
+    close(vm->go_fd);
+    ports_write();
+#ifdef __linux__
+    cgroup_enter(vm->name);
+    prefetch_start();
+#endif
+    if (program_needs_supervisor()) { // EOF on the report pipe: started.
+        close(vm->rep_fd);
+        _exit(program_run_supervised(&args));
+    }
+    execvp(args.v[0], args.v);
+    dprintf(vm->rep_fd, "E%d\n", errno);
+    _exit(127);
+}
+
+static void fleet_spawn(st_fleet *f, st_fleet_vm *vm) {
+    int go[2], rep[2];
+    if (pipe(go) != 0 || pipe(rep) != 0) {
+        fatal(ERR_EXEC);
+    }
+    fflush(stdout);
+    vm->t_fork = now_ms();
+    if ((vm->pid = fork()) < 0) {
+        fatal(ERR_EXEC);
+    }
+    if (vm->pid == 0) {
+        for (int i = 0; i < f->count; i++) {
+            if (f->vms[i].rep_fd >= 0) {
+                close(f->vms[i].rep_fd);
+            }
+            if (f->vms[i].go_fd >= 0) {
+                close(f->vms[i].go_fd);
+            }
+        }
+        close(go[1]);
+        close(rep[0]);
+        fcntl(rep[1], F_SETFD, FD_CLOEXEC);
+        vm->go_fd = go[0];
+        vm->rep_fd = rep[1];
+        fleet_child(vm);
+    }
+    close(go[0]);
+    close(rep[1]);
+    vm->go_fd = go[1];
+    vm->rep_fd = rep[0];
+    vm->state = FLEET_RESOLVING;
+}
+
+static void fleet_fail(st_fleet_vm *vm, const char *why) {
+    printf("[fleet] %s: %s\n", vm->name, why);
+    if (vm->go_fd >= 0) {
+        close(vm->go_fd); // The child exits on EOF.
+        vm->go_fd = -1;
+    }
+    vm->state = FLEET_FAILED;
+}
+
+static void fleet_finish(st_fleet *f, st_fleet_vm *vm) {
+    vm->state = FLEET_EXITED;
+    f->free_cores += vm->cores;
+    f->free_mem_mb += vm->mem_mb;
+    printf("[fleet] %s: exited with status %d\n", vm->name, vm->status);
+}
+
+/* Handles one readable report pipe. Returns 0 once it reached EOF. */
+static bool fleet_read_report(st_fleet *f, st_fleet_vm *vm) {
+    ssize_t r = read(vm->rep_fd, vm->rep + vm->rep_len,
+                     sizeof(vm->rep) - 1 - vm->rep_len);
+    if (r > 0) {
+        vm->rep_len += r;
+        vm->rep[vm->rep_len] = 0;
+        if (vm->state == FLEET_RESOLVING && strchr(vm->rep, '\n')) {
+            sscanf(vm->rep, "%d %llu", &vm->cores, &vm->mem_mb);
+            vm->cores = vm->cores > 0 ? vm->cores : 1;
+            vm->state = FLEET_WAITING;
+            vm->rep_len = 0;
+        }
+        return 1;
+    }
+    close(vm->rep_fd);
+    vm->rep_fd = -1;
+    if (vm->state == FLEET_RESOLVING) {
+        fleet_fail(vm, "cannot resolve VM or its config");
+    } else if (vm->state == FLEET_STARTING && vm->rep_len) {
+        fleet_fail(vm, strerror(atoi(vm->rep + 1)));
+        f->free_cores += vm->cores;
+        f->free_mem_mb += vm->mem_mb;
+    } else if (vm->state == FLEET_STARTING) {
+        vm->t_exec = now_ms();
+        vm->state = FLEET_RUNNING;
+        printf("[fleet] %s: started in %.1f ms (%d cores, %llu MiB)\n",
+               vm->name, vm->t_exec - vm->t_fork, vm->cores, vm->mem_mb);
+        if (!vm->pid) { // Already reaped before its pipe was drained.
+            fleet_finish(f, vm);
+        }
+    }
+    return 0;
+}
+
+static int fleet_cmp_demand(const void *a, const void *b) {
+    const st_fleet_vm *x = *(st_fleet_vm *const *)a,
+                      *y = *(st_fleet_vm *const *)b;
+    if (x->mem_mb != y->mem_mb) {
+        return x->mem_mb < y->mem_mb ? 1 : -1;
+    }
+    return y->cores - x->cores;
+}
+
+/* First fit decreasing over the single host bin: biggest VMs first,
+ * anything that does not fit stays queued until capacity is released. */
+static void fleet_admit(st_fleet *f, int host_cores,
+                        unsigned long long host_mem_mb) {
+    st_fleet_vm **queue = calloc(f->count, sizeof(st_fleet_vm *));
+    int n = 0;
+    if (!queue) {
+        fatal(ERR_MEM);
+    }
+    for (int i = 0; i < f->count; i++) {
+        if (f->vms[i].state == FLEET_RESOLVING) {
+            free(queue);
+            return; // Sort against the complete demand set.
+        }
+        if (f->vms[i].state == FLEET_WAITING) {
+            queue[n++] = &f->vms[i];
+        }
+    }
+    qsort(queue, n, sizeof(st_fleet_vm *), fleet_cmp_demand);
+    for (int i = 0; i < n; i++) {
+        st_fleet_vm *vm = queue[i];
+        if (vm->cores > host_cores || vm->mem_mb > host_mem_mb) {
+            fleet_fail(vm, "does not fit on this host");
+            continue;
+        }
+        if (vm->cores > f->free_cores || vm->mem_mb > f->free_mem_mb) {
+            continue;
+        }
+        f->free_cores -= vm->cores;
+        f->free_mem_mb -= vm->mem_mb;
+        vm->state = FLEET_STARTING;
+        if (write(vm->go_fd, "g", 1) != 1) {
+            fleet_fail(vm, "resolver exited before being admitted");
+            f->free_cores += vm->cores;
+            f->free_mem_mb += vm->mem_mb;
+            continue;
+        }
+        close(vm->go_fd);
+        vm->go_fd = -1;
+    }
+    free(queue);
+}
+
+static void fleet_reap(st_fleet *f) {
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (int i = 0; i < f->count; i++) {
+            st_fleet_vm *vm = &f->vms[i];
+            if (vm->pid != pid) {
+                continue;
+            }
+            vm->pid = 0;
+            vm->status = WIFEXITED(status) ? WEXITSTATUS(status)
+                                           : 128 + WTERMSIG(status);
+            if (vm->state == FLEET_RUNNING) {
+                fleet_finish(f, vm);
+            }
+        }
+    }
+}
+
+int program_run_fleet(char **vm_names, int vm_count, bool all) {
+    st_fleet f = {0};
+    struct pollfd *pfds;
+    st_fleet_vm **pvms;
+    int host_cores, alive, failed = 0;
+    unsigned long long host_mem_mb;
+    DPRINT_S();
+    for (int i = 0; i < vm_count; i++) {
+        fleet_add(&f, vm_names[i]);
+    }
+    if (all) {
+        fleet_add_all(&f);
+    }
+    if (!f.count) {
+        fatal(ERR_ARGS);
+    }
+    host_cores = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    host_mem_mb = (unsigned long long)sysconf(_SC_PHYS_PAGES) *
+                  sysconf(_SC_PAGESIZE) / (1024 * 1024);
+    f.free_cores = host_cores;
+    f.free_mem_mb = host_mem_mb;
+    printf("[fleet] %d VMs, host capacity: %d cores, %llu MiB\n", f.count,
+           host_cores, host_mem_mb);
+    signal(SIGPIPE, SIG_IGN);
+    for (int i = 0; i < f.count; i++) {
+        fleet_spawn(&f, &f.vms[i]);
+    }
+    pfds = calloc(f.count, sizeof(struct pollfd));
+    pvms = calloc(f.count, sizeof(st_fleet_vm *));
+    if (!pfds || !pvms) {
+        fatal(ERR_MEM);
+    }
+    do {
+        int n = 0;
+        fleet_admit(&f, host_cores, host_mem_mb);
+        for (int i = 0; i < f.count; i++) {
+            if (f.vms[i].rep_fd >= 0) {
+                pfds[n].fd = f.vms[i].rep_fd;
+                pfds[n].events = POLLIN;
+                pvms[n++] = &f.vms[i];
+            }
+        }
+        if (poll(pfds, n, n ? 100 : 250) > 0) {
+            for (int i = 0; i < n; i++) {
+                if (pfds[i].revents) {
+                    fleet_read_report(&f, pvms[i]);
+                }
+            }
+        }
+        fleet_reap(&f);
+        alive = 0;
+        for (int i = 0; i < f.count; i++) {
+            alive += f.vms[i].state != FLEET_FAILED &&
+                     f.vms[i].state != FLEET_EXITED;
+        }
+    } while (alive);
+    while (waitpid(-1, NULL, 0) > 0) // Resolvers that were never admitted.
+        ;
+    puts("[fleet] Summary:");
+    for (int i = 0; i < f.count; i++) {
+        st_fleet_vm *vm = &f.vms[i];
+        if (vm->state == FLEET_FAILED) {
+            printf("\t%-24s failed\n", vm->name);
+        } else {
+            printf("\t%-24s start %8.1f ms  exit %d\n", vm->name,
+                   vm->t_exec - vm->t_fork, vm->status);
+        }
+        failed += vm->state == FLEET_FAILED || vm->status != 0;
+        free(vm->name);
+    }
+    free(pvms);
+    free(pfds);
+    free(f.vms);
+    return failed ? 1 : 0;
+}
@@ -24,16 +24,115 @@ char *strupr_a(const char *s) {
     for (int i = 0; p[i] && i < n; i++) {
         p[i] = toupper(p[i]);
     }
-    dynm_i++;
     dynm[dynm_i] = p;
+    dynm_i++;
     return p;
 }
 
+const char *type_names[CFG_ENDLIST] = {"str", "bool", "int", "size", "list"};
+const char *type_enums[CFG_ENDLIST] = {"CFG_STR", "CFG_BOOL", "CFG_INT",
+                                       "CFG_SIZE", "CFG_LIST"};
+
+/* "key:type=" wins, otherwise the type is guessed from the default value. */
+int key_type(char *key, const char *val) {
+    long long num;
+    char *colon = strchr(key, ':');
+    if (colon) {
+        *colon = '\0';
+        for (int t = 0; t < CFG_ENDLIST; t++) {
+            if (strcmp(colon + 1, type_names[t]) == 0) {
+                return t;
+            }
+        }
+        printf("genhashes: Unknown type '%s' for key %s\n", colon + 1, key);
+        exit(1);
+    }
+    if (!val[0]) {
+        return CFG_STR;
+    }
+    if (strcmp(val, "yes") == 0 || strcmp(val, "no") == 0) {
+        return CFG_BOOL;
+    }
+    if (cfg_convert(CFG_INT, val, &num)) {
+        return CFG_INT;
+    }
+    return cfg_convert(CFG_SIZE, val, &num) ? CFG_SIZE : CFG_STR;
+}
+
+/* Builds a minimal perfect hash over the keys (hash and displace): keys
+ * are split into buckets by cfg_hash(key, 0), then every bucket, biggest
+ * first, gets the first seed that sends all its keys to free slots with
+ * cfg_hash(key, seed) % count. A lookup is then two hashes and one compare,
+ * and the slot order is the KEY_* order. */
+void perfect_hash(st_symbols **keys, int count, int buckets,
+                  unsigned int *out_seeds, st_symbols **out_slots) {
+    int *bucket_of = calloc(count, sizeof(int)), *order = calloc(buckets,
+                                                               sizeof(int)),
+        *sizes = calloc(buckets, sizeof(int)), *tried = calloc(count,
+                                                              sizeof(int));
+    if (!bucket_of || !order || !sizes || !tried) {
+        printf("genhashes: Out of memory\n");
+        exit(1);
+    }
+    for (int i = 0; i < count; i++) {
+        bucket_of[i] = cfg_hash(keys[i]->key, strlen(keys[i]->key), 0) %
+                       (unsigned int)buckets;
+        sizes[bucket_of[i]]++;
+    }
+    for (int b = 0; b < buckets; b++) {
+        order[b] = b;
+    }
+    for (int i = 1; i < buckets; i++) { // Biggest buckets first.
+        for (int j = i; j > 0 && sizes[order[j]] > sizes[order[j - 1]]; j--) {
+            int t = order[j];
+            order[j] = order[j - 1];
+            order[j - 1] = t;
+        }
+    }
+    for (int o = 0; o < buckets && sizes[order[o]]; o++) {
+        int b = order[o], ok = 0;
+        for (unsigned int seed = 1; !ok; seed++) {
+            if (seed > 1 << 24) {
+                printf("genhashes: Cannot build a perfect hash\n");
+                exit(1);
+            }
+            ok = 1;
+            for (int i = 0, n = 0; i < count && ok; i++) {
+                if (bucket_of[i] != b) {
+                    continue;
+                }
+                tried[n] = cfg_hash(keys[i]->key, strlen(keys[i]->key),
+                                    seed) %
+                           (unsigned int)count;
+                ok = !out_slots[tried[n]];
+                for (int j = 0; j < n && ok; j++) {
+                    ok = tried[j] != tried[n];
+                }
+                n++;
+            }
+            if (ok) {
+                out_seeds[b] = seed;
+                for (int i = 0, n = 0; i < count; i++) {
+                    if (bucket_of[i] == b) {
+                        out_slots[tried[n++]] = keys[i];
+                    }
+                }
+            }
+        }
+    }
+    free(tried);
+    free(sizes);
+    free(order);
+    free(bucket_of);
+}
+
 int main(int argc, char **argv) {
     FILE *fh;
-    st_symbols *sym;
-    char line[82], key[41], val[41], ch;
-    int cnt = 0;
+    st_symbols *sym, **keys, **slots;
+    char line[82], key[41], val[41];
+    int cnt = 0, buckets, type;
+    unsigned int *seeds;
+    long long num;
     fh = fopen_or_fatal("qemu-run.defaults", "r");
     while (fgets(line, 82, fh)) {
         if (!strchr(line, '=') || line[0] == '#') {
@@ -64,34 +163,70 @@ int main(int argc, char **argv) {
             }
             slice = strtok(NULL, "=");
         }
+        type = key_type(key, val);
+        if (sym_find_key(key)) {
+            printf("genhashes: Duplicate key %s\n", key);
+            exit(1);
+        }
+        if (!cfg_convert(type, val, &num)) {
+            printf("genhashes: Invalid %s default for %s\n", type_names[type],
+                   key);
+            exit(1);
+        }
         sym_add(key, val);
+        sym_find_key(key)->type = type;
+        cnt++;
     }
     fclose(fh);
+
+    buckets = cnt / 2 + 1;
+    keys = calloc(cnt, sizeof(st_symbols *));
+    slots = calloc(cnt, sizeof(st_symbols *));
+    seeds = calloc(buckets, sizeof(unsigned int));
+    if (!keys || !slots || !seeds) {
+        printf("genhashes: Out of memory\n");
+        exit(1);
+    }
+    for (sym = sym_first(), cnt = 0; sym; cnt++, sym = sym_next()) {
+        keys[cnt] = sym;
+    }
+    perfect_hash(keys, cnt, buckets, seeds, slots);
+
     fh = fopen_or_fatal("config.h", "w");
     fprintf(fh, "//Do not edit this file manually, this should be generated by "
                 "genhashes.c !\n");
     fprintf(fh, "#ifndef QEMU_RUN_CONFIG_H\n#define QEMU_RUN_CONFIG_H\n");
+    fprintf(fh, "#include \"cfghash.h\"\n\n");
     fprintf(fh, "enum { ");
-    for (sym = sym_first(), cnt = 0; sym; cnt++, sym = sym_next()) {
-        fprintf(fh, "KEY_%s,", strupr_a(sym->key));
+    for (int i = 0; i < cnt; i++) {
+        fprintf(fh, "KEY_%s,", strupr_a(slots[i]->key));
     }
-    fprintf(fh,
-            "KEY_ENDLIST };\n\ntypedef struct {\n\tint hash;\n\tchar *val;\n} "
-            "st_config;\n\nst_config cfg[%d] = {\n",
-            cnt + 1);
-
-    for (sym = sym_first(), cnt = 0; sym; cnt++, sym = sym_next()) {
-        fprintf(fh, "\t{0x%8.8X, \"%s\"}%s\t\t/* %s */\n", sym->hash,
-                sym->val ? sym->val : "", sym->next ? "," : "", sym->key);
+    fprintf(fh, "KEY_ENDLIST };\n\n"
+                "typedef struct {\n\tconst char *key;\n\tunsigned char len, "
+                "type;\n\tchar *val;\n\tlong long num;\n} st_config;\n\n");
+    fprintf(fh, "#define CFG_BUCKETS %d\nstatic const unsigned int "
+                "cfg_seeds[CFG_BUCKETS] = {",
+            buckets);
+    for (int b = 0; b < buckets; b++) {
+        fprintf(fh, "%s%u", b ? ", " : "", seeds[b]);
+    }
+    fprintf(fh, "};\n\nst_config cfg[KEY_ENDLIST] = {\n");
+    for (int i = 0; i < cnt; i++) {
+        sym = slots[i];
+        cfg_convert(sym->type, sym->val, &num);
+        fprintf(fh, "\t{\"%s\", %d, %s, \"%s\", %lldLL}%s\n", sym->key,
+                (int)strlen(sym->key), type_enums[sym->type], sym->val, num,
+                i + 1 < cnt ? "," : "");
     }
     fprintf(fh, "};\n");
     fprintf(fh, "#endif //QEMU_RUN_CONFIG_H\n");
     fclose(fh);
 
-    if (dynm_i) {
-        for (cnt = 0; cnt < dynm_i; cnt++) {
-            free(dynm[cnt]);
-        }
+    for (cnt = 0; cnt < dynm_i; cnt++) {
+        free(dynm[cnt]);
     }
+    free(seeds);
+    free(slots);
+    free(keys);
     return 0;
 }
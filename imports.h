@@ -1,12 +1,18 @@
 #ifndef QEMU_RUN_IMPORTS_H
 #define QEMU_RUN_IMPORTS_H
 
+#ifndef _GNU_SOURCE // fork(), clock_gettime(), etc. under -std=c99
+#define _GNU_SOURCE
+#endif
+
 #include <ctype.h>
+#include <errno.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #ifdef DEBUG
 #ifdef __GNUC__
@@ -39,9 +45,20 @@
 #define DSEP "/"
 #define PSEP_C ':'
 #define DSEP_C '/'
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #ifdef __linux__
 #include <linux/limits.h>
+#include <sys/sysmacros.h>
 #else
 #include <limits.h>
 #endif // __linux__
@@ -53,6 +70,7 @@
 #define PSEP_C ';'
 #define DSEP_C '\\'
 #include <io.h>
+#include <process.h>
 #include <limits.h>
 #endif // __WINDOWS__
 #endif // __NIX__
@@ -65,6 +83,7 @@
 #ifndef stricmp // GCC is weird sometimes it doesn't includes this..
 #include <strings.h>
 #define stricmp(x, y) strcasecmp(x, y)
+#define strnicmp(x, y, n) strncasecmp(x, y, n)
 #endif
 
 #include "config.h"
@@ -0,0 +1,244 @@
+/* Machine type, firmware and direct kernel boot.
+ *
+ * machine=pc (the default), q35 or microvm. microvm has no PCI bus nor
+ * legacy devices: no USB tablet, VGA, sound, floppy or CD-ROM, every
+ * virtio device sits on virtio-mmio, and it boots a kernel= directly,
+ * with no option ROMs and, under KVM, no PIT, PIC or RTC to set up.
+ *
+ * kernel=, initrd= and append= boot a Linux kernel directly, skipping
+ * the firmware's disk probing and boot loader (boot= is then ignored).
+ * efi=yes boots OVMF instead of SeaBIOS, with the UEFI variables in
+ * efivars.fd in the VM folder, copied from the firmware's template on
+ * first boot. efi_code= and efi_vars= override the firmware files found.
+ *
+ * snd= is a sound card model: -soundhw on the QEMU versions that have it,
+ * else the card as a -device fed by an -audiodev, picking the best audio
+ * backend the binary has and the host runs (pipewire, pulseaudio, ALSA). */
+
+#define EFI_VARS_FILE "efivars.fd"
+
+bool machine_microvm(void) {
+    const char *m = cfg[KEY_MACHINE].val;
+    if (stricmp(m, "microvm") == 0) {
+        return 1;
+    }
+    if (m[0] && stricmp(m, "pc") != 0 && stricmp(m, "q35") != 0) {
+        printf("qemu-run: machine=%s is not pc, q35 or microvm\n", m);
+        fatal(ERR_MACHINE);
+    }
+    return 0;
+}
+
+/* The device name for a virtio PCI device, or its virtio-mmio twin on
+ * microvm: virtio-blk-pci becomes virtio-blk-device. */
+const char *virtio_dev(const char *pci_name) {
+    static char mmio_name[BUFF_AVG];
+    size_t len = strlen(pci_name);
+    if (!machine_microvm() || len < 4 || len >= BUFF_AVG - 4 ||
+        strcmp(pci_name + len - 4, "-pci") != 0) {
+        return pci_name;
+    }
+    snprintf(mmio_name, sizeof(mmio_name), "%.*s-device", (int)len - 4,
+             pci_name);
+    return mmio_name;
+}
+
+/* Finds the OVMF code and variables template for this sys=. */
+static bool efi_firmware(char *out_code, char *out_vars, size_t size) {
+    static const char *x64[][2] = {
+        {"/usr/share/OVMF/OVMF_CODE_4M.fd", "/usr/share/OVMF/OVMF_VARS_4M.fd"},
+        {"/usr/share/OVMF/OVMF_CODE.fd", "/usr/share/OVMF/OVMF_VARS.fd"},
+        {"/usr/share/edk2/ovmf/OVMF_CODE.fd",
+         "/usr/share/edk2/ovmf/OVMF_VARS.fd"},
+        {"/usr/share/edk2/x64/OVMF_CODE.4m.fd",
+         "/usr/share/edk2/x64/OVMF_VARS.4m.fd"},
+        {"/usr/share/edk2-ovmf/x64/OVMF_CODE.fd",
+         "/usr/share/edk2-ovmf/x64/OVMF_VARS.fd"},
+        {"/usr/share/qemu/edk2-x86_64-code.fd",
+         "/usr/share/qemu/edk2-i386-vars.fd"},
+        {"/usr/local/share/qemu/edk2-x86_64-code.fd",
+         "/usr/local/share/qemu/edk2-i386-vars.fd"}};
+    static const char *x32[][2] = {
+        {"/usr/share/qemu/edk2-i386-code.fd",
+         "/usr/share/qemu/edk2-i386-vars.fd"},
+        {"/usr/local/share/qemu/edk2-i386-code.fd",
+         "/usr/local/share/qemu/edk2-i386-vars.fd"}};
+    bool is_x64 = strcmp(cfg[KEY_SYS].val, "x64") == 0;
+    size_t n = is_x64 ? sizeof(x64) / sizeof(x64[0])
+                      : sizeof(x32) / sizeof(x32[0]);
+    if (cfg[KEY_EFI_CODE].val[0] && cfg[KEY_EFI_VARS].val[0]) {
+        snprintf(out_code, size, "%s", cfg[KEY_EFI_CODE].val);
+        snprintf(out_vars, size, "%s", cfg[KEY_EFI_VARS].val);
+        return filetype(out_code, FT_FILE) && filetype(out_vars, FT_FILE);
+    }
+    for (size_t i = 0; i < n; i++) {
+        const char *code = is_x64 ? x64[i][0] : x32[i][0],
+                   *vars = is_x64 ? x64[i][1] : x32[i][1];
+        if (filetype(code, FT_FILE) && filetype(vars, FT_FILE)) {
+            snprintf(out_code, size, "%s", cfg[KEY_EFI_CODE].val[0]
+                                               ? cfg[KEY_EFI_CODE].val
+                                               : code);
+            snprintf(out_vars, size, "%s", cfg[KEY_EFI_VARS].val[0]
+                                               ? cfg[KEY_EFI_VARS].val
+                                               : vars);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* The VM's own copy of the UEFI variables, where its boot entries live. */
+static bool efi_vars_copy(const char *template_fpath) {
+    char buf[BUFF_MAX];
+    size_t r;
+    bool ok = 1;
+    FILE *in, *out;
+    if (filetype(EFI_VARS_FILE, FT_FILE)) {
+        return 1;
+    }
+    if (!(in = fopen(template_fpath, "rb"))) {
+        return 0;
+    }
+    if (!(out = fopen(EFI_VARS_FILE ".tmp", "wb"))) {
+        fclose(in);
+        return 0;
+    }
+    while ((r = fread(buf, 1, sizeof(buf), in)) > 0) {
+        ok = ok && fwrite(buf, 1, r, out) == r;
+    }
+    fclose(in);
+    ok = fclose(out) == 0 && ok && rename(EFI_VARS_FILE ".tmp",
+                                          EFI_VARS_FILE) == 0;
+    if (!ok) {
+        remove(EFI_VARS_FILE ".tmp");
+    }
+    return ok;
+}
+
+static bool argv_has(const st_argv *a, const char *arg) {
+    for (size_t i = 0; i < a->n; i++) {
+        if (strcmp(a->v[i], arg) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void program_build_machine(st_argv *out_args) {
+    char code[PATH_MAX], vars[PATH_MAX];
+    bool microvm = machine_microvm(), has_kernel = cfg[KEY_KERNEL].val[0];
+    DPRINT_S();
+    if ((microvm && !qemu_has(CAP_MICROVM)) ||
+        (stricmp(cfg[KEY_MACHINE].val, "q35") == 0 && !qemu_has(CAP_Q35))) {
+        printf("qemu-run: This %s has no machine=%s\n", qemu_binary(),
+               cfg[KEY_MACHINE].val);
+        fatal(ERR_MACHINE);
+    }
+    argv_push(out_args, "-machine");
+    if (microvm) {
+        argv_push(out_args, cfg[KEY_ACC].num
+                                ? "microvm,x-option-roms=off,pit=off,pic=off,"
+                                  "rtc=off"
+                                : "microvm,x-option-roms=off");
+        argv_push(out_args, "-nodefaults");
+        argv_push(out_args, "-no-user-config");
+        if (!cfg[KEY_HEADLESS].num && !argv_has(out_args, "-serial")) {
+            // Without the defaults, the console needs its serial port back.
+            argv_push(out_args, "-serial");
+            argv_push(out_args, "vc");
+        }
+    } else {
+        argv_push(out_args, cfg[KEY_MACHINE].val[0] ? cfg[KEY_MACHINE].val
+                                                     : "pc");
+    }
+    if (cfg[KEY_EFI].num) {
+        if (microvm) {
+            puts("qemu-run: machine=microvm has no UEFI firmware, it boots "
+                 "kernel= directly");
+            fatal(ERR_MACHINE);
+        }
+        if (!efi_firmware(code, vars, sizeof(code))) {
+            puts("qemu-run: Cannot find the OVMF firmware for efi=yes, "
+                 "install it (ovmf, edk2-ovmf) or set efi_code= and "
+                 "efi_vars=");
+            fatal(ERR_MACHINE);
+        }
+        if (!efi_vars_copy(vars)) {
+            printf("qemu-run: Cannot copy %s to " EFI_VARS_FILE "\n", vars);
+            fatal(ERR_MACHINE);
+        }
+        argv_push(out_args, "-drive");
+        argv_pushx(out_args, "if=pflash,format=raw,unit=0,readonly=on,file=",
+                   NULL);
+        argv_catx_escaped(out_args, code);
+        argv_push(out_args, "-drive");
+        argv_push(out_args,
+                  "if=pflash,format=raw,unit=1,file=" EFI_VARS_FILE);
+    }
+    if (!has_kernel && (microvm || cfg[KEY_INITRD].val[0] ||
+                        cfg[KEY_APPEND].val[0])) {
+        puts(microvm ? "qemu-run: machine=microvm needs kernel="
+                     : "qemu-run: initrd= and append= need kernel=");
+        fatal(ERR_MACHINE);
+    }
+    if (!has_kernel) {
+        return;
+    }
+    if (!filetype(cfg[KEY_KERNEL].val, FT_FILE) ||
+        (cfg[KEY_INITRD].val[0] && !filetype(cfg[KEY_INITRD].val, FT_FILE))) {
+        puts("qemu-run: Cannot find the kernel= or initrd= file");
+        fatal(ERR_MACHINE);
+    }
+    argv_push(out_args, "-kernel");
+    argv_push(out_args, cfg[KEY_KERNEL].val);
+    if (cfg[KEY_INITRD].val[0]) {
+        argv_push(out_args, "-initrd");
+        argv_push(out_args, cfg[KEY_INITRD].val);
+    }
+    if (cfg[KEY_APPEND].val[0]) {
+        argv_push(out_args, "-append");
+        argv_push(out_args, cfg[KEY_APPEND].val);
+    }
+}
+
+void program_build_audio(st_argv *out_args, bool headless) {
+    static const char *models[][2] = {{"hda", "intel-hda"},
+                                      {"ac97", "AC97"},
+                                      {"es1370", "ES1370"}};
+    const char *snd = cfg[KEY_SND].val, *driver = "none",
+               *runtime_dir = getenv("XDG_RUNTIME_DIR");
+    char pipewire[PATH_MAX], pulse[PATH_MAX];
+    if (!qemu_has(CAP_AUDIODEV)) {
+        argv_push(out_args, "-soundhw");
+        argv_push(out_args, snd);
+        return;
+    }
+    if (!headless && runtime_dir) {
+        snprintf(pipewire, sizeof(pipewire), "%s/pipewire-0", runtime_dir);
+        snprintf(pulse, sizeof(pulse), "%s/pulse/native", runtime_dir);
+        if (qemu_has(CAP_AUDIO_PIPEWIRE) && access(pipewire, F_OK) == 0) {
+            driver = "pipewire";
+        } else if (qemu_has(CAP_AUDIO_PA) && access(pulse, F_OK) == 0) {
+            driver = "pa";
+        }
+    }
+    if (!headless && strcmp(driver, "none") == 0 &&
+        qemu_has(CAP_AUDIO_ALSA)) {
+        driver = "alsa";
+    }
+    argv_push(out_args, "-audiodev");
+    argv_pushx(out_args, driver, ",id=snd0", NULL);
+    argv_push(out_args, "-device");
+    for (size_t i = 0; i < sizeof(models) / sizeof(models[0]); i++) {
+        if (stricmp(snd, models[i][0]) == 0) {
+            snd = models[i][1];
+        }
+    }
+    if (strcmp(snd, "intel-hda") == 0) { // The controller, then its codec.
+        argv_push(out_args, "intel-hda");
+        argv_push(out_args, "-device");
+        argv_push(out_args, "hda-duplex,audiodev=snd0");
+    } else {
+        argv_pushx(out_args, snd, ",audiodev=snd0", NULL);
+    }
+}
@@ -0,0 +1,245 @@
+/* Guest memory and CPU topology: -m, -smp and, when hugepages=,
+ * mem_prealloc= or numa_nodes= ask for it, or when a vhost-user device
+ * needs the guest RAM shared, explicit memory backends.
+ *
+ * mem_density=yes is for packing many mostly idle guests on a host: the
+ * guest RAM is open to KSM merging, and a virtio-balloon reports the
+ * pages the guest frees back to the host, as well as being inflated and
+ * deflated by the supervisor (density.c) as the guest and host need.
+ *
+ * hugepages=yes uses the host default hugepage size, 2M and 1G pick one.
+ * numa_nodes= is a ';' separated list of host NUMA nodes: the guest gets
+ * one node per entry, each with an equal share of the vCPUs and of mem=,
+ * its RAM bound to that host node, and one socket per node. */
+
+#define DENSITY_BALLOON "balloon0"
+
+static long long hugepage_default_size(void) {
+    long long size = 0;
+    char line[BUFF_AVG];
+    FILE *fh = fopen("/proc/meminfo", "r");
+    if (fh) {
+        while (fgets(line, sizeof(line), fh)) {
+            if (sscanf(line, "Hugepagesize: %lld kB", &size) == 1) {
+                break;
+            }
+        }
+        fclose(fh);
+    }
+    return size > 0 ? size << 10 : 2 << 20;
+}
+
+/* Returns the hugepage size in bytes asked for by hugepages=, 0 if off. */
+long long hugepage_size(void) {
+    long long size = 0;
+    if (cfg_convert(CFG_BOOL, cfg[KEY_HUGEPAGES].val, &size)) {
+        return size ? hugepage_default_size() : 0;
+    }
+    if (!cfg_convert(CFG_SIZE, cfg[KEY_HUGEPAGES].val, &size) || size <= 0) {
+        printf("qemu-run: hugepages= takes yes, no, or a page size like 2M\n");
+        fatal(ERR_HUGEPAGES);
+    }
+    return size;
+}
+
+#ifdef __linux__
+/* Free hugepages of a given size, on a host node or (node < 0) overall. */
+static long long hugepages_free(long long page_size, int node) {
+    char fpath[BUFF_AVG * 2];
+    long long pages = -1;
+    FILE *fh;
+    if (node < 0) {
+        snprintf(fpath, sizeof(fpath),
+                 "/sys/kernel/mm/hugepages/hugepages-%lldkB/free_hugepages",
+                 page_size >> 10);
+    } else {
+        snprintf(fpath, sizeof(fpath),
+                 "/sys/devices/system/node/node%d/hugepages/"
+                 "hugepages-%lldkB/free_hugepages",
+                 node, page_size >> 10);
+    }
+    if ((fh = fopen(fpath, "r"))) {
+        if (fscanf(fh, "%lld", &pages) != 1) {
+            pages = -1;
+        }
+        fclose(fh);
+    }
+    return pages;
+}
+
+/* Looks for a mounted hugetlbfs serving page_size pages. */
+static bool hugetlbfs_mount(long long page_size, char *out_path) {
+    char line[PATH_MAX + BUFF_AVG], dev[BUFF_AVG], path[PATH_MAX],
+        type[BUFF_AVG], opts[PATH_MAX];
+    long long mount_size;
+    bool found = 0;
+    FILE *fh = fopen("/proc/mounts", "r");
+    if (!fh) {
+        return 0;
+    }
+    while (!found && fgets(line, sizeof(line), fh)) {
+        char *ps;
+        if (sscanf(line, "%127s %4095s %127s %4095s", dev, path, type, opts) !=
+                4 ||
+            strcmp(type, "hugetlbfs") != 0) {
+            continue;
+        }
+        if ((ps = strstr(opts, "pagesize="))) {
+            char val[BUFF_AVG] = {0};
+            strncpy(val, ps + 9, strcspn(ps + 9, ","));
+            if (!cfg_convert(CFG_SIZE, val, &mount_size)) {
+                continue;
+            }
+        } else {
+            mount_size = hugepage_default_size();
+        }
+        if ((found = mount_size == page_size)) {
+            strcpy(out_path, path);
+        }
+    }
+    fclose(fh);
+    return found;
+}
+#endif
+
+static void memory_build_density(st_argv *out_args, long long page_size) {
+    char ksm[8] = {0};
+    FILE *fh;
+    if (page_size || cfg[KEY_MEM_PREALLOC].num) {
+        printf("qemu-run: mem_density=yes cannot give back hugepages or "
+               "preallocated memory, turn hugepages= and mem_prealloc= off\n");
+        fatal(ERR_HUGEPAGES);
+    }
+    argv_push(out_args, "-machine");
+    argv_push(out_args, "mem-merge=on");
+    argv_push(out_args, "-device");
+    argv_pushx(out_args, virtio_dev("virtio-balloon-pci"),
+               ",id=" DENSITY_BALLOON ",deflate-on-oom=on",
+               qemu_has(CAP_PAGE_REPORTING) ? ",free-page-reporting=on" : "",
+               NULL);
+    if ((fh = fopen("/sys/kernel/mm/ksm/run", "r"))) {
+        if (!fgets(ksm, sizeof(ksm), fh) || ksm[0] != '1') {
+            printf("qemu-run: Warning: KSM is not running, guests will not "
+                   "share identical pages (echo 1 > /sys/kernel/mm/ksm/run)\n");
+        }
+        fclose(fh);
+    }
+}
+
+/* Emits -smp, -m and, if needed, the memory backends and guest NUMA
+ * nodes; share puts guest RAM in memory other processes can map. Fails
+ * before launch if the hugepages cannot be had. */
+void program_build_memory(st_argv *out_args, bool share) {
+    long long page_size, mem = cfg[KEY_MEM].num, cores = cfg[KEY_CORES].num,
+                         nodes = cfg[KEY_NUMA_NODES].num, node_mem;
+    bool prealloc = cfg[KEY_MEM_PREALLOC].num;
+    char num_a[24], num_b[24], num_c[24], mem_path[PATH_MAX] = {0};
+    DPRINT_S();
+    page_size = hugepage_size();
+    argv_push(out_args, "-smp");
+    if (nodes > 1) {
+        if (cores % nodes) {
+            printf("qemu-run: cores=%lld cannot be split evenly over %lld "
+                   "NUMA nodes\n",
+                   cores, nodes);
+            fatal(ERR_HUGEPAGES);
+        }
+        snprintf(num_a, sizeof(num_a), "%lld", cores);
+        snprintf(num_b, sizeof(num_b), "%lld", nodes);
+        snprintf(num_c, sizeof(num_c), "%lld", cores / nodes);
+        argv_pushx(out_args, num_a, ",sockets=", num_b, ",cores=", num_c,
+                   ",threads=1", NULL);
+    } else {
+        argv_push(out_args, cfg[KEY_CORES].val);
+    }
+    argv_push(out_args, "-m");
+    argv_push(out_args, cfg[KEY_MEM].val);
+    if (cfg[KEY_MEM_DENSITY].num) {
+        memory_build_density(out_args, page_size);
+    }
+    if (!page_size && !prealloc && !nodes && !share) {
+        return; // Plain anonymous memory, QEMU's default.
+    }
+#ifdef __linux__
+    nodes = nodes ? nodes : 1;
+    node_mem = mem / nodes;
+    if (page_size && (node_mem % page_size || mem % nodes)) {
+        printf("qemu-run: mem=%s is not a multiple of %lld hugepages of %lld "
+               "KiB\n",
+               cfg[KEY_MEM].val, nodes, page_size >> 10);
+        fatal(ERR_HUGEPAGES);
+    }
+    if (page_size && !hugetlbfs_mount(page_size, mem_path)) {
+        mem_path[0] = '\0'; // memfd then, it has its own hugetlbfs mount.
+    }
+    char *node_list = cfg[KEY_NUMA_NODES].val;
+    for (long long i = 0; i < nodes; i++) {
+        int host_node = -1;
+        char id[24], path[BUFF_AVG], where[BUFF_AVG] = {0};
+        if (cfg[KEY_NUMA_NODES].num) {
+            host_node = atoi(node_list);
+            node_list += strcspn(node_list, ";");
+            node_list += *node_list == ';';
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d",
+                     host_node);
+            if (!filetype(path, FT_PATH)) {
+                printf("qemu-run: Host NUMA node %d does not exist\n",
+                       host_node);
+                fatal(ERR_HUGEPAGES);
+            }
+            snprintf(where, sizeof(where), " on node %d", host_node);
+        }
+        if (page_size) {
+            long long free_pages = hugepages_free(page_size, host_node);
+            if (free_pages < node_mem / page_size) {
+                printf("qemu-run: %lld free %lld KiB hugepages%s, %lld "
+                       "needed. See /proc/sys/vm/nr_hugepages\n",
+                       free_pages < 0 ? 0 : free_pages, page_size >> 10,
+                       where, node_mem / page_size);
+                fatal(ERR_HUGEPAGES);
+            }
+        }
+        snprintf(id, sizeof(id), "ram%lld", i);
+        snprintf(num_a, sizeof(num_a), "%lld", node_mem);
+        argv_push(out_args, "-object");
+        if (page_size && mem_path[0]) {
+            argv_pushx(out_args, "memory-backend-file,id=", id,
+                       ",mem-path=", mem_path, ",size=", num_a, NULL);
+        } else if (page_size) {
+            snprintf(num_b, sizeof(num_b), "%lld", page_size);
+            argv_pushx(out_args, "memory-backend-memfd,id=", id,
+                       ",hugetlb=on,hugetlbsize=", num_b, ",size=", num_a,
+                       NULL);
+        } else if (share) {
+            argv_pushx(out_args, "memory-backend-memfd,id=", id, ",size=",
+                       num_a, NULL);
+        } else {
+            argv_pushx(out_args, "memory-backend-ram,id=", id, ",size=",
+                       num_a, NULL);
+        }
+        if (share) {
+            argv_catx(out_args, ",share=on", NULL);
+        }
+        if (prealloc) {
+            argv_catx(out_args, ",prealloc=on,prealloc-threads=",
+                      cfg[KEY_CORES].val, NULL);
+        }
+        if (host_node >= 0) {
+            snprintf(num_b, sizeof(num_b), "%d", host_node);
+            argv_catx(out_args, ",host-nodes=", num_b, ",policy=bind", NULL);
+        }
+        if (cfg[KEY_NUMA_NODES].num) {
+            snprintf(num_a, sizeof(num_a), "%lld", i);
+            snprintf(num_b, sizeof(num_b), "%lld", i * (cores / nodes));
+            snprintf(num_c, sizeof(num_c), "%lld",
+                     (i + 1) * (cores / nodes) - 1);
+            argv_push(out_args, "-numa");
+            argv_pushx(out_args, "node,nodeid=", num_a, ",cpus=", num_b, "-",
+                       num_c, ",memdev=", id, NULL);
+        } else {
+            argv_push(out_args, "-machine");
+            argv_pushx(out_args, "memory-backend=", id, NULL);
+        }
+    }
+#endif
+}
@@ -0,0 +1,454 @@
+/* qemu-run --metrics [--interval S] [--json] [vm names...]
+ *
+ * Exports the load of every running VM (all the VMs in the index, or the
+ * ones named), every S seconds (15 by default; 0 prints once and exits),
+ * as Prometheus text or, with --json, one JSON object per VM and round.
+ * From QMP: vCPU threads, block device and balloon stats. From the host:
+ * CPU time, RSS and run queue wait of QEMU and of every vCPU thread, from
+ * /proc, and the counters of the tap devices QEMU has open.
+ *
+ * One process for all the VMs: each round queues its commands on every VM
+ * before reading any reply, so a round costs about one QMP round trip per
+ * VM, not one per command. QEMU serves one QMP client at a time, so the
+ * sessions are closed at the end of every round, leaving the socket free
+ * for the supervisor, qemu-run <vm> qmp and the others in between. VMs
+ * that are not running cost a failed connect() per round. */
+
+#define METRICS_MAX_IFS 8
+
+enum {
+    M_UP,
+    M_CPU,
+    M_RSS,
+    M_VCPU_CPU,
+    M_VCPU_WAIT,
+    M_BLK_RD_BYTES,
+    M_BLK_WR_BYTES,
+    M_BLK_RD_OPS,
+    M_BLK_WR_OPS,
+    M_BLK_FLUSH_OPS,
+    M_BLK_RD_TIME,
+    M_BLK_WR_TIME,
+    M_NET_RX_BYTES,
+    M_NET_TX_BYTES,
+    M_NET_RX_PACKETS,
+    M_NET_TX_PACKETS,
+    M_BALLOON,
+    M_ENDLIST
+};
+
+static const struct {
+    const char *name, *type, *label, *help;
+} metrics[M_ENDLIST] = {
+    {"up", "gauge", NULL, "Whether the VM answers on its QMP socket"},
+    {"cpu_seconds_total", "counter", NULL, "CPU time of the QEMU process"},
+    {"resident_bytes", "gauge", NULL, "Resident memory of the QEMU process"},
+    {"vcpu_cpu_seconds_total", "counter", "vcpu", "CPU time of a vCPU"},
+    {"vcpu_wait_seconds_total", "counter", "vcpu",
+     "Time a vCPU spent runnable, waiting for a host CPU"},
+    {"block_read_bytes_total", "counter", "drive", "Bytes read"},
+    {"block_write_bytes_total", "counter", "drive", "Bytes written"},
+    {"block_read_ops_total", "counter", "drive", "Read requests"},
+    {"block_write_ops_total", "counter", "drive", "Write requests"},
+    {"block_flush_ops_total", "counter", "drive", "Flush requests"},
+    {"block_read_seconds_total", "counter", "drive", "Time spent reading"},
+    {"block_write_seconds_total", "counter", "drive", "Time spent writing"},
+    {"net_rx_bytes_total", "counter", "iface", "Bytes the guest received"},
+    {"net_tx_bytes_total", "counter", "iface", "Bytes the guest sent"},
+    {"net_rx_packets_total", "counter", "iface", "Packets the guest received"},
+    {"net_tx_packets_total", "counter", "iface", "Packets the guest sent"},
+    {"balloon_bytes", "gauge", NULL, "Guest RAM left by the balloon"}};
+
+typedef struct {
+    char *name, *dir;
+    st_qmp q;
+    pid_t pid;
+    int nifs;
+    char ifs[METRICS_MAX_IFS][20]; /**< Tap devices, as in /sys/class/net */
+    unsigned int ids[3];           /**< Commands queued this round */
+} st_metrics_vm;
+
+typedef struct {
+    int vm, metric;
+    char label[48];
+    double val;
+} st_sample;
+
+typedef struct {
+    st_metrics_vm *vms;
+    int count, cap;
+    st_sample *samples;
+    size_t nsamples, samples_cap;
+} st_metrics;
+
+static void metrics_add_vm(st_metrics *m, const char *name, const char *dir) {
+    if (m->count == m->cap) {
+        m->cap = m->cap ? m->cap * 2 : 16;
+        if (!(m->vms = realloc(m->vms, m->cap * sizeof(st_metrics_vm)))) {
+            fatal(ERR_MEM);
+        }
+    }
+    memset(&m->vms[m->count], 0, sizeof(st_metrics_vm));
+    m->vms[m->count].name = l_str_dup(name);
+    m->vms[m->count].dir = l_str_dup(dir);
+    m->vms[m->count++].q.fd = -1;
+}
+
+static void metrics_sample(st_metrics *m, int vm, int metric,
+                           const char *label, double val) {
+    if (m->nsamples == m->samples_cap) {
+        m->samples_cap = m->samples_cap ? m->samples_cap * 2 : 256;
+        m->samples = realloc(m->samples, m->samples_cap * sizeof(st_sample));
+        if (!m->samples) {
+            fatal(ERR_MEM);
+        }
+    }
+    m->samples[m->nsamples].vm = vm;
+    m->samples[m->nsamples].metric = metric;
+    snprintf(m->samples[m->nsamples].label, sizeof(m->samples[0].label), "%s",
+             label ? label : "");
+    m->samples[m->nsamples++].val = val;
+}
+
+/* Prometheus label values and JSON strings escape the same few bytes. */
+static void metrics_print_str(const char *str) {
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\') {
+            putchar('\\');
+        }
+        if (*str == '\n') {
+            fputs("\\n", stdout);
+        } else {
+            putchar(*str);
+        }
+    }
+}
+
+#ifdef __linux__
+static bool metrics_read(const char *fpath, char *out, size_t size) {
+    int fd = open(fpath, O_RDONLY | O_CLOEXEC);
+    ssize_t len = fd >= 0 ? read(fd, out, size - 1) : -1;
+    if (fd >= 0) {
+        close(fd);
+    }
+    out[len > 0 ? len : 0] = '\0';
+    return len > 0;
+}
+
+/* utime + stime, in seconds, and the RSS in bytes, from a stat file. */
+static bool metrics_proc_stat(const char *fpath, double *out_cpu,
+                              double *out_rss) {
+    char buf[1024], *p;
+    unsigned long long utime, stime;
+    long long rss;
+    if (!metrics_read(fpath, buf, sizeof(buf)) || !(p = strrchr(buf, ')')) ||
+        sscanf(p + 1,
+               " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu %*d %*d "
+               "%*d %*d %*d %*d %*u %*u %lld",
+               &utime, &stime, &rss) != 3) {
+        return 0;
+    }
+    *out_cpu = (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+    *out_rss = (double)rss * sysconf(_SC_PAGESIZE);
+    return 1;
+}
+
+/* Finds the tap devices QEMU has open, by their tun fd info. */
+static void metrics_find_ifs(st_metrics_vm *vm) {
+    char fpath[PATH_MAX], target[32], info[256], *iff;
+    struct dirent *de;
+    DIR *dh;
+    snprintf(fpath, sizeof(fpath), "/proc/%ld/fd", (long)vm->pid);
+    if (!(dh = opendir(fpath))) {
+        return;
+    }
+    while ((de = readdir(dh)) && vm->nifs < METRICS_MAX_IFS) {
+        ssize_t len;
+        int i;
+        snprintf(fpath, sizeof(fpath), "/proc/%ld/fd/%s", (long)vm->pid,
+                 de->d_name);
+        if ((len = readlink(fpath, target, sizeof(target) - 1)) <= 0) {
+            continue;
+        }
+        target[len] = '\0';
+        if (strcmp(target, "/dev/net/tun") != 0) {
+            continue;
+        }
+        snprintf(fpath, sizeof(fpath), "/proc/%ld/fdinfo/%s", (long)vm->pid,
+                 de->d_name);
+        if (!metrics_read(fpath, info, sizeof(info)) ||
+            !(iff = strstr(info, "iff:"))) {
+            continue;
+        }
+        iff += 4 + strspn(iff + 4, " \t");
+        iff[strcspn(iff, "\n")] = '\0';
+        for (i = 0; i < vm->nifs && strcmp(vm->ifs[i], iff) != 0; i++)
+            ;
+        if (i == vm->nifs) { // Multiqueue taps have one fd per queue.
+            snprintf(vm->ifs[vm->nifs++], sizeof(vm->ifs[0]), "%s", iff);
+        }
+    }
+    closedir(dh);
+}
+
+static double metrics_netdev(const char *ifname, const char *counter) {
+    char fpath[96], buf[32];
+    snprintf(fpath, sizeof(fpath), "/sys/class/net/%s/statistics/%s", ifname,
+             counter);
+    return metrics_read(fpath, buf, sizeof(buf)) ? strtod(buf, NULL) : 0;
+}
+
+static void metrics_host(st_metrics *m, int idx) {
+    st_metrics_vm *vm = &m->vms[idx];
+    char fpath[64];
+    double cpu, rss;
+    snprintf(fpath, sizeof(fpath), "/proc/%ld/stat", (long)vm->pid);
+    if (metrics_proc_stat(fpath, &cpu, &rss)) {
+        metrics_sample(m, idx, M_CPU, NULL, cpu);
+        metrics_sample(m, idx, M_RSS, NULL, rss);
+    }
+    for (int i = 0; i < vm->nifs; i++) { // The tap sees the guest inverted.
+        metrics_sample(m, idx, M_NET_RX_BYTES, vm->ifs[i],
+                       metrics_netdev(vm->ifs[i], "tx_bytes"));
+        metrics_sample(m, idx, M_NET_TX_BYTES, vm->ifs[i],
+                       metrics_netdev(vm->ifs[i], "rx_bytes"));
+        metrics_sample(m, idx, M_NET_RX_PACKETS, vm->ifs[i],
+                       metrics_netdev(vm->ifs[i], "tx_packets"));
+        metrics_sample(m, idx, M_NET_TX_PACKETS, vm->ifs[i],
+                       metrics_netdev(vm->ifs[i], "rx_packets"));
+    }
+}
+#endif
+
+static void metrics_vcpus(st_metrics *m, int idx, const char *ret) {
+    const char *item;
+    for (int i = 0; ret && (item = json_item(ret, i)); i++) {
+        long long cpu_index, tid;
+        if (!json_int(item, "cpu-index", &cpu_index) ||
+            !json_int(item, "thread-id", &tid)) {
+            continue;
+        }
+#ifdef __linux__
+        char fpath[64], buf[128], label[24];
+        unsigned long long run_ns, wait_ns;
+        double cpu, rss;
+        snprintf(label, sizeof(label), "%lld", cpu_index);
+        snprintf(fpath, sizeof(fpath), "/proc/%ld/task/%lld/stat",
+                 (long)m->vms[idx].pid, tid);
+        if (metrics_proc_stat(fpath, &cpu, &rss)) {
+            metrics_sample(m, idx, M_VCPU_CPU, label, cpu);
+        }
+        snprintf(fpath, sizeof(fpath), "/proc/%ld/task/%lld/schedstat",
+                 (long)m->vms[idx].pid, tid);
+        if (metrics_read(fpath, buf, sizeof(buf)) &&
+            sscanf(buf, "%llu %llu", &run_ns, &wait_ns) == 2) {
+            metrics_sample(m, idx, M_VCPU_WAIT, label, wait_ns / 1e9);
+        }
+#endif
+    }
+}
+
+static void metrics_block(st_metrics *m, int idx, const char *ret) {
+    static const struct {
+        const char *key;
+        int metric;
+        double scale;
+    } stats[] = {{"rd_bytes", M_BLK_RD_BYTES, 1},
+                 {"wr_bytes", M_BLK_WR_BYTES, 1},
+                 {"rd_operations", M_BLK_RD_OPS, 1},
+                 {"wr_operations", M_BLK_WR_OPS, 1},
+                 {"flush_operations", M_BLK_FLUSH_OPS, 1},
+                 {"rd_total_time_ns", M_BLK_RD_TIME, 1e-9},
+                 {"wr_total_time_ns", M_BLK_WR_TIME, 1e-9}};
+    const char *item, *st;
+    char drive[48];
+    for (int i = 0; ret && (item = json_item(ret, i)); i++) {
+        json_str(json_member(item, "device"), drive, sizeof(drive));
+        if (!drive[0]) { // -blockdev drives only have a node name.
+            json_str(json_member(item, "node-name"), drive,
+                             sizeof(drive));
+        }
+        if (!drive[0] || !(st = json_member(item, "stats"))) {
+            continue;
+        }
+        for (size_t s = 0; s < sizeof(stats) / sizeof(stats[0]); s++) {
+            long long val;
+            if (json_int(st, stats[s].key, &val)) {
+                metrics_sample(m, idx, stats[s].metric, drive,
+                               val * stats[s].scale);
+            }
+        }
+    }
+}
+
+static void metrics_connect(st_metrics_vm *vm) {
+    if (chdir(vm->dir) != 0 || !qmp_connect(&vm->q, QMP_SOCKET, 0, 1000)) {
+        return;
+    }
+    vm->pid = 0;
+    vm->nifs = 0;
+#ifdef __linux__
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(vm->q.fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0) {
+        vm->pid = cred.pid;
+        metrics_find_ifs(vm);
+    }
+#endif
+}
+
+/* One round: queue the commands on every VM, then collect the replies
+ * and hang up. */
+static void metrics_collect(st_metrics *m) {
+    static const char *cmds[] = {"query-cpus-fast", "query-blockstats",
+                                 "query-balloon"};
+    const char *ret;
+    long long actual;
+    m->nsamples = 0;
+    for (int i = 0; i < m->count; i++) {
+        st_metrics_vm *vm = &m->vms[i];
+        metrics_connect(vm);
+        for (int c = 0; c < 3 && vm->q.fd >= 0; c++) {
+            if (!(vm->ids[c] = qmp_send(&vm->q, cmds[c], NULL))) {
+                qmp_close(&vm->q);
+            }
+        }
+    }
+    for (int i = 0; i < m->count; i++) {
+        st_metrics_vm *vm = &m->vms[i];
+        for (int c = 0; c < 3 && vm->q.fd >= 0; c++) {
+            char *reply = qmp_wait_reply(&vm->q, vm->ids[c], 2000);
+            if (!reply) {
+                qmp_close(&vm->q); // Gone, or hung.
+                break;
+            }
+            ret = json_member(reply, "return");
+            if (c == 0) {
+                metrics_vcpus(m, i, ret);
+            } else if (c == 1) {
+                metrics_block(m, i, ret);
+            } else if (ret && json_int(ret, "actual", &actual)) {
+                metrics_sample(m, i, M_BALLOON, NULL, (double)actual);
+            }
+        }
+        metrics_sample(m, i, M_UP, NULL, vm->q.fd >= 0);
+#ifdef __linux__
+        if (vm->q.fd >= 0 && vm->pid > 0) {
+            metrics_host(m, i);
+        }
+#endif
+        qmp_close(&vm->q);
+    }
+}
+
+static void metrics_print_prom(const st_metrics *m) {
+    for (int k = 0; k < M_ENDLIST; k++) {
+        printf("# HELP qemu_run_%s %s.\n# TYPE qemu_run_%s %s\n",
+               metrics[k].name, metrics[k].help, metrics[k].name,
+               metrics[k].type);
+        for (size_t i = 0; i < m->nsamples; i++) {
+            const st_sample *s = &m->samples[i];
+            if (s->metric != k) {
+                continue;
+            }
+            printf("qemu_run_%s{vm=\"", metrics[k].name);
+            metrics_print_str(m->vms[s->vm].name);
+            if (metrics[k].label) {
+                printf("\",%s=\"", metrics[k].label);
+                metrics_print_str(s->label);
+            }
+            printf("\"} %.15g\n", s->val);
+        }
+    }
+}
+
+/* {"time": t, "vm": "name", "up": 1, "vcpu_cpu_seconds_total": {"0": 1.5},
+ * ...}: metrics with a label become an object keyed by it. */
+static void metrics_print_json(const st_metrics *m, time_t t) {
+    for (int v = 0; v < m->count; v++) {
+        printf("{\"time\": %lld, \"vm\": \"", (long long)t);
+        metrics_print_str(m->vms[v].name);
+        putchar('"');
+        for (int k = 0; k < M_ENDLIST; k++) {
+            int n = 0;
+            for (size_t i = 0; i < m->nsamples; i++) {
+                const st_sample *s = &m->samples[i];
+                if (s->vm != v || s->metric != k) {
+                    continue;
+                }
+                if (!metrics[k].label) {
+                    printf(", \"%s\": %.15g", metrics[k].name, s->val);
+                    continue;
+                }
+                printf(n++ ? ", \"" : ", \"%s\": {\"", metrics[k].name);
+                metrics_print_str(s->label);
+                printf("\": %.15g", s->val);
+            }
+            if (n) {
+                putchar('}');
+            }
+        }
+        puts("}");
+    }
+}
+
+int program_run_metrics(char **items, int count) {
+    st_metrics m = {0};
+    char vm_cfg_file[BUFF_AVG], dir[PATH_MAX];
+    double interval = 15, next;
+    bool json = 0;
+    DPRINT_S();
+    for (int i = 0; i < count; i++) {
+        if (strcmp(items[i], "--interval") == 0 && i + 1 < count) {
+            if ((interval = atof(items[++i])) < 0) {
+                fatal(ERR_ARGS);
+            }
+        } else if (strcmp(items[i], "--json") == 0) {
+            json = 1;
+        } else if (items[i][0] == '-') {
+            fatal(ERR_ARGS);
+        } else {
+            program_find_vm_and_chdir(items[i], vm_cfg_file);
+            if (!getcwd(dir, sizeof(dir))) {
+                fatal(ERR_CHDIR_VM_DIR);
+            }
+            metrics_add_vm(&m, items[i], dir);
+        }
+    }
+    if (!m.count) {
+        st_vmindex ix;
+        if (!vmindex_open(&ix, 1)) {
+            fatal(ERR_INDEX);
+        }
+        for (uint32_t i = 0; i < ix.hdr->nslots; i++) {
+            if (ix.slots[i].name_off && ix.slots[i].cfg_off) {
+                metrics_add_vm(&m, ix.str + ix.slots[i].name_off,
+                               ix.str + ix.slots[i].dir_off);
+            }
+        }
+        vmindex_close(&ix);
+    }
+    signal(SIGPIPE, SIG_IGN); // A VM going away mid write is not our end.
+    for (next = now_ms();; next += interval * 1000) {
+        metrics_collect(&m);
+        if (json) {
+            metrics_print_json(&m, time(NULL));
+        } else {
+            metrics_print_prom(&m);
+        }
+        if (fflush(stdout) != 0 || interval <= 0) {
+            break;
+        }
+        while (now_ms() < next + interval * 1000) {
+            usleep((useconds_t)((next + interval * 1000 - now_ms()) * 1000));
+        }
+    }
+    for (int i = 0; i < m.count; i++) {
+        qmp_close(&m.vms[i].q);
+        free(m.vms[i].name);
+        free(m.vms[i].dir);
+    }
+    free(m.vms);
+    free(m.samples);
+    return 0;
+}
@@ -0,0 +1,210 @@
+/* Networking: net_backend=user (QEMU's slirp, the default), tap or bridge.
+ *
+ * user is the classic -nic, with ipv4=, ipv6=, fwd_ports= and smb shared
+ * folders. tap attaches the VM to net_tap=, a device created beforehand
+ * ("ip tuntap add qr0 mode tap multi_queue user $USER"), or one QEMU
+ * creates itself when it has CAP_NET_ADMIN. bridge lets QEMU's
+ * qemu-bridge-helper create a tap and enslave it to net_bridge= (it needs
+ * "allow <bridge>" in /etc/qemu/bridge.conf). On tap and bridge the guest
+ * sits on the host L2 network, so ipv4=, ipv6= and fwd_ports= do not
+ * apply; the NIC gets vhost-net when /dev/vhost-net is usable, and a
+ * virtio NIC gets net_queues= queue pairs, cores= by default. */
+
+enum { NET_USER, NET_TAP, NET_BRIDGE };
+
+int net_backend(void) {
+    char *val = cfg[KEY_NET_BACKEND].val;
+    if (!val[0] || stricmp(val, "user") == 0) {
+        return NET_USER;
+    }
+    if (stricmp(val, "tap") == 0) {
+        return NET_TAP;
+    }
+    if (stricmp(val, "bridge") == 0) {
+        return NET_BRIDGE;
+    }
+    printf("qemu-run: net_backend=%s is not user, tap or bridge\n", val);
+    fatal(ERR_NET);
+    return NET_USER;
+}
+
+static void program_build_net_user(st_argv *out_args, bool vm_has_sharedf) {
+    // "no", or "auto" left unresolved where there is no port allocation.
+    bool vm_has_fwd_ports = isdigit((unsigned char)cfg[KEY_FWD_PORTS].val[0]);
+    bool vm_has_ipv4 = cfg[KEY_IPV4].num;
+    bool vm_has_ipv6 = cfg[KEY_IPV6].num;
+    if (!vm_has_ipv6 && !vm_has_ipv4) {
+        fatal(ERR_NETCONF_IP);
+    }
+    argv_push(out_args, "-nic");
+    argv_pushx(out_args, "user,model=",
+               machine_microvm() ? "virtio-net-device" : cfg[KEY_NET].val,
+               vm_has_ipv4 ? ",ipv4=on" : ",ipv4=off",
+               vm_has_ipv6 ? ",ipv6=on" : ",ipv6=off", NULL);
+    if (vm_has_sharedf) {
+        argv_catx(out_args, ",smb=", cfg[KEY_SHARED].val, NULL);
+    }
+    if (vm_has_fwd_ports) {
+        char fwd_port_a[6], fwd_port_b[6], *slice;
+        if (strchr(cfg[KEY_FWD_PORTS].val, ':') !=
+            NULL) { // If have fwd_ports=<HostPort>:<GuestPort>
+            int i = 0, have_slice = 0;
+            size_t slice_len;
+            slice = &cfg[KEY_FWD_PORTS].val[0];
+            do {
+                have_slice = l_str_slice(slice, ':', &slice_len);
+                if (i == 0) {
+                    mzero_ca(fwd_port_a);
+                    strncpy(fwd_port_a, slice, slice_len);
+                }
+                if (i == 1) {
+                    mzero_ca(fwd_port_b);
+                    strncpy(fwd_port_b, slice, slice_len);
+                }
+                slice = slice + slice_len + 1;
+                i++;
+            } while (have_slice && i < 2);
+            argv_catx(out_args, ",hostfwd=tcp::", fwd_port_a, "-:",
+                      fwd_port_b, ",hostfwd=udp::", fwd_port_a, "-:",
+                      fwd_port_b, NULL);
+        } else { // Else use the same port for Host and Guest.
+            char *port = cfg[KEY_FWD_PORTS].val;
+            argv_catx(out_args, ",hostfwd=tcp::", port, "-:", port,
+                      ",hostfwd=udp::", port, "-:", port, NULL);
+        }
+    }
+}
+
+/* Reads /sys/class/net/<ifname>/<attr>, "" if there is no such thing. */
+static bool netdev_attr(const char *ifname, const char *attr, char *out,
+                        size_t size) {
+    char fpath[BUFF_AVG * 2];
+    FILE *fh;
+    out[0] = '\0';
+    snprintf(fpath, sizeof(fpath), "/sys/class/net/%s/%s", ifname, attr);
+    if (!(fh = fopen(fpath, "r"))) {
+        return 0;
+    }
+    if (!fgets(out, (int)size, fh)) {
+        out[0] = '\0';
+    }
+    out[strcspn(out, "\r\n")] = '\0';
+    fclose(fh);
+    return 1;
+}
+
+/* -netdev bridge takes no vhost=, so a bridge is set up as -netdev tap
+ * with br= and the helper path found here. */
+static const char *net_bridge_helper(void) {
+    static const char *paths[] = {"/usr/libexec/qemu-bridge-helper",
+                                  "/usr/lib/qemu/qemu-bridge-helper",
+                                  "/usr/local/libexec/qemu-bridge-helper",
+                                  "/usr/lib/qemu-bridge-helper"};
+    for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+        if (filetype(paths[i], FT_FILE)) {
+            return paths[i];
+        }
+    }
+    printf("qemu-run: Cannot find qemu-bridge-helper, needed for "
+           "net_backend=bridge\n");
+    fatal(ERR_NET);
+    return "";
+}
+
+/* Checks the tap or bridge device before QEMU gets to fail on it. */
+static void net_check_host(int backend, long long queues) {
+    char *ifname = cfg[backend == NET_TAP ? KEY_NET_TAP : KEY_NET_BRIDGE].val;
+    char flags[BUFF_AVG], fpath[BUFF_AVG * 2];
+    if (backend == NET_BRIDGE) {
+        snprintf(fpath, sizeof(fpath), "/sys/class/net/%s/bridge", ifname);
+        if (!ifname[0] || !filetype(fpath, FT_PATH)) {
+            printf("qemu-run: net_bridge=%s is not a bridge on this host\n",
+                   ifname);
+            fatal(ERR_NET);
+        }
+        return;
+    }
+    if (!ifname[0] || !netdev_attr(ifname, "tun_flags", flags, sizeof(flags))) {
+        if (geteuid() != 0) {
+            printf("qemu-run: Warning: no tap device '%s', QEMU needs "
+                   "CAP_NET_ADMIN to create one\n",
+                   ifname);
+        }
+        return;
+    }
+    // IFF_MULTI_QUEUE, set by "ip tuntap add ... multi_queue".
+    if (queues > 1 && !(strtol(flags, NULL, 16) & 0x0100)) {
+        printf("qemu-run: tap device '%s' was not created multi_queue, needed "
+               "for net_queues=%lld\n",
+               ifname, queues);
+        fatal(ERR_NET);
+    }
+}
+
+void program_build_net(st_argv *out_args, const char *vm_name,
+                       bool vm_has_sharedf) {
+    int backend = net_backend();
+    bool virtio = strnicmp(cfg[KEY_NET].val, "virtio", 6) == 0 ||
+                  machine_microvm(),
+         vhost = 0;
+    long long queues = cfg[KEY_NET_QUEUES].num;
+    char num_a[24], num_b[24], mac[24];
+    DPRINT_S();
+    if (backend == NET_USER) {
+        program_build_net_user(out_args, vm_has_sharedf);
+        return;
+    }
+    if (vm_has_sharedf) {
+        printf("qemu-run: shared= is served by slirp, it needs "
+               "net_backend=user\n");
+        fatal(ERR_NET);
+    }
+    if (queues < 0) {
+        printf("qemu-run: net_queues=%lld is not a queue count\n", queues);
+        fatal(ERR_NET);
+    }
+    queues = !virtio ? 1 : queues ? queues : cfg[KEY_CORES].num;
+    if (backend == NET_BRIDGE && queues > 1) {
+        if (cfg[KEY_NET_QUEUES].num > 1) {
+            printf("qemu-run: Warning: qemu-bridge-helper taps are single "
+                   "queue, use a multi_queue net_tap= on the bridge\n");
+        }
+        queues = 1;
+    }
+    net_check_host(backend, queues);
+    if (virtio && !(vhost = access("/dev/vhost-net", R_OK | W_OK) == 0)) {
+        printf("qemu-run: Warning: /dev/vhost-net is not usable, the NIC is "
+               "served by QEMU itself (modprobe vhost_net?)\n");
+    }
+    snprintf(num_a, sizeof(num_a), "%lld", queues);
+    snprintf(num_b, sizeof(num_b), "%lld", 2 * queues + 2);
+    if (cfg[KEY_NET_MAC].val[0]) {
+        snprintf(mac, sizeof(mac), "%s", cfg[KEY_NET_MAC].val);
+    } else { // A stable MAC in QEMU's 52:54:00 range, per VM name.
+        unsigned int h = cfg_hash(vm_name, strlen(vm_name), 0);
+        snprintf(mac, sizeof(mac), "52:54:00:%02x:%02x:%02x", (h >> 16) & 0xff,
+                 (h >> 8) & 0xff, h & 0xff);
+    }
+    argv_push(out_args, "-netdev");
+    if (backend == NET_TAP) {
+        argv_pushx(out_args, "tap,id=net0,script=no,downscript=no", NULL);
+        if (cfg[KEY_NET_TAP].val[0]) {
+            argv_catx(out_args, ",ifname=", cfg[KEY_NET_TAP].val, NULL);
+        }
+        if (queues > 1) {
+            argv_catx(out_args, ",queues=", num_a, NULL);
+        }
+    } else {
+        argv_pushx(out_args, "tap,id=net0,br=", cfg[KEY_NET_BRIDGE].val,
+                   ",helper=", net_bridge_helper(), NULL);
+    }
+    argv_catx(out_args, vhost ? ",vhost=on" : ",vhost=off", NULL);
+    argv_push(out_args, "-device");
+    argv_pushx(out_args,
+               virtio ? virtio_dev("virtio-net-pci") : cfg[KEY_NET].val,
+               ",netdev=net0,mac=", mac, NULL);
+    if (queues > 1) { // MSI-X vectors only exist on PCI.
+        argv_catx(out_args, machine_microvm() ? ",mq=on" : ",mq=on,vectors=",
+                  machine_microvm() ? "" : num_b, NULL);
+    }
+}
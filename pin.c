@@ -0,0 +1,205 @@
+/* CPU pinning of the QEMU threads.
+ *
+ * vcpu_pin=, iothread_pin= and emulator_pin= take host CPU lists in the
+ * sysfs format ("0-3,8"). vcpu_pin and iothread_pin may also hold one
+ * ';' separated list per vCPU / iothread. The lists are checked against
+ * the host topology before QEMU starts, and applied once QMP reports the
+ * thread ids. Threads that are not vCPUs nor iothreads are emulator
+ * threads; they get emulator_pin, and later ones inherit it. */
+
+#include <sched.h>
+
+typedef struct {
+    cpu_set_t *sets;
+    int count;
+} st_pinset;
+
+static bool cpulist_parse(const char *str, size_t len, cpu_set_t *out_set) {
+    const char *end = str + len;
+    CPU_ZERO(out_set);
+    while (str < end) {
+        char *next;
+        long a = strtol(str, &next, 10), b = a;
+        if (next == str || a < 0) {
+            return 0;
+        }
+        if (*next == '-') {
+            str = next + 1;
+            b = strtol(str, &next, 10);
+            if (next == str || b < a) {
+                return 0;
+            }
+        }
+        if (b >= CPU_SETSIZE) {
+            return 0;
+        }
+        for (; a <= b; a++) {
+            CPU_SET(a, out_set);
+        }
+        str = next;
+        if (str < end && *str++ != ',') {
+            return 0;
+        }
+    }
+    return CPU_COUNT(out_set) > 0;
+}
+
+static bool cpulist_read(const char *fpath, cpu_set_t *out_set) {
+    char line[BUFF_MAX] = {0};
+    FILE *fh = fopen(fpath, "r");
+    if (!fh) {
+        return 0;
+    }
+    if (!fgets(line, sizeof(line), fh)) {
+        line[0] = '\0';
+    }
+    fclose(fh);
+    return cpulist_parse(line, strcspn(line, "\r\n"), out_set);
+}
+
+static void pinset_parse(int key, st_pinset *out) {
+    char *val = cfg[key].val;
+    memset(out, 0, sizeof(st_pinset));
+    if (!val[0]) {
+        return;
+    }
+    for (char *item = val;; item++) {
+        size_t len = strcspn(item, ";");
+        if (!(out->sets =
+                  realloc(out->sets, (out->count + 1) * sizeof(cpu_set_t)))) {
+            fatal(ERR_MEM);
+        }
+        if (!cpulist_parse(item, len, &out->sets[out->count++])) {
+            printf("qemu-run: %s: '%.*s' is not a CPU list\n", cfg[key].key,
+                   (int)len, item);
+            fatal(ERR_PIN);
+        }
+        item += len;
+        if (!*item) {
+            break;
+        }
+    }
+}
+
+bool pin_requested(void) {
+    return cfg[KEY_VCPU_PIN].val[0] || cfg[KEY_IOTHREAD_PIN].val[0] ||
+           cfg[KEY_EMULATOR_PIN].val[0];
+}
+
+/* Checks every pin set against the online CPUs, and warns about vCPU sets
+ * that span NUMA nodes, where memory accesses go across the interconnect. */
+void program_check_pinning(void) {
+    static const int keys[] = {KEY_VCPU_PIN, KEY_IOTHREAD_PIN,
+                               KEY_EMULATOR_PIN};
+    char fpath[BUFF_AVG];
+    cpu_set_t online, node, both;
+    st_pinset ps;
+    DPRINT_S();
+    if (!cpulist_read("/sys/devices/system/cpu/online", &online)) {
+        CPU_ZERO(&online);
+        for (long i = 0; i < sysconf(_SC_NPROCESSORS_ONLN); i++) {
+            CPU_SET(i, &online);
+        }
+    }
+    for (size_t k = 0; k < sizeof(keys) / sizeof(keys[0]); k++) {
+        pinset_parse(keys[k], &ps);
+        for (int i = 0; i < ps.count; i++) {
+            CPU_AND(&both, &ps.sets[i], &online);
+            if (!CPU_EQUAL(&both, &ps.sets[i])) {
+                printf("qemu-run: %s names CPUs that are not online\n",
+                       cfg[keys[k]].key);
+                fatal(ERR_PIN);
+            }
+            for (int n = 0; keys[k] == KEY_VCPU_PIN; n++) {
+                snprintf(fpath, sizeof(fpath),
+                         "/sys/devices/system/node/node%d/cpulist", n);
+                if (!cpulist_read(fpath, &node)) {
+                    break;
+                }
+                CPU_AND(&both, &ps.sets[i], &node);
+                if (CPU_COUNT(&both) && !CPU_EQUAL(&both, &ps.sets[i])) {
+                    printf("qemu-run: Warning: vcpu_pin set %d spans NUMA "
+                           "nodes\n",
+                           i);
+                    break;
+                }
+            }
+        }
+        if (keys[k] == KEY_VCPU_PIN && ps.count > 1 &&
+            ps.count != cfg[KEY_CORES].num) {
+            printf("qemu-run: vcpu_pin needs one CPU list, or one per vCPU "
+                   "(%lld)\n",
+                   cfg[KEY_CORES].num);
+            fatal(ERR_PIN);
+        }
+        free(ps.sets);
+    }
+}
+
+static void pin_thread(long tid, const cpu_set_t *set, const char *what) {
+    if (sched_setaffinity((pid_t)tid, sizeof(cpu_set_t), set) != 0) {
+        printf("qemu-run: Cannot pin %s thread %ld: %s\n", what, tid,
+               strerror(errno));
+    }
+}
+
+/* Pins the threads listed by a QMP query ("thread-id" of each item), to
+ * the only set or to the set matching the item position. Every pinned
+ * thread id is appended to tids. */
+static void pin_from_query(st_qmp *q, const char *cmd, int key,
+                           long *tids, int *ntids, int max_tids) {
+    st_pinset ps;
+    const char *ret, *item;
+    char *reply = qmp_execute(q, cmd, NULL, 5000);
+    long long tid;
+    if (!reply || !(ret = json_member(reply, "return"))) {
+        printf("qemu-run: QMP %s failed, threads left unpinned\n", cmd);
+        return;
+    }
+    pinset_parse(key, &ps);
+    for (int i = 0; (item = json_item(ret, i)); i++) {
+        if (!json_int(item, "thread-id", &tid)) {
+            continue;
+        }
+        if (*ntids < max_tids) {
+            tids[(*ntids)++] = (long)tid;
+        }
+        if (ps.count == 1 || i < ps.count) {
+            pin_thread((long)tid, &ps.sets[ps.count == 1 ? 0 : i],
+                       cfg[key].key);
+        } else if (ps.count) {
+            printf("qemu-run: %s has no CPU list for thread %d\n",
+                   cfg[key].key, i);
+        }
+    }
+    free(ps.sets);
+}
+
+void pin_apply(st_qmp *q, pid_t qemu_pid) {
+    long tids[1024];
+    int ntids = 0;
+    char task_dir[BUFF_AVG];
+    st_pinset ps;
+    DIR *dir;
+    struct dirent *de;
+    DPRINT_S();
+    pin_from_query(q, "query-cpus-fast", KEY_VCPU_PIN, tids, &ntids, 1024);
+    pin_from_query(q, "query-iothreads", KEY_IOTHREAD_PIN, tids, &ntids,
+                   1024);
+    pinset_parse(KEY_EMULATOR_PIN, &ps);
+    snprintf(task_dir, sizeof(task_dir), "/proc/%ld/task", (long)qemu_pid);
+    if (ps.count && (dir = opendir(task_dir))) {
+        while ((de = readdir(dir))) {
+            long tid = atol(de->d_name);
+            bool known = tid <= 0;
+            for (int i = 0; i < ntids && !known; i++) {
+                known = tids[i] == tid;
+            }
+            if (!known) {
+                pin_thread(tid, &ps.sets[0], "emulator");
+            }
+        }
+        closedir(dir);
+    }
+    free(ps.sets);
+}
@@ -0,0 +1,290 @@
+/* Pools of paused VMs: qemu-run --pool <template> [--count N] keeps N
+ * ephemeral instances of a template started with -S, their QEMU set up
+ * and RAM allocated, and starts a new one whenever one is handed out.
+ * qemu-run --take <template> hands one out: it claims an instance with a
+ * rename() from the pool ready/ folder into taken/, so concurrent takers
+ * never get the same one, resumes it and prints it as JSON.
+ *
+ * Instances run in their own session, so stopping the pool (^C) quits
+ * the spare instances but leaves the ones handed out running.
+ *
+ * An instance that exits before it is handed out is replaced after a
+ * delay, 1 s doubling up to POOL_BACKOFF_MAX_MS, so a broken template
+ * does not fork in a loop. The delay resets once an instance is handed
+ * out or stays up POOL_STABLE_MS, and the pool gives up after
+ * POOL_MAX_FAILURES failures in a row. */
+
+#define POOL_BACKOFF_MAX_MS 60000
+#define POOL_STABLE_MS 60000
+#define POOL_MAX_FAILURES 5
+
+typedef struct {
+    pid_t pid; /**< The instance supervisor, also its name in ready/ */
+    bool taken;
+    double started;
+} st_pool_vm;
+
+static char pool_ready_link[PATH_MAX + BUFF_AVG];
+static char pool_instance_dir[PATH_MAX];
+static volatile sig_atomic_t pool_stop;
+
+bool pool_instance_requested(void) {
+    return pool_ready_link[0];
+}
+
+/* Runs in the instance supervisor once QMP answers: QEMU is up, paused,
+ * and can be handed out. */
+void pool_announce(void) {
+    if (symlink(pool_instance_dir, pool_ready_link) != 0) {
+        printf("qemu-run: Cannot add %s to the pool: %s\n", pool_ready_link,
+               strerror(errno));
+    }
+}
+
+/* The pool folder sits next to the instance folders, in ephemeral_dir=.
+ * Expects the template config loaded. */
+static void pool_dir(const char *tmpl_name, char *out_dir, size_t size) {
+    const char *base = cfg[KEY_EPHEMERAL_DIR].val;
+    if (!base[0] && !(base = getenv("TMPDIR"))) {
+        base = "/tmp";
+    }
+    snprintf(out_dir, size, "%s/qemu-run-pool-%s", base, tmpl_name);
+}
+
+static void pool_load_template(const char *tmpl_name) {
+    char vm_cfg_file[BUFF_AVG];
+    program_find_vm_and_chdir(tmpl_name, vm_cfg_file);
+    program_set_default_cfg_values();
+    program_load_config(vm_cfg_file);
+}
+
+static void pool_instance(const char *tmpl_name, const char *dir) {
+    char name[BUFF_AVG * 2];
+    st_argv args = {0};
+    int rc;
+    setsid(); // Out of the pool's process group, away from its ^C.
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    ephemeral_prepare(tmpl_name, pool_instance_dir, name);
+    program_build_cmd_line(name, &args);
+    argv_push(&args, "-S");
+    ports_write();
+#ifdef __linux__
+    cgroup_enter(name);
+#endif
+    snprintf(pool_ready_link, sizeof(pool_ready_link), "%s/ready/%ld", dir,
+             (long)getpid());
+    rc = program_run_supervised(&args);
+    ephemeral_cleanup(pool_instance_dir);
+    unlink(pool_ready_link);
+    snprintf(pool_ready_link, sizeof(pool_ready_link), "%s/taken/%ld", dir,
+             (long)getpid());
+    unlink(pool_ready_link);
+    fflush(stdout);
+    _exit(rc);
+}
+
+static void pool_on_signal(int sig) {
+    (void)sig;
+    pool_stop = 1;
+}
+
+/* Tells the spare instances to quit through their QMP socket, waiting
+ * for the ones still starting up to get there, and reaps them. */
+static void pool_quit(const char *dir, st_pool_vm *vms, int count) {
+    char fpath[PATH_MAX + BUFF_AVG], target[PATH_MAX];
+    double deadline = now_ms() + 30000;
+    int left;
+    st_qmp q;
+    do {
+        left = 0;
+        for (int i = 0; i < count; i++) {
+            ssize_t len;
+            if (vms[i].taken || vms[i].pid <= 0) {
+                continue;
+            }
+            if (waitpid(vms[i].pid, NULL, WNOHANG) == vms[i].pid) {
+                vms[i].pid = 0;
+                continue;
+            }
+            left++;
+            snprintf(fpath, sizeof(fpath), "%s/ready/%ld", dir,
+                     (long)vms[i].pid);
+            if ((len = readlink(fpath, target, sizeof(target) - 1)) <= 0) {
+                continue; // Not up yet.
+            }
+            target[len] = '\0';
+            snprintf(fpath, sizeof(fpath), "%s/" QMP_SOCKET, target);
+            if (qmp_connect(&q, fpath, 0, 1000)) {
+                qmp_execute(&q, "quit", NULL, 1000);
+                qmp_close(&q);
+            }
+        }
+        usleep(50000);
+    } while (left && now_ms() < deadline);
+}
+
+int program_run_pool(const char *tmpl_name, int count) {
+    char dir[PATH_MAX], fpath[PATH_MAX + BUFF_AVG];
+    st_pool_vm *vms = NULL;
+    int nvms = 0, cap = 0, handed = 0, failures = 0;
+    double next_start = 0;
+    DPRINT_S();
+    pool_load_template(tmpl_name);
+    pool_dir(tmpl_name, dir, sizeof(dir));
+    snprintf(fpath, sizeof(fpath), "%s/ready", dir);
+    mkdir(dir, 0700);
+    mkdir(fpath, 0700);
+    snprintf(fpath, sizeof(fpath), "%s/taken", dir);
+    if (mkdir(fpath, 0700) != 0 && errno != EEXIST) {
+        fatal(ERR_EPHEMERAL);
+    }
+    signal(SIGINT, pool_on_signal);
+    signal(SIGTERM, pool_on_signal);
+    printf("[pool] %s: keeping %d paused instances in %s\n", tmpl_name, count,
+           dir);
+    while (!pool_stop && failures <= POOL_MAX_FAILURES) {
+        int spare = 0, status;
+        double now = now_ms();
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (int i = 0; i < nvms; i++) {
+                if (vms[i].pid != pid) {
+                    continue;
+                }
+                if (!vms[i].taken) {
+                    int delay = failures < 6 ? 1000 << failures
+                                             : POOL_BACKOFF_MAX_MS;
+                    delay = delay < POOL_BACKOFF_MAX_MS ? delay
+                                                        : POOL_BACKOFF_MAX_MS;
+                    failures++;
+                    next_start = now + delay;
+                    printf("[pool] %s: instance %ld exited with status %d "
+                           "before it was handed out, next in %.0f s\n",
+                           tmpl_name, (long)pid,
+                           WIFEXITED(status) ? WEXITSTATUS(status)
+                                             : 128 + WTERMSIG(status),
+                           delay / 1000.0);
+                }
+                vms[i] = vms[--nvms];
+                break;
+            }
+        }
+        for (int i = 0; i < nvms; i++) {
+            snprintf(fpath, sizeof(fpath), "%s/taken/%ld", dir,
+                     (long)vms[i].pid);
+            if (!vms[i].taken && access(fpath, F_OK) == 0) {
+                vms[i].taken = 1;
+                printf("[pool] %s: instance %ld handed out\n", tmpl_name,
+                       (long)vms[i].pid);
+                handed++;
+                failures = 0;
+            }
+            if (!vms[i].taken && now - vms[i].started >= POOL_STABLE_MS) {
+                failures = 0;
+            }
+            spare += !vms[i].taken;
+        }
+        for (; spare < count && now >= next_start &&
+               failures <= POOL_MAX_FAILURES;
+             spare++) {
+            if (nvms == cap) {
+                cap = cap ? cap * 2 : 16;
+                if (!(vms = realloc(vms, cap * sizeof(st_pool_vm)))) {
+                    fatal(ERR_MEM);
+                }
+            }
+            fflush(stdout);
+            if ((pid = fork()) < 0) {
+                fatal(ERR_EXEC);
+            }
+            if (pid == 0) {
+                pool_instance(tmpl_name, dir);
+            }
+            vms[nvms].pid = pid;
+            vms[nvms].started = now;
+            vms[nvms++].taken = 0;
+        }
+        usleep(50000);
+    }
+    if (failures > POOL_MAX_FAILURES) {
+        printf("[pool] %s: giving up after %d failed instances in a row\n",
+               tmpl_name, failures);
+    }
+    pool_quit(dir, vms, nvms);
+    printf("[pool] %s: stopped, %d instances handed out\n", tmpl_name,
+           handed);
+    free(vms);
+    return failures > POOL_MAX_FAILURES;
+}
+
+/* Claims a ready instance, resumes it and prints it as JSON. */
+int program_take(const char *tmpl_name) {
+    char dir[PATH_MAX], from[PATH_MAX * 2], to[PATH_MAX * 2],
+        target[PATH_MAX], qmp_path[PATH_MAX + 16], ports_path[PATH_MAX + 16],
+        line[BUFF_AVG], *eq;
+    double t = now_ms();
+    struct dirent *de;
+    ssize_t len = 0;
+    DIR *dh;
+    st_qmp q;
+    FILE *fh;
+    char *reply;
+    DPRINT_S();
+    pool_load_template(tmpl_name);
+    pool_dir(tmpl_name, dir, sizeof(dir));
+    snprintf(from, sizeof(from), "%s/ready", dir);
+    if (!(dh = opendir(from))) {
+        printf("qemu-run: No pool for %s, start one with --pool\n",
+               tmpl_name);
+        return 1;
+    }
+    while ((de = readdir(dh))) {
+        if (de->d_name[0] == '.') {
+            continue;
+        }
+        snprintf(from, sizeof(from), "%s/ready/%s", dir, de->d_name);
+        snprintf(to, sizeof(to), "%s/taken/%s", dir, de->d_name);
+        if (rename(from, to) == 0 &&
+            (len = readlink(to, target, sizeof(target) - 1)) > 0) {
+            break; // Ours: nobody else can rename it now.
+        }
+        len = 0;
+    }
+    closedir(dh);
+    if (len <= 0) {
+        printf("qemu-run: The %s pool is empty\n", tmpl_name);
+        return 1;
+    }
+    target[len] = '\0';
+    snprintf(qmp_path, sizeof(qmp_path), "%s/" QMP_SOCKET, target);
+    if (!qmp_connect(&q, qmp_path, 0, 2000) ||
+        !(reply = qmp_execute(&q, "cont", NULL, 2000)) ||
+        !json_member(reply, "return")) {
+        fatal(ERR_QMP);
+    }
+    qmp_close(&q);
+    snprintf(line, sizeof(line), "%s%s", tmpl_name, strrchr(target, '.'));
+    fputs("{\"name\": ", stdout);
+    json_print_str(stdout, line);
+    fputs(", \"dir\": ", stdout);
+    json_print_str(stdout, target);
+    fputs(", \"qmp\": ", stdout);
+    json_print_str(stdout, qmp_path);
+    fputs(", \"ports\": {", stdout);
+    snprintf(ports_path, sizeof(ports_path), "%s/" PORTS_FILE, target);
+    if ((fh = fopen(ports_path, "r"))) {
+        for (int n = 0; fgets(line, sizeof(line), fh); n++) {
+            line[strcspn(line, "\n")] = '\0';
+            if ((eq = strchr(line, '='))) {
+                *eq = '\0';
+                fputs(n ? ", " : "", stdout);
+                json_print_str(stdout, line);
+                printf(": %d", atoi(eq + 1));
+            }
+        }
+        fclose(fh);
+    }
+    printf("}, \"take_ms\": %.1f}\n", now_ms() - t);
+    return 0;
+}
@@ -0,0 +1,246 @@
+/* Host port allocation for fwd_ports=, vnc_port= and monitor_port=.
+ *
+ * "auto" picks a free port: fwd_ports=auto:22 forwards one to guest port
+ * 22, fwd_ports=2200-2299:22 picks one in that range. A port is taken by
+ * creating a claim file named after it, holding the pid that owns it
+ * (QEMU itself once exec()ed, or its supervisor), in a folder shared by
+ * every qemu-run of the user. Claims of dead pids are stale and reused,
+ * all under an flock(), so concurrent launches never pick the same port
+ * even before QEMU binds it. The ports a VM got are written to
+ * PORTS_FILE in its folder, and preferred on its next start. */
+
+#define PORTS_FILE "ports"
+#define PORTS_AUTO_LO 20000
+#define PORTS_AUTO_HI 29999
+#define PORTS_VNC_LO 5900
+#define PORTS_VNC_HI 6899
+
+static char ports_fwd[BUFF_AVG], ports_vnc[12], ports_monitor[12];
+
+/* $XDG_RUNTIME_DIR/qemu-run, or /tmp/qemu-run-<uid>, made if missing.
+ * Anybody can make the /tmp one first, so it is only used if it is a
+ * folder of this user that nobody else can get into. */
+bool runtime_dir(char *out_dir, size_t size) {
+    const char *run = getenv("XDG_RUNTIME_DIR");
+    struct stat st;
+    if (run && run[0]) {
+        snprintf(out_dir, size, "%s/qemu-run", run);
+    } else {
+        snprintf(out_dir, size, "/tmp/qemu-run-%ld", (long)getuid());
+    }
+    mkdir(out_dir, 0700);
+    if (lstat(out_dir, &st) != 0 || !S_ISDIR(st.st_mode) ||
+        st.st_uid != getuid() || (st.st_mode & 07777) != 0700) {
+        printf("qemu-run: %s is not a folder of this user with mode 0700\n",
+               out_dir);
+        return 0;
+    }
+    return 1;
+}
+
+static void ports_claim_dir(char *out_dir, size_t size) {
+    if (!runtime_dir(out_dir, size)) {
+        fatal(ERR_PORTS);
+    }
+    snprintf(out_dir + strlen(out_dir), size - strlen(out_dir), "/ports");
+    mkdir(out_dir, 0700);
+}
+
+/* Whether nothing listens on port, TCP and (for forwards) UDP. */
+static bool port_bindable(int port, bool udp) {
+    struct sockaddr_in addr = {.sin_family = AF_INET};
+    bool ok = 1;
+    addr.sin_port = htons(port);
+    for (int i = 0; i < 1 + udp && ok; i++) {
+        int fd = socket(AF_INET, i ? SOCK_DGRAM : SOCK_STREAM, 0);
+        ok = fd >= 0 && bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    return ok;
+}
+
+/* Claims port for this process, unless a live process holds it. */
+static bool port_claim(const char *dir, int port, bool udp) {
+    char fpath[PATH_MAX + 16], pid_str[24] = {0};
+    int fd = -1;
+    snprintf(fpath, sizeof(fpath), "%s/%d", dir, port);
+    for (int tries = 0; tries < 2 && fd < 0; tries++) {
+        if ((fd = open(fpath, O_WRONLY | O_CREAT | O_EXCL, 0600)) >= 0) {
+            break;
+        }
+        int old = open(fpath, O_RDONLY);
+        long pid = 0;
+        if (old >= 0) {
+            if (read(old, pid_str, sizeof(pid_str) - 1) > 0) {
+                pid = atol(pid_str);
+            }
+            close(old);
+        }
+        if (pid > 0 && (kill((pid_t)pid, 0) == 0 || errno == EPERM)) {
+            return 0;
+        }
+        unlink(fpath); // Stale.
+    }
+    if (fd < 0) {
+        return 0;
+    }
+    if (!port_bindable(port, udp)) { // Someone outside qemu-run has it.
+        close(fd);
+        unlink(fpath);
+        return 0;
+    }
+    dprintf(fd, "%ld\n", (long)getpid());
+    close(fd);
+    return 1;
+}
+
+static int port_alloc(const char *dir, int lo, int hi, int prefer, bool udp) {
+    if (prefer >= lo && prefer <= hi && port_claim(dir, prefer, udp)) {
+        return prefer;
+    }
+    for (int port = lo; port <= hi; port++) {
+        if (port != prefer && port_claim(dir, port, udp)) {
+            return port;
+        }
+    }
+    printf("qemu-run: No free host port in %d-%d\n", lo, hi);
+    fatal(ERR_PORTS);
+    return -1;
+}
+
+/* The port this VM got last time for key, from PORTS_FILE, or 0. */
+static int ports_previous(const char *key) {
+    char line[BUFF_AVG];
+    size_t key_len = strlen(key);
+    int port = 0;
+    FILE *fh = fopen(PORTS_FILE, "r");
+    while (fh && fgets(line, sizeof(line), fh)) {
+        if (strncmp(line, key, key_len) == 0 && line[key_len] == '=') {
+            port = atoi(line + key_len + 1);
+        }
+    }
+    if (fh) {
+        fclose(fh);
+    }
+    return port;
+}
+
+static bool ports_fwd_auto(void) {
+    char *fwd = cfg[KEY_FWD_PORTS].val;
+    return strncmp(fwd, "auto:", 5) == 0 ||
+           (isdigit((unsigned char)fwd[0]) && strchr(fwd, '-') &&
+            strchr(fwd, ':') > strchr(fwd, '-'));
+}
+
+static bool ports_vnc_auto(void) {
+    return cfg[KEY_HEADLESS].num && stricmp(cfg[KEY_VNC_PORT].val, "auto") == 0;
+}
+
+static bool ports_monitor_auto(void) {
+    return stricmp(cfg[KEY_MONITOR_PORT].val, "auto") == 0;
+}
+
+/* Resolves the auto and range values of the port keys into the ports to
+ * use, in place. Runs from the VM folder, before building the argv. */
+void program_alloc_ports(void) {
+    char dir[PATH_MAX], lock_path[PATH_MAX + 8], *fwd = cfg[KEY_FWD_PORTS].val;
+    int lock_fd, lo = PORTS_AUTO_LO, hi = PORTS_AUTO_HI;
+    DPRINT_S();
+    if (!ports_fwd_auto() && !ports_vnc_auto() && !ports_monitor_auto()) {
+        return;
+    }
+    ports_claim_dir(dir, sizeof(dir));
+    snprintf(lock_path, sizeof(lock_path), "%s/.lock", dir);
+    if ((lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0 ||
+        flock(lock_fd, LOCK_EX) != 0) {
+        fatal(ERR_PORTS);
+    }
+    if (ports_fwd_auto()) {
+        if (strncmp(fwd, "auto:", 5) != 0 &&
+            (sscanf(fwd, "%d-%d", &lo, &hi) != 2 || lo < 1 || hi > 65535 ||
+             lo > hi)) {
+            printf("qemu-run: fwd_ports=%s is not a valid port range\n", fwd);
+            fatal(ERR_PORTS);
+        }
+        snprintf(ports_fwd, sizeof(ports_fwd), "%d:%s",
+                 port_alloc(dir, lo, hi, ports_previous("fwd_host_port"), 1),
+                 strchr(fwd, ':') + 1);
+        cfg_put(KEY_FWD_PORTS, ports_fwd);
+    }
+    if (ports_vnc_auto()) {
+        snprintf(ports_vnc, sizeof(ports_vnc), "%d",
+                 port_alloc(dir, PORTS_VNC_LO, PORTS_VNC_HI,
+                            ports_previous("vnc_port"), 0));
+        cfg_put(KEY_VNC_PORT, ports_vnc);
+    }
+    if (ports_monitor_auto()) {
+        snprintf(ports_monitor, sizeof(ports_monitor), "%d",
+                 port_alloc(dir, PORTS_AUTO_LO, PORTS_AUTO_HI,
+                            ports_previous("monitor_port"), 0));
+        cfg_put(KEY_MONITOR_PORT, ports_monitor);
+    }
+    close(lock_fd);
+}
+
+/* Copies of one template cannot share its fixed host ports: turns them
+ * into auto ones. */
+void ports_make_auto(void) {
+    char fwd[BUFF_AVG], *guest = strchr(cfg[KEY_FWD_PORTS].val, ':');
+    if (isdigit((unsigned char)cfg[KEY_FWD_PORTS].val[0]) && guest &&
+        !ports_fwd_auto()) {
+        snprintf(fwd, sizeof(fwd), "auto%s", guest);
+        cfg_put(KEY_FWD_PORTS, l_str_dup(fwd));
+    }
+    if (isdigit((unsigned char)cfg[KEY_VNC_PORT].val[0])) {
+        cfg_put(KEY_VNC_PORT, "auto");
+    }
+    if (isdigit((unsigned char)cfg[KEY_MONITOR_PORT].val[0])) {
+        cfg_put(KEY_MONITOR_PORT, "auto");
+    }
+}
+
+/* Takes the ports recorded in PORTS_FILE as they are, without claiming
+ * them: for rebuilding the argv of the VM that just ran with them. */
+void ports_reuse(void) {
+    int fwd = ports_previous("fwd_host_port"), vnc = ports_previous("vnc_port"),
+        monitor = ports_previous("monitor_port");
+    if (ports_fwd_auto() && fwd > 0) {
+        snprintf(ports_fwd, sizeof(ports_fwd), "%d:%s", fwd,
+                 strchr(cfg[KEY_FWD_PORTS].val, ':') + 1);
+        cfg_put(KEY_FWD_PORTS, ports_fwd);
+    }
+    if (ports_vnc_auto() && vnc > 0) {
+        snprintf(ports_vnc, sizeof(ports_vnc), "%d", vnc);
+        cfg_put(KEY_VNC_PORT, ports_vnc);
+    }
+    if (ports_monitor_auto() && monitor > 0) {
+        snprintf(ports_monitor, sizeof(ports_monitor), "%d", monitor);
+        cfg_put(KEY_MONITOR_PORT, ports_monitor);
+    }
+}
+
+/* Records the host ports the VM listens on in PORTS_FILE. */
+void ports_write(void) {
+    FILE *fh;
+    char *fwd = cfg[KEY_FWD_PORTS].val;
+    bool fwd_on = stricmp(fwd, "no") != 0 && fwd[0] &&
+                  stricmp(cfg[KEY_NET].val, "no") != 0 &&
+                  net_backend() == NET_USER;
+    if (!(fh = fopen(PORTS_FILE ".tmp", "w"))) {
+        return;
+    }
+    if (fwd_on) {
+        fprintf(fh, "fwd_host_port=%d\nfwd_guest_port=%s\n", atoi(fwd),
+                strchr(fwd, ':') ? strchr(fwd, ':') + 1 : fwd);
+    }
+    if (cfg[KEY_HEADLESS].num) {
+        fprintf(fh, "vnc_port=%s\n", cfg[KEY_VNC_PORT].val);
+    }
+    if (cfg[KEY_MONITOR_PORT].val[0]) {
+        fprintf(fh, "monitor_port=%s\n", cfg[KEY_MONITOR_PORT].val);
+    }
+    fclose(fh);
+    rename(PORTS_FILE ".tmp", PORTS_FILE);
+}
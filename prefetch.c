@@ -0,0 +1,195 @@
+/* Boot prefetch: prefetch=yes keeps the list of image extents the guest
+ * reads while it boots in PREFETCH_FILE in the VM folder (prefetch=<file>
+ * puts it elsewhere). On later launches those extents are read into the
+ * host page cache while QEMU starts, one process per image, so a cold
+ * boot from slow or network storage reads sequentially instead of
+ * seeking for every block the guest asks for.
+ *
+ * The list is made on the first launch without one: the images' cached
+ * pages are dropped, and once the guest is up (the end of the launch
+ * trace with QEMURUN_TRACE, else PREFETCH_RECORD_MS later) the pages back
+ * in the page cache are the boot reads, found with mincore(). Remove the
+ * list to record it again. Disks opened with O_DIRECT (disk_cache=none or
+ * directsync) skip the page cache, so they are left out. */
+
+#include <sys/mman.h>
+
+#define PREFETCH_FILE "prefetch.list"
+#define PREFETCH_RECORD_MS 60000
+#define PREFETCH_GAP (256 << 10) // Extents closer than this are merged.
+#define PREFETCH_MAX_IMAGES 16
+
+/* The list file, NULL with prefetch=no. */
+static const char *prefetch_list(void) {
+    long long on = 0;
+    const char *val = cfg[KEY_PREFETCH].val;
+    if (!val[0] || cfg_convert(CFG_BOOL, val, &on)) {
+        return on ? PREFETCH_FILE : NULL;
+    }
+    return val;
+}
+
+bool prefetch_recording(void) {
+    return prefetch_list() && !filetype(prefetch_list(), FT_FILE);
+}
+
+/* Absolute paths of the images the guest reads through the page cache. */
+static int prefetch_images(char out[][PATH_MAX]) {
+    char fpath[PATH_MAX], cache[BUFF_AVG];
+    int n = 0;
+    const int keys[] = {KEY_KERNEL, KEY_INITRD, KEY_FLOPPY, KEY_CDROM};
+    for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+        if (cfg[keys[i]].val[0] && realpath(cfg[keys[i]].val, out[n])) {
+            n++;
+        }
+    }
+    for (int i = 0; i < cfg[KEY_DISK].num && n < PREFETCH_MAX_IMAGES; i++) {
+        cfg_list_item(KEY_DISK, i, fpath, sizeof(fpath));
+        cfg_list_item(KEY_DISK_CACHE, i, cache, sizeof(cache));
+        if (strcmp(cache, "none") != 0 && strcmp(cache, "directsync") != 0 &&
+            realpath(fpath, out[n])) {
+            n++;
+        }
+    }
+    return n;
+}
+
+static void prefetch_file(const char *fpath) {
+    long long offset, length;
+    char line[PATH_MAX + 64];
+    int path_at, fd = open(fpath, O_RDONLY | O_CLOEXEC);
+    FILE *list;
+    if (fd < 0) {
+        return;
+    }
+    if (!(list = fopen(prefetch_list(), "r"))) {
+        close(fd);
+        return;
+    }
+    while (fgets(line, sizeof(line), list)) {
+        line[strcspn(line, "\n")] = '\0';
+        if (sscanf(line, "%lld %lld %n", &offset, &length, &path_at) == 2 &&
+            strcmp(line + path_at, fpath) == 0) {
+            readahead(fd, offset, length);
+        }
+    }
+    fclose(list);
+    close(fd);
+}
+
+/* Runs right before QEMU starts, and does not wait for the reads. */
+void prefetch_start(void) {
+    char images[PREFETCH_MAX_IMAGES][PATH_MAX];
+    int n;
+    pid_t pid;
+    if (!prefetch_list()) {
+        return;
+    }
+    DPRINT_S();
+    n = prefetch_images(images);
+    if (prefetch_recording()) { // Cold, so what is cached later was read.
+        for (int i = 0; i < n; i++) {
+            int fd = open(images[i], O_RDONLY | O_CLOEXEC);
+            if (fd >= 0) {
+                posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+                close(fd);
+            }
+        }
+        return;
+    }
+    fflush(stdout);
+    if ((pid = fork()) != 0) {
+        if (pid > 0) { // Its children are handed over to init.
+            waitpid(pid, NULL, 0);
+        }
+        return;
+    }
+    for (int i = 0; i < n; i++) {
+        if (fork() == 0) {
+            prefetch_file(images[i]);
+            _exit(0);
+        }
+    }
+    _exit(0);
+}
+
+/* Appends the cached extents of one image to the list. */
+static long long prefetch_record_file(const char *fpath, FILE *list) {
+    long long page = sysconf(_SC_PAGESIZE), window = 1LL << 30, total = 0,
+              ext_start = -1, ext_end = -1;
+    unsigned char *vec = malloc(window / page);
+    struct stat st;
+    int fd = open(fpath, O_RDONLY | O_CLOEXEC);
+    if (!vec || fd < 0 || fstat(fd, &st) != 0) {
+        free(vec);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 0;
+    }
+    for (long long off = 0; off < st.st_size; off += window) {
+        long long len = st.st_size - off < window ? st.st_size - off : window;
+        void *map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, off);
+        if (map == MAP_FAILED) {
+            break;
+        }
+        if (mincore(map, len, vec) == 0) {
+            for (long long p = 0; p < (len + page - 1) / page; p++) {
+                long long at = off + p * page;
+                if (!(vec[p] & 1)) {
+                    continue;
+                }
+                if (ext_end >= 0 && at - ext_end <= PREFETCH_GAP) {
+                    ext_end = at + page;
+                    continue;
+                }
+                if (ext_end >= 0) {
+                    fprintf(list, "%lld %lld %s\n", ext_start,
+                            ext_end - ext_start, fpath);
+                    total += ext_end - ext_start;
+                }
+                ext_start = at;
+                ext_end = at + page;
+            }
+        }
+        munmap(map, len);
+    }
+    if (ext_end >= 0) {
+        fprintf(list, "%lld %lld %s\n", ext_start, ext_end - ext_start, fpath);
+        total += ext_end - ext_start;
+    }
+    free(vec);
+    close(fd);
+    return total;
+}
+
+/* Runs in the supervisor: waits for the boot to be over and saves what it
+ * read. The trace, when there is one, has already waited for the guest. */
+void prefetch_record(pid_t qemu_pid) {
+    char images[PREFETCH_MAX_IMAGES][PATH_MAX], tmp[PATH_MAX];
+    long long total = 0;
+    int n;
+    FILE *list;
+    DPRINT_S();
+    for (int i = 0; !trace_requested() && i < PREFETCH_RECORD_MS / 100; i++) {
+        if (pid_exited(qemu_pid)) {
+            return; // Too short a run to tell what booting needs.
+        }
+        usleep(100000);
+    }
+    n = prefetch_images(images);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", prefetch_list());
+    if (!(list = fopen(tmp, "w"))) {
+        printf("qemu-run: Cannot write %s\n", tmp);
+        return;
+    }
+    for (int i = 0; i < n; i++) {
+        total += prefetch_record_file(images[i], list);
+    }
+    if (fclose(list) != 0 || rename(tmp, prefetch_list()) != 0) {
+        unlink(tmp);
+        return;
+    }
+    printf("qemu-run: %lld MiB of boot reads recorded in %s\n", total >> 20,
+           prefetch_list());
+}
@@ -11,13 +11,35 @@ enum {
     ERR_NETCONF_IP,
     ERR_SHAREDF,
     ERR_EXEC,
+    ERR_MEM,
+    ERR_INDEX,
+    ERR_PIN,
+    ERR_HUGEPAGES,
+    ERR_DISK,
+    ERR_NET,
+    ERR_QMP,
+    ERR_STATE,
+    ERR_EPHEMERAL,
+    ERR_PORTS,
+    ERR_MACHINE,
+    ERR_CGROUP,
+    ERR_DAEMON,
     ERR_ENDLIST
 };
 
 void fatal(unsigned int errcode) {
     char *errs[] = {
         "Unkown error.", // ERR_UNKOWN
-        "Invalid argument count. Did you specified the VM Name?",
+        "Invalid arguments. Usage: qemu-run [--print-argv] <vm name> | "
+        "<vm name> --suspend | <vm name> qmp <command> [arguments] | "
+        "<vm name> qmp --events | "
+        "<vm name> console [--follow] | <vm name> --start | "
+        "<vm name> --stop | --daemon | --status | "
+        "--fleet <vm names...> | --all | --ephemeral <template> [--count N] | "
+        "--pool <template> [--count N] | --take <template> | "
+        "--metrics [--interval S] [--json] [vm names...] | "
+        "--trace-summary [trace files...] | --list | "
+        "--check [config files...]",
         "Cannot find VM. Please check your QEMURUN_VM_PATH env. variable",
         "Cannot access VM folder. Maybe check its permissions",
         "Cannot find VM config file. Is it created?",
@@ -26,35 +48,185 @@ void fatal(unsigned int errcode) {
         "Invalid configuration: VM has enabled network, but has IPv6 and IPv4 "
         "disabled. Please enable at least one",
         "Invalid configuration: VM has disabled network, and specified a "
-        "shared folder. Enable network or disable the shared folder.",
-        "There was an error trying to execute qemu. Is it installed?"};
+        "shared folder. Enable network, use shared_backend=virtiofs or "
+        "disable the shared folder.",
+        "There was an error trying to execute qemu. Is it installed?",
+        "Out of memory",
+        "Cannot read or write the VM index. Check $XDG_CACHE_HOME or $HOME",
+        "Invalid CPU pinning (vcpu_pin, iothread_pin or emulator_pin)",
+        "Cannot set up guest memory (hugepages, mem_prealloc, numa_nodes or "
+        "mem_density)",
+        "Invalid disk configuration (disk_cache, disk_aio, disk_queues, "
+        "disk_iothread, disk_iops or disk_bps)",
+        "Invalid network configuration (net_backend, net_tap, net_bridge or "
+        "net_queues)",
+        "Cannot talk to the VM over QMP. Is it running?",
+        "Cannot save the VM state. Is there enough disk space?",
+        "Cannot set up the ephemeral VM. Is qemu-img installed, and "
+        "ephemeral_dir writable?",
+        "Cannot allocate host ports (fwd_ports, vnc_port or monitor_port)",
+        "Invalid machine or boot configuration (machine, kernel, initrd, "
+        "append or efi)",
+        "Cannot set up the VM cgroup (cgroup_cpu_max, cgroup_mem_max, "
+        "cgroup_io_max or cgroup_weight)",
+        "Cannot start the daemon. Is one already running?"};
     DPRINT_S();
     printf("There was an error in the program:\n\t%s.\n",
            errs[errcode < ERR_ENDLIST ? errcode : 0]);
     exit(1);
 }
 
-int sym_hash_generate(char *str) {
-    int pos = 0, hash = 0xCAFEBABE;
-    while (str[pos]) {
-        hash = ~(((((hash & 0xFF) ^ str[pos]) << 5) |
-                  (((hash >> 26) & 0x1f) ^ (pos & 31))) |
-                 (hash << 18));
-        pos++;
-    }
-    hash &= 0xFFFFFFFF;
-    return hash;
+double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* Finds the slot of a config key with the perfect hash generated by
+ * genhashes: two hashes and a single compare, no scan. */
+int cfg_slot(const char *key, size_t len) {
+    unsigned int slot =
+        cfg_hash(key, len, cfg_seeds[cfg_hash(key, len, 0) % CFG_BUCKETS]) %
+        KEY_ENDLIST;
+    return (cfg[slot].len == len && memcmp(cfg[slot].key, key, len) == 0)
+               ? (int)slot
+               : -1;
+}
+
+/* Stores val (not a copy, it must outlive cfg[]) in its typed slot.
+ * Values that do not fit the type read as 0. */
+bool cfg_put(int slot, char *val) {
+    cfg[slot].val = val;
+    return cfg_convert(cfg[slot].type, val, &cfg[slot].num);
 }
 
 bool sym_put_kv(char *key, char *val) {
-    int cnt = 0, ret = 0, hash = sym_hash_generate(key);
-    for (; cnt < KEY_ENDLIST; cnt++) {
-        if (cfg[cnt].hash == hash) {
-            ret = 1;
-            cfg[cnt].val = l_str_dup(val);
+    int slot = cfg_slot(key, strlen(key));
+    return slot >= 0 && cfg_put(slot, val);
+}
+
+/* Growable, NULL terminated argument vector handed to execvp().
+ * Every argument is owned by the vector, so callers can pass scratch
+ * buffers and config values without worrying about their lifetime. */
+typedef struct {
+    char **v;
+    size_t n, cap;
+} st_argv;
+
+static char *argv_slot_grow(st_argv *a, size_t len) {
+    if (a->n + 2 > a->cap) {
+        size_t cap = a->cap ? a->cap * 2 : 64;
+        char **v = realloc(a->v, cap * sizeof(char *));
+        if (!v) {
+            fatal(ERR_MEM);
+        }
+        a->v = v;
+        a->cap = cap;
+    }
+    char *arg = malloc(len + 1);
+    if (!arg) {
+        fatal(ERR_MEM);
+    }
+    arg[0] = '\0';
+    a->v[a->n++] = arg;
+    a->v[a->n] = NULL;
+    return arg;
+}
+
+void argv_push(st_argv *a, const char *arg) {
+    size_t len = strlen(arg);
+    memcpy(argv_slot_grow(a, len), arg, len + 1);
+}
+
+/* Pushes the concatenation of a NULL terminated list of strings,
+ * the same way l_str_catx() appends them. */
+void argv_pushx(st_argv *a, ...) {
+    va_list ap, aq;
+    size_t len = 0;
+    char *s, *arg;
+    va_start(ap, a);
+    va_copy(aq, ap);
+    while ((s = va_arg(ap, char *))) {
+        len += strlen(s);
+    }
+    va_end(ap);
+    arg = argv_slot_grow(a, len);
+    while ((s = va_arg(aq, char *))) {
+        strcat(arg, s);
+    }
+    va_end(aq);
+}
+
+/* Appends a NULL terminated list of strings to the last argument. */
+void argv_catx(st_argv *a, ...) {
+    va_list ap, aq;
+    size_t len;
+    char *s, *arg;
+    assert(a->n > 0);
+    len = strlen(a->v[a->n - 1]);
+    va_start(ap, a);
+    va_copy(aq, ap);
+    while ((s = va_arg(ap, char *))) {
+        len += strlen(s);
+    }
+    va_end(ap);
+    if (!(arg = realloc(a->v[a->n - 1], len + 1))) {
+        fatal(ERR_MEM);
+    }
+    while ((s = va_arg(aq, char *))) {
+        strcat(arg, s);
+    }
+    va_end(aq);
+    a->v[a->n - 1] = arg;
+}
+
+/* QEMU options use ',' as separator, so a literal one is written ",,". */
+void argv_catx_escaped(st_argv *a, const char *str) {
+    char chunk[2] = {0};
+    for (; *str; str++) {
+        chunk[0] = *str;
+        argv_catx(a, chunk, *str == ',' ? "," : "", NULL);
+    }
+}
+
+void argv_free(st_argv *a) {
+    for (size_t i = 0; i < a->n; i++) {
+        free(a->v[i]);
+    }
+    free(a->v);
+    a->v = NULL;
+    a->n = a->cap = 0;
+}
+
+/* Prints the vector either one argument per line, or as a single line
+ * with the arguments that need it quoted for a POSIX shell. */
+void argv_print(FILE *fh, const st_argv *a, bool one_per_line) {
+    for (size_t i = 0; i < a->n; i++) {
+        const char *arg = a->v[i];
+        if (one_per_line) {
+            fprintf(fh, "%s\n", arg);
+            continue;
+        }
+        if (i) {
+            fputc(' ', fh);
         }
+        if (arg[0] && !arg[strcspn(arg, " \t\n\"'\\$`;&|<>()*?!~#")]) {
+            fputs(arg, fh);
+            continue;
+        }
+        fputc('\'', fh);
+        for (; *arg; arg++) {
+            if (*arg == '\'') {
+                fputs("'\\''", fh);
+            } else {
+                fputc(*arg, fh);
+            }
+        }
+        fputc('\'', fh);
+    }
+    if (!one_per_line) {
+        fputc('\n', fh);
     }
-    return ret;
 }
 
 enum { FT_TYPE, FT_UNKNOWN = 0, FT_PATH, FT_FILE };
@@ -86,6 +258,9 @@ bool get_binary_full_path(char *bin_fname, char *out_bin_fpath, char *out_dir) {
         strncpy(dir_pb, slice, slice_len);
         dir_pq = l_str_rm_surrc(dir_pb, '\"');
         l_str_catx(fp_b, dir_pq, DSEP, bin_fname, NULL);
+#ifdef __NIX__
+        found = access(fp_b, X_OK) == 0 && filetype(fp_b, FT_FILE);
+#else // Only Windows looks for the program under these names too.
         found = filetype(fp_b, FT_FILE);
         if (!found) {
             mzero_ca(fp_b);
@@ -102,6 +277,7 @@ bool get_binary_full_path(char *bin_fname, char *out_bin_fpath, char *out_dir) {
             l_str_catx(fp_b, dir_pq, DSEP, bin_fname, ".com", NULL);
             found = filetype(fp_b, FT_FILE);
         }
+#endif
         if (found && out_dir) {
             strcpy(out_dir, dir_pq);
         }
@@ -113,53 +289,74 @@ bool get_binary_full_path(char *bin_fname, char *out_bin_fpath, char *out_dir) {
     return found;
 }
 
+/* Reads a whole file into *buf, growing it as needed, so callers that
+ * go through many files reuse one allocation. */
+bool read_file(const char *fpath, char **buf, size_t *cap) {
+    FILE *fptr = fopen(fpath, "rb");
+    size_t len = 0, r;
+    if (!fptr) {
+        return 0;
+    }
+    do {
+        if (*cap - len < BUFF_AVG * 8) {
+            *cap = *cap ? *cap * 2 : BUFF_AVG * 32;
+            if (!(*buf = realloc(*buf, *cap))) {
+                fatal(ERR_MEM);
+            }
+        }
+        len += (r = fread(*buf + len, 1, *cap - len - 1, fptr));
+    } while (r);
+    (*buf)[len] = '\0';
+    fclose(fptr);
+    return 1;
+}
+
+/* Single pass over a config file held in buf: lines are split in place
+ * and the values stored in cfg[] point into buf. With strict set,
+ * unknown keys and values not matching their type are reported.
+ * Returns the number of invalid lines. */
+int program_parse_config(char *buf, const char *fpath, bool strict) {
+    int errors = 0, line_no = 0, slot;
+    char *line = buf, *next, *eq;
+    while (*line) {
+        size_t len = strcspn(line, "\n");
+        next = line[len] ? line + len + 1 : line + len;
+        line[len] = '\0';
+        line_no++;
+        if (len && line[len - 1] == '\r') {
+            line[--len] = '\0';
+        }
+        if (len >= 3 && line[0] != '#' && (eq = strchr(line, '='))) {
+            if ((slot = cfg_slot(line, eq - line)) < 0) {
+                if (strict) {
+                    printf("%s:%d: Unknown key '%.*s'\n", fpath, line_no,
+                           (int)(eq - line), line);
+                }
+                errors++;
+            } else if (!cfg_put(slot, eq + 1)) {
+                if (strict) {
+                    printf("%s:%d: Invalid value for %s: '%s'\n", fpath,
+                           line_no, cfg[slot].key, eq + 1);
+                }
+                errors++;
+            }
+        }
+        line = next;
+    }
+    return errors;
+}
+
 void program_load_config(const char *fpath) {
+    static char *buf = NULL;
+    static size_t cap = 0;
     DPRINT_S();
-    FILE *fptr = fopen(fpath, "r");
 #ifdef DEBUG
     printf("fpath=%s\n", fpath);
 #endif
-    if (!fptr) {
+    if (!read_file(fpath, &buf, &cap)) {
         fatal(ERR_OPEN_CONFIG);
     }
-    char line[BUFF_AVG * 2] = {0}, key[BUFF_AVG], val[BUFF_AVG], *slice;
-    size_t slice_len = 0;
-    int i = 0, have_slice = 0;
-    while (fgets(line, BUFF_AVG * 2, fptr)) {
-        if (!strchr(line, '=') || line[0] == '#') {
-            continue;
-        }
-        size_t len = strlen(line);
-        if (len && line[len - 2] == '\r') {
-            len--;
-            line[len - 1] = '\0';
-        }
-        if (len && line[len - 1] == '\n') {
-            len--;
-            line[len] = '\0';
-        }
-        if (len < 3) {
-            continue;
-        }
-        slice = &line[0];
-        i = 0;
-        do {
-            have_slice = l_str_slice(slice, '=', &slice_len);
-            if (i == 0) {
-                mzero_ca(key);
-                strncpy(key, slice, slice_len);
-            }
-            if (i == 1) {
-                mzero_ca(val);
-                strncpy(val, slice, slice_len);
-                break;
-            }
-            slice = slice + slice_len + 1;
-            i++;
-        } while (have_slice && i < 2);
-        sym_put_kv(key, val);
-    }
-    fclose(fptr);
+    program_parse_config(buf, fpath, 0);
 }
 
 void program_set_default_cfg_values() {
@@ -212,39 +409,73 @@ void program_set_default_cfg_values() {
     }
 }
 
-void program_build_cmd_line(char *vm_name, char *out_cmd) {
-    int drive_index = 0; // telnet_port = 55555; // @TODO: Get usable TCP port
-    char drive_str[4] = {0};
+#ifdef __NIX__
+#include "qmp.c"
+#include "vmindex.c"
+#endif
+#ifdef __linux__
+#include "pin.c"
+#endif
+#include "qemucaps.c"
+#include "machine.c"
+#include "memory.c"
+#include "disk.c"
+#include "net.c"
+#include "virtiofs.c"
+#ifdef __NIX__
+#include "ports.c"
+#endif
+#include "trace.c"
+#ifdef __NIX__
+#include "serial.c"
+#endif
+#ifdef __linux__
+#include "cgroup.c"
+#include "prefetch.c"
+#endif
+
+void program_build_cmd_line(char *vm_name, st_argv *out_args) {
+    int drive_index = 0;
+    char drive_str[12] = {0};
     DPRINT_S();
 #ifdef __WINDOWS__
     char qemu_binary_file[64] = {0};
 #else
-    bool vm_has_rngdev = stricmp(cfg[KEY_RNG_DEV].val, "yes") == 0;
+    bool vm_has_rngdev = cfg[KEY_RNG_DEV].num;
 #endif
     bool vm_has_name = (strcmp(vm_name, "") != 0);
-    bool vm_has_acc_enabled = stricmp(cfg[KEY_ACC].val, "yes") == 0;
+    bool vm_has_acc_enabled = cfg[KEY_ACC].num;
     bool vm_has_vncpwd = (strcmp(cfg[KEY_VNC_PWD].val, "") != 0);
     bool vm_has_audio = stricmp(cfg[KEY_SND].val, "no") != 0;
-    bool vm_has_videoacc = stricmp(cfg[KEY_HOST_VIDEO_ACC].val, "yes") == 0;
-    bool vm_is_headless = stricmp(cfg[KEY_HEADLESS].val, "yes") == 0;
-    bool vm_clock_is_localtime = stricmp(cfg[KEY_LOCALTIME].val, "yes") == 0;
+    bool vm_has_videoacc = cfg[KEY_HOST_VIDEO_ACC].num;
+    bool vm_is_headless = cfg[KEY_HEADLESS].num;
+    bool vm_has_monitor;
+    bool vm_is_microvm = machine_microvm();
+    char vnc_display[12] = "0";
+    bool vm_clock_is_localtime = cfg[KEY_LOCALTIME].num;
     bool vm_has_sharedf = (strcmp(cfg[KEY_SHARED].val, "") != 0 &&
                            filetype(cfg[KEY_SHARED].val, FT_PATH));
-    bool vm_has_hddvirtio = stricmp(cfg[KEY_HDD_VIRTIO].val, "yes") == 0;
     bool vm_has_network = (strcmp(cfg[KEY_NET].val, "no") != 0);
-    bool vm_has_fwd_ports = strcmp(cfg[KEY_FWD_PORTS].val, "no") != 0;
-    bool vm_has_ipv4 = stricmp(cfg[KEY_IPV4].val, "yes") == 0;
-    bool vm_has_ipv6 = stricmp(cfg[KEY_IPV6].val, "yes") == 0;
-    vm_has_sharedf =
-        vm_has_sharedf ? filetype(cfg[KEY_SHARED].val, FT_PATH) : 0;
+#ifdef __NIX__
+    program_alloc_ports();
+#endif
+    vm_has_monitor = cfg[KEY_MONITOR_PORT].val[0] != '\0';
+    if (atoi(cfg[KEY_VNC_PORT].val) >= 5900) {
+        l_int_to_str(atoi(cfg[KEY_VNC_PORT].val) - 5900, vnc_display);
+    }
+    bool vm_has_virtiofs = vm_has_sharedf && shared_virtiofs();
+    bool vm_has_smb = vm_has_sharedf && !vm_has_virtiofs;
 
+#ifdef __linux__
+    program_build_cgroup(out_args);
+#endif
     if (strcmp(cfg[KEY_SYS].val, "x32") == 0) {
-        strcpy(out_cmd, "qemu-system-i386");
+        argv_push(out_args, "qemu-system-i386");
 #ifdef __WINDOWS__
         strcpy(qemu_binary_file, "qemu-system-i386");
 #endif
     } else if (strcmp(cfg[KEY_SYS].val, "x64") == 0) {
-        strcpy(out_cmd, "qemu-system-x86_64");
+        argv_push(out_args, "qemu-system-x86_64");
 #ifdef __WINDOWS__
         strcpy(qemu_binary_file, "qemu-system-x86_64");
 #endif
@@ -253,177 +484,305 @@ void program_build_cmd_line(char *vm_name, char *out_cmd) {
     }
 
     if (vm_has_acc_enabled) {
-        strcat(out_cmd, " --enable-kvm");
+        argv_push(out_args, "--enable-kvm");
     }
     if (vm_has_name) {
-        l_str_catx(out_cmd, " -name ", vm_name, NULL);
+        argv_push(out_args, "-name");
+        argv_push(out_args, vm_name);
+    }
+#ifdef __linux__
+    if (pin_requested()) {
+        program_check_pinning();
+        if (vm_has_name) {
+            argv_catx(out_args, ",debug-threads=on", NULL);
+        }
+    }
+#endif
+#ifdef __NIX__
+    argv_push(out_args, "-qmp");
+    argv_push(out_args, "unix:" QMP_SOCKET ",server=on,wait=off");
+    program_build_trace(out_args);
+    program_build_serial(out_args);
+#endif
+    if (vm_has_monitor) {
+        argv_push(out_args, "-monitor");
+        argv_pushx(out_args, "telnet:127.0.0.1:", cfg[KEY_MONITOR_PORT].val,
+                   ",server=on,wait=off", NULL);
     }
 
-    l_str_catx(out_cmd, " -cpu ", cfg[KEY_CPU].val, " -smp ",
-               cfg[KEY_CORES].val, " -m ", cfg[KEY_MEM].val,
-               " -boot order=", cfg[KEY_BOOT].val,
-               " -usb -device usb-tablet -vga ", cfg[KEY_VGA].val, NULL);
+    program_build_machine(out_args);
+    argv_push(out_args, "-cpu");
+    argv_push(out_args, cfg[KEY_CPU].val);
+    program_build_memory(out_args, vm_has_virtiofs);
+    if (!vm_is_microvm && !cfg[KEY_KERNEL].val[0]) {
+        argv_push(out_args, "-boot");
+        argv_pushx(out_args, "order=", cfg[KEY_BOOT].val, NULL);
+    }
+    if (!vm_is_microvm) {
+        argv_push(out_args, "-usb");
+        argv_push(out_args, "-device");
+        argv_push(out_args, "usb-tablet");
+        argv_push(out_args, "-vga");
+        argv_push(out_args, cfg[KEY_VGA].val);
+    }
 
-    if (vm_has_audio) {
-        l_str_catx(out_cmd, " -soundhw ", cfg[KEY_SND].val, NULL);
+    if (vm_has_audio && !vm_is_microvm) {
+        program_build_audio(out_args, vm_is_headless);
     }
 
     if (vm_is_headless) {
-        l_str_catx(out_cmd,
-                   " -display none -monitor "
-                   "telnet:127.0.0.1:55555,server,nowait -vnc 127.0.0.1:0",
+        argv_push(out_args, "-display");
+        argv_push(out_args, "none");
+        argv_push(out_args, "-vnc");
+        argv_pushx(out_args, "127.0.0.1:", vnc_display,
                    vm_has_vncpwd ? ",password" : "", NULL);
     } else {
-        l_str_catx(out_cmd,
-                   vm_has_videoacc ? " -display gtk,gl=on"
-                                   : " -display gtk,gl=off",
-                   NULL);
+        argv_push(out_args, "-display");
+        argv_push(out_args, vm_has_videoacc ? "gtk,gl=on" : "gtk,gl=off");
     }
 
-    if (vm_has_network && !vm_has_ipv6 && !vm_has_ipv4) {
-        fatal(ERR_NETCONF_IP);
-    }
-    if (!vm_has_network && vm_has_sharedf) {
+    if (!vm_has_network && vm_has_smb) {
         fatal(ERR_SHAREDF);
     }
     if (vm_has_network) {
-        l_str_catx(out_cmd, " -nic user,model=", cfg[KEY_NET].val,
-                   vm_has_ipv4 ? ",ipv4=on" : ",ipv4=off",
-                   vm_has_ipv6 ? ",ipv6=on" : ",ipv6=off", NULL);
-    }
-    if (vm_has_network && vm_has_sharedf) {
-        l_str_catx(out_cmd, ",smb=", cfg[KEY_SHARED].val, NULL);
-    }
-    if (vm_has_network && vm_has_fwd_ports) {
-        char fwd_port_a[6], fwd_port_b[6], *slice;
-        if (strchr(cfg[KEY_FWD_PORTS].val, ':') !=
-            NULL) { // If have fwd_ports=<HostPort>:<GuestPort>
-            int i = 0, have_slice = 0;
-            size_t slice_len;
-            slice = &cfg[KEY_FWD_PORTS].val[0];
-            do {
-                have_slice = l_str_slice(slice, ':', &slice_len);
-                if (i == 0) {
-                    mzero_ca(fwd_port_a);
-                    strncpy(fwd_port_a, slice, slice_len);
-                }
-                if (i == 1) {
-                    mzero_ca(fwd_port_b);
-                    strncpy(fwd_port_b, slice, slice_len);
-                }
-                slice = slice + slice_len + 1;
-                i++;
-            } while (have_slice && i < 2);
-            l_str_catx(out_cmd, ",hostfwd=tcp::", fwd_port_a, "-:", fwd_port_b,
-                       ",hostfwd=udp::", fwd_port_a, "-:", fwd_port_b, NULL);
-        } else { // Else use the same port for Host and Guest.
-            char *port = cfg[KEY_FWD_PORTS].val;
-            l_str_catx(out_cmd, ",hostfwd=tcp::", port, "-:", port,
-                       ",hostfwd=udp::", port, "-:", port, NULL);
-        }
+        program_build_net(out_args, vm_name, vm_has_smb);
+    }
+    if (vm_has_virtiofs) {
+        program_build_virtiofs(out_args);
     }
 
-    if (filetype(cfg[KEY_FLOPPY].val, FT_FILE)) {
+    if (vm_is_microvm && (filetype(cfg[KEY_FLOPPY].val, FT_FILE) ||
+                          filetype(cfg[KEY_CDROM].val, FT_FILE))) {
+        puts("qemu-run: machine=microvm has no floppy nor CD-ROM drive, "
+             "leaving them out");
+    } else if (filetype(cfg[KEY_FLOPPY].val, FT_FILE)) {
         l_int_to_str(drive_index, drive_str);
-        l_str_catx(out_cmd, " -drive index=", drive_str,
-                   ",file=", cfg[KEY_FLOPPY].val, ",format=raw", NULL);
+        argv_push(out_args, "-drive");
+        argv_pushx(out_args, "index=", drive_str, ",file=",
+                   cfg[KEY_FLOPPY].val, ",format=raw", NULL);
         drive_index++;
     }
 
-    if (filetype(cfg[KEY_CDROM].val, FT_FILE)) {
+    if (!vm_is_microvm && filetype(cfg[KEY_CDROM].val, FT_FILE)) {
         l_int_to_str(drive_index, drive_str);
-        l_str_catx(out_cmd, " -drive index=", drive_str,
-                   ",file=", cfg[KEY_CDROM].val, ",media=cdrom", NULL);
+        argv_push(out_args, "-drive");
+        argv_pushx(out_args, "index=", drive_str, ",file=",
+                   cfg[KEY_CDROM].val, ",media=cdrom,format=",
+                   disk_format(cfg[KEY_CDROM].val), NULL);
         drive_index++;
     }
 
-    bool have_multiple_disks = strchr(cfg[KEY_DISK].val, ';');
-
-    if (!have_multiple_disks) {
+    if (!strchr(cfg[KEY_DISK].val, ';')) {
         DPRINT("Single hard disk detected");
-        if (filetype(cfg[KEY_DISK].val, FT_FILE)) {
-            l_int_to_str(drive_index, drive_str);
-            l_str_catx(out_cmd, " -drive index=", drive_str,
-                       ",file=", cfg[KEY_DISK].val,
-                       vm_has_hddvirtio ? ",if=virtio" : "", NULL);
-            drive_index++;
-        }
     } else {
         DPRINT("Multiple hard disks detected");
-        bool have_slice = 0;
-        size_t slice_len = 0;
-        char *slice = &cfg[KEY_DISK].val[0];
-        do {
-            have_slice = l_str_slice(slice, ';', &slice_len);
-            slice[slice_len] = 0;
-            if (filetype(slice, FT_FILE)) {
-                l_int_to_str(drive_index, drive_str);
-                l_str_catx(out_cmd, " -drive index=", drive_str,
-                           ",file=", slice,
-                           vm_has_hddvirtio ? ",if=virtio" : "", NULL);
-                drive_index++;
-            }
-            slice = slice + slice_len + 1;
-        } while (have_slice);
     }
+    bool have_slice = 0;
+    int disk_n = 0;
+    size_t slice_len = 0;
+    char *slice = &cfg[KEY_DISK].val[0], disk_fpath[PATH_MAX];
+    do {
+        have_slice = l_str_slice(slice, ';', &slice_len);
+        snprintf(disk_fpath, sizeof(disk_fpath), "%.*s", (int)slice_len,
+                 slice);
+        if (filetype(disk_fpath, FT_FILE)) {
+            program_build_disk(out_args, disk_fpath, disk_n, &drive_index);
+        }
+        disk_n++;
+        slice = slice + slice_len + 1;
+    } while (have_slice);
 
 #ifdef __WINDOWS__
     /* QEMU on Windows needs,for some reason,to have an additional argument with
      * the program path on it, For example if you have it on: "C:\Program
      * Files\Qemu",You have to run it like this: qemu-system-i386.exe -L
-     * "C:\Program Files\Qemu" Otherwise it wont find the BIOS file.. */
+     * "C:\Program Files\Qemu" Otherwise it wont find the BIOS file..
+     * _spawnvp() joins the vector with spaces, so the path keeps its quotes. */
     char qemu_binary_full_path[BUFF_AVG] = {0};
     char *qemu_binary_full_path_p = &qemu_binary_full_path[0];
     if (!get_binary_full_path(qemu_binary_file, NULL,
                               qemu_binary_full_path_p)) {
         fatal(ERR_EXEC);
     }
-    l_str_catx(out_cmd, " -L \"", qemu_binary_full_path_p, "\"", NULL);
+    argv_push(out_args, "-L");
+    argv_pushx(out_args, "\"", qemu_binary_full_path_p, "\"", NULL);
 #else
     if (vm_has_rngdev) {
-        strcat(out_cmd, " -object rng-random,id=rng0,filename=/dev/random "
-                        "-device virtio-rng-pci,rng=rng0");
+        argv_push(out_args, "-object");
+        argv_push(out_args, "rng-random,id=rng0,filename=/dev/random");
+        argv_push(out_args, "-device");
+        argv_pushx(out_args, virtio_dev("virtio-rng-pci"), ",rng=rng0",
+                   NULL);
     }
 #endif
     if (vm_clock_is_localtime) {
-        strcat(out_cmd, " -rtc base=localtime");
+        argv_push(out_args, "-rtc");
+        argv_push(out_args, "base=localtime");
     }
 }
 
-void program_find_vm_and_chdir(int argc, char **argv, char *out_vm_name,
-                               char *out_vm_cfg_file) {
+enum {
+    MODE_RUN,
+    MODE_FLEET,
+    MODE_LIST,
+    MODE_CHECK,
+    MODE_QMP,
+    MODE_CONSOLE,
+    MODE_SUSPEND,
+    MODE_EPHEMERAL,
+    MODE_POOL,
+    MODE_TAKE,
+    MODE_METRICS,
+    MODE_TRACE_SUMMARY,
+    MODE_DAEMON,
+    MODE_STATUS,
+    MODE_START,
+    MODE_STOP
+};
+
+typedef struct {
+    int mode;
+    char *vm_name, **items;
+    int item_count, count;
+    bool print_argv, all;
+} st_opts;
+
+void program_parse_args(int argc, char **argv, st_opts *out_opts) {
+    DPRINT_S();
+    memset(out_opts, 0, sizeof(st_opts));
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--print-argv") == 0) {
+            out_opts->print_argv = 1;
+        } else if (strcmp(argv[i], "--fleet") == 0) {
+            out_opts->mode = MODE_FLEET;
+            out_opts->items = &argv[i + 1];
+            out_opts->item_count = argc - i - 1;
+            break;
+        } else if (strcmp(argv[i], "--metrics") == 0) {
+            out_opts->mode = MODE_METRICS;
+            out_opts->items = &argv[i + 1];
+            out_opts->item_count = argc - i - 1;
+            break;
+        } else if (strcmp(argv[i], "--trace-summary") == 0) {
+            out_opts->mode = MODE_TRACE_SUMMARY;
+            out_opts->items = &argv[i + 1];
+            out_opts->item_count = argc - i - 1;
+            return;
+        } else if (strcmp(argv[i], "--check") == 0) {
+            out_opts->mode = MODE_CHECK;
+            out_opts->items = &argv[i + 1];
+            out_opts->item_count = argc - i - 1;
+            return;
+        } else if ((strcmp(argv[i], "--ephemeral") == 0 ||
+                    strcmp(argv[i], "--pool") == 0 ||
+                    strcmp(argv[i], "--take") == 0) &&
+                   i + 1 < argc && !out_opts->vm_name) {
+            out_opts->mode = argv[i][2] == 'e'   ? MODE_EPHEMERAL
+                             : argv[i][2] == 'p' ? MODE_POOL
+                                                 : MODE_TAKE;
+            out_opts->vm_name = argv[++i];
+        } else if (strcmp(argv[i], "--count") == 0 && i + 1 < argc) {
+            if ((out_opts->count = atoi(argv[++i])) < 1) {
+                fatal(ERR_ARGS);
+            }
+        } else if (strcmp(argv[i], "--suspend") == 0) {
+            out_opts->mode = MODE_SUSPEND;
+        } else if (strcmp(argv[i], "--start") == 0) {
+            out_opts->mode = MODE_START;
+        } else if (strcmp(argv[i], "--stop") == 0) {
+            out_opts->mode = MODE_STOP;
+        } else if (strcmp(argv[i], "--daemon") == 0) {
+            out_opts->mode = MODE_DAEMON;
+        } else if (strcmp(argv[i], "--status") == 0) {
+            out_opts->mode = MODE_STATUS;
+        } else if (strcmp(argv[i], "--list") == 0) {
+            out_opts->mode = MODE_LIST;
+        } else if (strcmp(argv[i], "--all") == 0) {
+            out_opts->mode = MODE_FLEET;
+            out_opts->all = 1;
+        } else if (out_opts->vm_name && out_opts->mode == MODE_RUN &&
+                   (strcmp(argv[i], "qmp") == 0 ||
+                    strcmp(argv[i], "console") == 0)) {
+            out_opts->mode = argv[i][0] == 'q' ? MODE_QMP : MODE_CONSOLE;
+            out_opts->items = &argv[i + 1];
+            out_opts->item_count = argc - i - 1;
+            break;
+        } else if (argv[i][0] == '-' || out_opts->vm_name) {
+            fatal(ERR_ARGS);
+        } else {
+            out_opts->vm_name = argv[i];
+        }
+    }
+    for (int i = 0; i < out_opts->item_count &&
+                    (out_opts->mode == MODE_FLEET ||
+                     out_opts->mode == MODE_METRICS);
+         i++) { // VM names, like vm_name below.
+        if (strlen(out_opts->items[i]) >= BUFF_AVG) {
+            fatal(ERR_ARGS);
+        }
+    }
+    if (out_opts->mode == MODE_LIST || out_opts->mode == MODE_METRICS ||
+        out_opts->mode == MODE_DAEMON || out_opts->mode == MODE_STATUS) {
+        if (out_opts->vm_name || out_opts->print_argv) {
+            fatal(ERR_ARGS);
+        }
+        return;
+    }
+    if (out_opts->mode == MODE_FLEET) {
+        if (out_opts->vm_name || out_opts->print_argv ||
+            (!out_opts->item_count && !out_opts->all)) {
+            fatal(ERR_ARGS);
+        }
+        return;
+    }
+    if (!out_opts->vm_name || strlen(out_opts->vm_name) >= BUFF_AVG ||
+        (out_opts->mode != MODE_RUN && out_opts->print_argv) ||
+        (out_opts->mode != MODE_EPHEMERAL && out_opts->mode != MODE_POOL &&
+         out_opts->count)) {
+        fatal(ERR_ARGS);
+    }
+}
+
+void program_find_vm_and_chdir(const char *vm_name, char *out_vm_cfg_file) {
     char vm_dir[PATH_MAX + 1], env_dir[PATH_MAX] = {0}, *env, *slice,
                                *env_dir_q;
-    bool vm_dir_exists = 0, cfg_file_exists = 0, have_slice = 0;
+    bool vm_dir_exists = 0, cfg_file_exists = 0, have_slice = 0,
+         vm_indexed = 0;
     size_t slice_len;
     DPRINT_S();
-    if (argc < 2) {
-        fatal(ERR_ARGS);
-    }
-    strcpy(out_vm_name, argv[1]);
-    if (!(env = getenv("QEMURUN_VM_PATH"))) {
-        fatal(ERR_ENV);
-    }
-    if (strcmp(env, "") == 0) {
-        fatal(ERR_ENV);
+    out_vm_cfg_file[0] = '\0';
+#ifdef __NIX__
+    vm_indexed = vmindex_lookup(vm_name, vm_dir, sizeof(vm_dir),
+                                out_vm_cfg_file, BUFF_AVG, &vm_dir_exists);
+#endif
+    if (!vm_indexed || !vm_dir_exists) { // Not indexed: a nested VM name.
+        if (!(env = getenv("QEMURUN_VM_PATH"))) {
+            fatal(ERR_ENV);
+        }
+        if (strcmp(env, "") == 0) {
+            fatal(ERR_ENV);
+        }
+        slice = &env[0];
+        do {
+            have_slice = l_str_slice(slice, PSEP_C, &slice_len);
+            mzero_ca(env_dir);
+            mzero_ca(vm_dir);
+            strncpy(env_dir, slice, slice_len);
+            env_dir_q = l_str_rm_surrc(env_dir, '\"');
+            l_str_catx(vm_dir, env_dir_q, DSEP, vm_name, NULL);
+            vm_dir_exists = filetype(vm_dir, FT_PATH);
+            slice = slice + slice_len + 1;
+        } while (have_slice && !vm_dir_exists);
     }
-    slice = &env[0];
-    do {
-        have_slice = l_str_slice(slice, PSEP_C, &slice_len);
-        mzero_ca(env_dir);
-        mzero_ca(vm_dir);
-        strncpy(env_dir, slice, slice_len);
-        env_dir_q = l_str_rm_surrc(env_dir, '\"');
-        l_str_catx(vm_dir, env_dir_q, DSEP, out_vm_name, NULL);
-        vm_dir_exists = filetype(vm_dir, FT_PATH);
-        slice = slice + slice_len + 1;
-    } while (have_slice && !vm_dir_exists);
     if (!vm_dir_exists) {
         fatal(ERR_ENV);
     }
     if (chdir(vm_dir) != 0) {
         fatal(ERR_CHDIR_VM_DIR);
     }
+    if (out_vm_cfg_file[0] && filetype(out_vm_cfg_file, FT_FILE)) {
+        return; // The index already knows which one it is.
+    }
     strcpy(out_vm_cfg_file, "config");
     cfg_file_exists = filetype(out_vm_cfg_file, FT_FILE);
     if (!cfg_file_exists) {
@@ -435,19 +794,264 @@ void program_find_vm_and_chdir(int argc, char **argv, char *out_vm_name,
     }
 }
 
+/* Validates config files in bulk, from the command line or one path per
+ * line on stdin. Each file is parsed against a fresh copy of the defaults,
+ * reusing one read buffer. */
+int program_check_configs(char **fpaths, int count) {
+    st_config defaults[KEY_ENDLIST];
+    char *buf = NULL, fpath[PATH_MAX + 2];
+    size_t cap = 0;
+    int files = 0, invalid = 0;
+    double t = now_ms();
+    DPRINT_S();
+    memcpy(defaults, cfg, sizeof(cfg));
+    for (int i = 0;
+         count ? i < count : fgets(fpath, sizeof(fpath), stdin) != NULL; i++) {
+        const char *p = count ? fpaths[i] : fpath;
+        if (!count) {
+            fpath[strcspn(fpath, "\r\n")] = '\0';
+            if (!fpath[0]) {
+                continue;
+            }
+        }
+        memcpy(cfg, defaults, sizeof(cfg));
+        files++;
+        if (!read_file(p, &buf, &cap)) {
+            printf("%s: Cannot open config file\n", p);
+            invalid++;
+        } else if (program_parse_config(buf, p, 1)) {
+            invalid++;
+        }
+    }
+    t = now_ms() - t;
+    printf("%d config files checked, %d invalid, %.1f ms (%.0f files/s)\n",
+           files, invalid, t, t > 0 ? files * 1000.0 / t : 0.0);
+    free(buf);
+    return invalid ? 1 : 0;
+}
+
+#ifdef __NIX__
+#include "state.c"
+#ifdef __linux__
+#include "density.c"
+#endif
+
+bool pool_instance_requested(void); // pool.c, which needs the supervisor.
+void pool_announce(void);
+
+/* Whether the supervisor has to act on QEMU over QMP once it is up. */
+bool program_needs_qmp(void) {
+#ifdef __linux__
+    return pin_requested() || state_restore_requested() ||
+           pool_instance_requested() || trace_requested();
+#else
+    return state_restore_requested() || pool_instance_requested() ||
+           trace_requested();
+#endif
+}
+
+bool program_needs_supervisor(void) {
+#ifdef __linux__
+    return program_needs_qmp() || virtiofs_requested() ||
+           density_requested() || prefetch_recording() ||
+           serial_log_requested();
+#else
+    return program_needs_qmp() || serial_log_requested();
+#endif
+}
+
+/* Runs QEMU as a child instead of exec()ing it, for the features that
+ * need to act on it once it is up. Returns QEMU's exit code. */
+int program_run_supervised(st_argv *args) {
+    pid_t pid, virtiofsd = -1, serial_logger = -1;
+    int status = 0;
+    bool restored = 1;
+    DPRINT_S();
+    signal(SIGINT, SIG_IGN); // QEMU gets ^C too, and we follow it out.
+#ifdef __linux__
+    if (virtiofs_requested()) {
+        virtiofsd = virtiofs_spawn();
+    }
+#endif
+    if (serial_log_requested()) {
+        serial_logger = serial_spawn();
+    }
+    if (trace_requested()) {
+        trace_prepare();
+    }
+    if ((pid = fork()) < 0) {
+        fatal(ERR_EXEC);
+    }
+    if (pid == 0) {
+        signal(SIGINT, SIG_DFL);
+        execvp(args->v[0], args->v);
+        fatal(ERR_EXEC);
+    }
+    if (program_needs_qmp()) {
+        st_qmp q;
+        if (qmp_connect(&q, QMP_SOCKET, pid, 10000)) {
+            trace_mark("qmp_ready");
+#ifdef __linux__
+            if (pin_requested()) {
+                pin_apply(&q, pid);
+            }
+#endif
+            if (state_restore_requested()) {
+                restored = state_restore(&q, pid);
+            }
+            if (restored && pool_instance_requested()) {
+                pool_announce();
+            }
+            qmp_close(&q);
+        } else {
+            puts("qemu-run: Cannot reach QMP, the VM is left as is");
+        }
+    }
+    if (restored && trace_requested()) {
+        trace_watch(pid);
+    }
+#ifdef __linux__
+    if (restored && prefetch_recording()) {
+        prefetch_record(pid);
+    }
+    if (restored && density_requested()) {
+        density_run(pid);
+    }
+#endif
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+        ;
+    if (virtiofsd > 0) { // It normally exits as soon as QEMU hangs up.
+        for (int i = 0; i < 100 && !pid_exited(virtiofsd); i++) {
+            usleep(10000);
+        }
+        kill(virtiofsd, SIGTERM);
+        waitpid(virtiofsd, NULL, 0);
+        unlink(VIRTIOFS_SOCKET);
+    }
+    if (serial_logger > 0) {
+        serial_stop(serial_logger);
+    }
+    if (!restored) { // QEMU quit, with its helpers: boot it afresh.
+        state_cold_boot(args);
+        return program_run_supervised(args);
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+#include "fleet.c"
+#include "ephemeral.c"
+#include "pool.c"
+#include "metrics.c"
+#ifdef __linux__
+#include "daemon.c"
+#endif
+#endif
+
 int main(int argc, char **argv) {
-    char cmd[BUFF_MAX], vm_name[BUFF_AVG], vm_cfg_file[BUFF_AVG];
+    char vm_cfg_file[BUFF_AVG];
+    st_argv args = {0};
+    st_opts opts;
     DPRINT_S();
-    program_find_vm_and_chdir(argc, argv, vm_name, vm_cfg_file);
+    program_parse_args(argc, argv, &opts);
+#ifdef __NIX__
+    if (opts.mode == MODE_FLEET) {
+        return program_run_fleet(opts.items, opts.item_count, opts.all);
+    }
+    if (opts.mode == MODE_LIST) {
+        return program_list_vms();
+    }
+    if (opts.mode == MODE_METRICS) {
+        return program_run_metrics(opts.items, opts.item_count);
+    }
+    if (opts.mode == MODE_TRACE_SUMMARY) {
+        return program_trace_summary(opts.items, opts.item_count);
+    }
+#ifdef __linux__
+    if (opts.mode == MODE_DAEMON) {
+        return program_run_daemon();
+    }
+    if (opts.mode == MODE_STATUS || opts.mode == MODE_START ||
+        opts.mode == MODE_STOP) {
+        int rc = daemon_request(opts.mode == MODE_STATUS  ? "status"
+                                : opts.mode == MODE_START ? "start"
+                                                          : "stop",
+                                opts.vm_name);
+        return rc >= 0 ? rc : 1;
+    }
+#else
+    if (opts.mode == MODE_DAEMON || opts.mode == MODE_STATUS ||
+        opts.mode == MODE_START || opts.mode == MODE_STOP) {
+        puts("qemu-run: The daemon needs a Linux host");
+        return 1;
+    }
+#endif
+    if (opts.mode == MODE_RUN && !opts.print_argv) {
+        trace_start(opts.vm_name);
+    }
+    if (opts.mode == MODE_EPHEMERAL) {
+        return program_run_ephemeral(opts.vm_name,
+                                     opts.count ? opts.count : 1);
+    }
+    if (opts.mode == MODE_POOL) {
+        return program_run_pool(opts.vm_name, opts.count ? opts.count : 1);
+    }
+    if (opts.mode == MODE_TAKE) {
+        return program_take(opts.vm_name);
+    }
+    if (opts.mode == MODE_QMP) {
+        program_find_vm_and_chdir(opts.vm_name, vm_cfg_file);
+        return program_run_qmp(opts.items, opts.item_count);
+    }
+#endif
+    if (opts.mode == MODE_CHECK) {
+        return program_check_configs(opts.items, opts.item_count);
+    }
+    program_find_vm_and_chdir(opts.vm_name, vm_cfg_file);
+    trace_mark("find");
     program_set_default_cfg_values();
+    trace_mark("defaults");
     program_load_config(vm_cfg_file);
+    trace_mark("load");
 #ifdef DEBUG
     puts("Hash table:");
     for (int i = 0; i < KEY_ENDLIST; i++)
-        printf("%d 0x%8.8X='%s'\n", i, cfg[i].hash, cfg[i].val);
+        printf("%d %s='%s' (%lld)\n", i, cfg[i].key, cfg[i].val, cfg[i].num);
+#endif
+#ifdef __NIX__
+    if (opts.mode == MODE_SUSPEND) {
+        return program_suspend(opts.vm_name);
+    }
+    if (opts.mode == MODE_CONSOLE) {
+        return program_console(opts.items, opts.item_count);
+    }
+#endif
+    program_build_cmd_line(opts.vm_name, &args);
+#ifdef __NIX__
+    program_build_restore(&args);
+#endif
+    trace_mark("build");
+    if (opts.print_argv) {
+        argv_print(stdout, &args, 1);
+        return 0;
+    }
+#ifdef __NIX__
+    ports_write();
+#endif
+#ifdef __linux__
+    cgroup_enter(opts.vm_name);
+    prefetch_start();
 #endif
-    program_build_cmd_line(vm_name, cmd);
     puts("QEMU Command line arguments:");
-    puts(cmd);
-    return system(cmd); // Just Pass Qemu's Err code on
+    argv_print(stdout, &args, 0);
+    fflush(stdout);
+#ifdef __WINDOWS__
+    return _spawnvp(_P_WAIT, args.v[0], (const char *const *)args.v);
+#else
+    if (program_needs_supervisor()) {
+        return program_run_supervised(&args);
+    }
+    execvp(args.v[0], args.v); // Qemu replaces us, and its exit code is ours
+    fatal(ERR_EXEC);
+    return 1;
+#endif
 }
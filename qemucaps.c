@@ -0,0 +1,298 @@
+/* What the installed QEMU can do, so the command line picks what this
+ * binary supports instead of failing once QEMU starts.
+ *
+ * A binary is probed once: it is started with -machine none and asked
+ * over QMP on stdio for its version, machines, device types and QAPI
+ * schema. The result goes to $XDG_CACHE_HOME/qemu-run/caps, one line per
+ * binary keyed by its path, mtime and size, so a QEMU upgrade probes
+ * again and every other launch reads one short file. A binary that does
+ * not answer is kept that way too, so it is not probed again until it
+ * changes, and is assumed to have everything but -audiodev, which is
+ * what qemu-run did before.
+ *
+ * Where the binary is in PATH is kept in the same file, with a stamp of
+ * the mtimes of the PATH folders up to that one: a binary installed in
+ * any of them, one that could now come first, makes it walk PATH again. */
+
+#define QEMUCAPS_FILE "caps"
+#define QEMUCAPS_PROBE_MS 10000
+
+enum {
+    CAP_PROBED = 1 << 0,
+    CAP_AUDIODEV = 1 << 1, /**< -audiodev, 4.0 on */
+    CAP_MICROVM = 1 << 3,
+    CAP_Q35 = 1 << 4,
+    CAP_VIRTIOFS = 1 << 5, /**< vhost-user-fs-pci */
+    CAP_IO_URING = 1 << 6,
+    CAP_MAPPED_RAM = 1 << 7,
+    CAP_PAGE_REPORTING = 1 << 8, /**< virtio-balloon free-page-reporting */
+    CAP_AUDIO_PIPEWIRE = 1 << 9,
+    CAP_AUDIO_PA = 1 << 10,
+    CAP_AUDIO_ALSA = 1 << 11
+};
+
+const char *qemu_binary(void) {
+    return strcmp(cfg[KEY_SYS].val, "x32") == 0 ? "qemu-system-i386"
+                                                 : "qemu-system-x86_64";
+}
+
+#ifdef __NIX__
+typedef struct {
+    unsigned int caps;
+    int major, minor;
+} st_qemucaps;
+
+/* Runs the binary with QMP on a socketpair as its stdin and stdout. */
+static void qemucaps_probe(const char *fpath, st_qemucaps *out) {
+    char *argv[] = {(char *)fpath, "-machine", "none", "-nodefaults",
+                    "-display", "none", "-S", "-qmp", "stdio", NULL};
+    static const struct {
+        const char *cmd, *args, *needle;
+        unsigned int cap;
+    } checks[] = {
+        {"query-machines", NULL, "\"microvm\"", CAP_MICROVM},
+        {"query-machines", NULL, "\"q35\"", CAP_Q35},
+        {"qom-list-types", "{\"implements\": \"device\"}",
+         "\"vhost-user-fs-pci\"", CAP_VIRTIOFS},
+        {"query-qmp-schema", NULL, "\"io_uring\"", CAP_IO_URING},
+        {"query-qmp-schema", NULL, "\"mapped-ram\"", CAP_MAPPED_RAM},
+        {"query-qmp-schema", NULL, "\"pipewire\"", CAP_AUDIO_PIPEWIRE},
+        {"query-qmp-schema", NULL, "\"pa\"", CAP_AUDIO_PA},
+        {"query-qmp-schema", NULL, "\"alsa\"", CAP_AUDIO_ALSA}};
+    const char *last_cmd = "";
+    char *reply = NULL;
+    const char *ret;
+    int sv[2], version;
+    st_qmp q = {.fd = -1};
+    pid_t pid;
+    DPRINT_S();
+    memset(out, 0, sizeof(st_qemucaps));
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0) {
+        return;
+    }
+    fflush(stdout);
+    if ((pid = fork()) == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(sv[1], 0);
+        dup2(sv[1], 1);
+        dup2(null_fd, 2);
+        execv(fpath, argv);
+        _exit(127);
+    }
+    close(sv[1]);
+    if (pid < 0) {
+        close(sv[0]);
+    } else if (qmp_attach(&q, sv[0], QEMUCAPS_PROBE_MS) &&
+               (reply = qmp_execute(&q, "query-version", NULL,
+                                    QEMUCAPS_PROBE_MS)) &&
+               (ret = json_member(reply, "return")) &&
+               (ret = json_member(ret, "qemu"))) {
+        long long major = 0, minor = 0;
+        json_int(ret, "major", &major);
+        json_int(ret, "minor", &minor);
+        out->major = (int)major;
+        out->minor = (int)minor;
+        out->caps = CAP_PROBED;
+        for (size_t i = 0; i < sizeof(checks) / sizeof(checks[0]); i++) {
+            if (strcmp(checks[i].cmd, last_cmd) != 0) { // Asked once each.
+                last_cmd = checks[i].cmd;
+                reply = qmp_execute(&q, last_cmd, checks[i].args,
+                                    QEMUCAPS_PROBE_MS);
+            }
+            if (reply && strstr(reply, checks[i].needle)) {
+                out->caps |= checks[i].cap;
+            }
+        }
+        version = out->major * 100 + out->minor;
+        out->caps |= (version >= 400 ? CAP_AUDIODEV : 0) |
+                     (version >= 501 ? CAP_PAGE_REPORTING : 0);
+        qmp_send(&q, "quit", NULL);
+    }
+    if (pid > 0) {
+        for (int i = 0; i < 200 && !pid_exited(pid); i++) {
+            usleep(10000);
+        }
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+    }
+    if (q.fd >= 0) {
+        qmp_close(&q);
+    }
+}
+
+/* Parses a cache line: "<mtime s> <mtime ns> <size> <caps> <version>
+ * <path>". Returns where the path starts, 0 if it is no such line. */
+static int qemucaps_parse(char *line, long long key[3], st_qemucaps *out) {
+    int path_at = 0;
+    line[strcspn(line, "\n")] = '\0';
+    if (sscanf(line, "%lld %lld %lld %x %d.%d %n", &key[0], &key[1], &key[2],
+               &out->caps, &out->major, &out->minor, &path_at) != 6) {
+        return 0;
+    }
+    return path_at;
+}
+
+/* FNV-1a of the mtimes of the PATH folders up to dir, where the binary
+ * was found. */
+static unsigned long long qemucaps_path_stamp(const char *env,
+                                              const char *dir) {
+    unsigned long long hash = 14695981039346656037ull;
+    char entry[PATH_MAX];
+    struct stat st;
+    while (*env) {
+        size_t len = strchr(env, PSEP_C) ? (size_t)(strchr(env, PSEP_C) - env)
+                                         : strlen(env);
+        snprintf(entry, sizeof(entry), "%.*s", (int)len, env);
+        env += len + (env[len] != '\0');
+        if (stat(entry, &st) == 0) {
+            hash = (hash ^ (unsigned long long)st.st_mtim.tv_sec) *
+                   1099511628211ull;
+            hash = (hash ^ (unsigned long long)st.st_mtim.tv_nsec) *
+                   1099511628211ull;
+        }
+        if (strcmp(entry, dir) == 0) {
+            break;
+        }
+    }
+    return hash;
+}
+
+/* The stamp for fpath, found in PATH. */
+static unsigned long long qemucaps_stamp_of(const char *env,
+                                            const char *fpath) {
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", fpath);
+    if (strrchr(dir, '/')) {
+        *strrchr(dir, '/') = '\0';
+    }
+    return qemucaps_path_stamp(env, dir);
+}
+
+/* Parses a PATH line: "path <PATH hash> <stamp> <name> <path>". Returns
+ * where the binary path starts, 0 if it is no such line. */
+static int qemucaps_parse_path(char *line, unsigned int *env_hash,
+                               unsigned long long *stamp, char *name,
+                               size_t name_size) {
+    int name_at = 0, path_at = 0;
+    line[strcspn(line, "\n")] = '\0';
+    if (sscanf(line, "path %x %llx %n%*s %n", env_hash, stamp, &name_at,
+               &path_at) != 2 ||
+        !path_at || (size_t)(path_at - name_at) > name_size) {
+        return 0;
+    }
+    snprintf(name, name_size, "%.*s", (int)strcspn(line + name_at, " "),
+             line + name_at);
+    return path_at;
+}
+
+/* Finds the binary in PATH and its line in the cache, or walks PATH and
+ * probes it, and adds what it learned. */
+static void qemucaps_load(const char *bin_name, st_qemucaps *out) {
+    char cache[PATH_MAX], cache_tmp[PATH_MAX + 24], line[PATH_MAX + 128],
+        fpath[PATH_MAX] = "", name[BUFF_AVG];
+    const char *env = getenv("PATH");
+    unsigned int env_hash = vmindex_hash(env ? env : ""), hash;
+    unsigned long long stamp;
+    long long key[3], want[3];
+    bool found_path = 0, found_caps = 0, probed = 0;
+    st_qemucaps found;
+    struct stat st;
+    FILE *fh, *tmp;
+    int path_at;
+    memset(out, 0, sizeof(st_qemucaps));
+    if (!env || !cache_dir(cache, 1) ||
+        strlen(cache) + sizeof(QEMUCAPS_FILE) + 1 > sizeof(cache)) {
+        return;
+    }
+    strcat(cache, "/" QEMUCAPS_FILE);
+    snprintf(cache_tmp, sizeof(cache_tmp), "%s.%ld", cache, (long)getpid());
+    fh = fopen(cache, "r");
+    while (fh && !found_path && fgets(line, sizeof(line), fh)) {
+        if ((path_at = qemucaps_parse_path(line, &hash, &stamp, name,
+                                           sizeof(name))) &&
+            hash == env_hash && strcmp(name, bin_name) == 0 &&
+            stamp == qemucaps_stamp_of(env, line + path_at)) {
+            snprintf(fpath, sizeof(fpath), "%s", line + path_at);
+            found_path = 1;
+        }
+    }
+    if (!found_path && !get_binary_full_path((char *)bin_name, fpath, NULL)) {
+        if (fh) {
+            fclose(fh);
+        }
+        return;
+    }
+    if (stat(fpath, &st) != 0) {
+        if (fh) {
+            fclose(fh);
+        }
+        return;
+    }
+    want[0] = (long long)st.st_mtim.tv_sec;
+    want[1] = (long long)st.st_mtim.tv_nsec;
+    want[2] = (long long)st.st_size;
+    if (fh) {
+        rewind(fh);
+    }
+    while (fh && !found_caps && fgets(line, sizeof(line), fh)) {
+        if ((path_at = qemucaps_parse(line, key, &found)) &&
+            strcmp(line + path_at, fpath) == 0 &&
+            memcmp(key, want, sizeof(key)) == 0) {
+            *out = found;
+            found_caps = 1;
+        }
+    }
+    if (!found_caps) {
+        qemucaps_probe(fpath, out); // Kept even if it fails, as caps 0.
+        probed = 1;
+    }
+    if ((found_path && !probed) || !(tmp = fopen(cache_tmp, "w"))) {
+        if (fh) {
+            fclose(fh);
+        }
+        return;
+    }
+    if (fh) { // The other binaries' lines stay.
+        rewind(fh);
+        while (fgets(line, sizeof(line), fh)) {
+            char copy[sizeof(line)];
+            bool keep;
+            strcpy(copy, line);
+            if ((path_at = qemucaps_parse(copy, key, &found))) {
+                keep = strcmp(copy + path_at, fpath) != 0;
+            } else {
+                keep = qemucaps_parse_path(copy, &hash, &stamp, name,
+                                           sizeof(name)) &&
+                       (hash != env_hash || strcmp(name, bin_name) != 0);
+            }
+            if (keep) {
+                fputs(line, tmp);
+            }
+        }
+        fclose(fh);
+    }
+    fprintf(tmp, "path %08x %llx %s %s\n", env_hash,
+            qemucaps_stamp_of(env, fpath), bin_name, fpath);
+    fprintf(tmp, "%lld %lld %lld %x %d.%d %s\n", want[0], want[1], want[2],
+            out->caps, out->major, out->minor, fpath);
+    if (fclose(tmp) != 0 || rename(cache_tmp, cache) != 0) {
+        unlink(cache_tmp);
+    }
+}
+#endif
+
+/* Whether the QEMU binary for this VM's sys= has cap. */
+bool qemu_has(unsigned int cap) {
+#ifdef __NIX__
+    static st_qemucaps caps;
+    static const char *loaded_for;
+    if (loaded_for != qemu_binary()) {
+        loaded_for = qemu_binary();
+        qemucaps_load(loaded_for, &caps);
+    }
+    if (caps.caps & CAP_PROBED) {
+        return (caps.caps & cap) != 0;
+    }
+#endif
+    return cap != CAP_AUDIODEV && cap != CAP_PROBED;
+}
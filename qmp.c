@@ -0,0 +1,354 @@
+/* QMP client for the control socket every VM gets in its folder
+ * (QMP_SOCKET, relative to the VM folder QEMU runs in).
+ *
+ * The socket is non-blocking and all waits go through poll() with a
+ * deadline, so callers can also watch q->fd in their own poll loop.
+ * Commands carry an "id" and their replies are matched by it; events
+ * that arrive meanwhile go to the on_event callback, if any.
+ * Also holds the few JSON helpers needed to read QMP replies. */
+
+#define QMP_SOCKET "qmp.sock"
+
+typedef struct {
+    int fd;
+    char *buf; /**< Received data, the current line is NUL terminated */
+    size_t len, cap, line_len;
+    unsigned int next_id;
+    void (*on_event)(const char *line, void *ctx);
+    void *ctx;
+} st_qmp;
+
+/* Returns a pointer just past the JSON value starting at p. */
+const char *json_skip(const char *p) {
+    int depth = 0;
+    while (isspace((unsigned char)*p)) {
+        p++;
+    }
+    for (; *p; p++) {
+        if (*p == '"') {
+            for (p++; *p && *p != '"'; p++) {
+                if (*p == '\\' && p[1]) {
+                    p++;
+                }
+            }
+            if (!*p) {
+                return p;
+            }
+            if (!depth) {
+                return p + 1;
+            }
+        } else if (*p == '{' || *p == '[') {
+            depth++;
+        } else if (*p == '}' || *p == ']') {
+            if (--depth <= 0) {
+                return depth < 0 ? p : p + 1; // A scalar ends at its parent.
+            }
+        } else if (!depth && strchr(",: \t\r\n", *p)) {
+            return p;
+        }
+    }
+    return p;
+}
+
+/* Returns the value of key in the object starting at obj, or NULL. */
+const char *json_member(const char *obj, const char *key) {
+    size_t key_len = strlen(key);
+    while (isspace((unsigned char)*obj)) {
+        obj++;
+    }
+    if (*obj++ != '{') {
+        return NULL;
+    }
+    for (;;) {
+        const char *name, *val;
+        while (isspace((unsigned char)*obj) || *obj == ',') {
+            obj++;
+        }
+        if (*obj != '"') {
+            return NULL;
+        }
+        name = obj + 1;
+        obj = json_skip(obj);
+        while (isspace((unsigned char)*obj) || *obj == ':') {
+            obj++;
+        }
+        val = obj;
+        if ((size_t)(obj - name) >= key_len + 1 &&
+            strncmp(name, key, key_len) == 0 && name[key_len] == '"') {
+            return val;
+        }
+        obj = json_skip(val);
+    }
+}
+
+/* Returns item idx of the array starting at arr, or NULL. */
+const char *json_item(const char *arr, int idx) {
+    while (isspace((unsigned char)*arr)) {
+        arr++;
+    }
+    if (*arr++ != '[') {
+        return NULL;
+    }
+    for (int i = 0;; i++) {
+        while (isspace((unsigned char)*arr)) {
+            arr++;
+        }
+        if (!*arr || *arr == ']') {
+            return NULL;
+        }
+        if (i == idx) {
+            return arr;
+        }
+        arr = json_skip(arr);
+        while (isspace((unsigned char)*arr) || *arr == ',') {
+            arr++;
+        }
+    }
+}
+
+/* True if val is the JSON string str. */
+bool json_is(const char *val, const char *str) {
+    size_t len = strlen(str);
+    return val[0] == '"' && strncmp(val + 1, str, len) == 0 &&
+           val[len + 1] == '"';
+}
+
+/* Copies the JSON string at val into out, "" if it is not a string. */
+void json_str(const char *val, char *out, size_t size) {
+    size_t n = 0;
+    if (val && *val == '"') {
+        for (val++; *val && *val != '"' && n + 1 < size; val++) {
+            if (*val == '\\' && val[1]) {
+                val++;
+            }
+            out[n++] = *val;
+        }
+    }
+    out[n] = '\0';
+}
+
+/* Prints str as a quoted JSON string. */
+void json_print_str(FILE *fh, const char *str) {
+    fputc('"', fh);
+    for (; *str; str++) {
+        unsigned char c = (unsigned char)*str;
+        if (c == '"' || c == '\\') {
+            fprintf(fh, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(fh, "\\u%04x", c);
+        } else {
+            fputc(c, fh);
+        }
+    }
+    fputc('"', fh);
+}
+
+bool json_int(const char *obj, const char *key, long long *out_num) {
+    const char *val = json_member(obj, key);
+    char *end;
+    if (!val) {
+        return 0;
+    }
+    *out_num = strtoll(val, &end, 10);
+    return end != val;
+}
+
+void qmp_close(st_qmp *q) {
+    if (q->fd >= 0) {
+        close(q->fd);
+    }
+    free(q->buf);
+    memset(q, 0, sizeof(st_qmp));
+    q->fd = -1;
+}
+
+/* Waits for fd to be ready for events, until deadline (< 0: forever). */
+static bool qmp_wait_fd(int fd, short events, double deadline) {
+    struct pollfd pfd = {fd, events, 0};
+    int r;
+    do {
+        int left = deadline < 0 ? -1 : (int)(deadline - now_ms());
+        if (deadline >= 0 && left <= 0) {
+            return 0;
+        }
+        r = poll(&pfd, 1, left);
+    } while (r < 0 && errno == EINTR);
+    return r > 0;
+}
+
+/* Reads the next line (one QMP message), waiting up to timeout_ms, or
+ * forever if it is negative. NULL on timeout, EOF or error. */
+char *qmp_read_line(st_qmp *q, int timeout_ms) {
+    double deadline = timeout_ms < 0 ? -1 : now_ms() + timeout_ms;
+    char *nl;
+    if (q->line_len) { // Drop the previously returned line.
+        memmove(q->buf, q->buf + q->line_len, q->len - q->line_len);
+        q->len -= q->line_len;
+        q->line_len = 0;
+    }
+    while (!q->buf || !(nl = memchr(q->buf, '\n', q->len))) {
+        ssize_t r;
+        if (q->cap - q->len < BUFF_MAX) {
+            q->cap = q->cap ? q->cap * 2 : BUFF_MAX * 4;
+            if (!(q->buf = realloc(q->buf, q->cap))) {
+                fatal(ERR_MEM);
+            }
+        }
+        r = read(q->fd, q->buf + q->len, q->cap - q->len - 1);
+        if (r > 0) {
+            q->len += r;
+        } else if (r == 0 || (errno != EAGAIN && errno != EINTR) ||
+                   !qmp_wait_fd(q->fd, POLLIN, deadline)) {
+            return NULL;
+        }
+    }
+    *nl = '\0';
+    q->line_len = nl - q->buf + 1;
+    return q->buf;
+}
+
+/* Queues a command, with args_json as its arguments object (or NULL).
+ * Returns the id its reply will carry, 0 if the socket is gone. */
+unsigned int qmp_send(st_qmp *q, const char *cmd, const char *args_json) {
+    char msg[BUFF_MAX];
+    unsigned int id = ++q->next_id;
+    int len = snprintf(msg, sizeof(msg),
+                       "{\"execute\": \"%s\"%s%s, \"id\": %u}\n", cmd,
+                       args_json ? ", \"arguments\": " : "",
+                       args_json ? args_json : "", id);
+    if (len <= 0 || len >= (int)sizeof(msg)) {
+        return 0;
+    }
+    for (int off = 0; off < len;) {
+        ssize_t w = write(q->fd, msg + off, len - off);
+        if (w > 0) {
+            off += w;
+        } else if (w < 0 && errno != EAGAIN && errno != EINTR) {
+            return 0;
+        } else if (!qmp_wait_fd(q->fd, POLLOUT, now_ms() + 5000)) {
+            return 0;
+        }
+    }
+    return id;
+}
+
+/* Reads until the reply to id shows up and returns it, valid until the
+ * next read. Events are handed to on_event along the way. */
+char *qmp_wait_reply(st_qmp *q, unsigned int id, int timeout_ms) {
+    double deadline = now_ms() + timeout_ms;
+    long long got;
+    for (;;) {
+        int left = (int)(deadline - now_ms());
+        char *line = qmp_read_line(q, left > 0 ? left : 0);
+        if (!line) {
+            return NULL;
+        }
+        if (json_member(line, "event")) {
+            if (q->on_event) {
+                q->on_event(line, q->ctx);
+            }
+        } else if (json_int(line, "id", &got) && got == id) {
+            return line;
+        }
+    }
+}
+
+/* Runs a command and returns its reply line, or NULL on timeout. */
+char *qmp_execute(st_qmp *q, const char *cmd, const char *args_json,
+                  int timeout_ms) {
+    unsigned int id = qmp_send(q, cmd, args_json);
+    return id ? qmp_wait_reply(q, id, timeout_ms) : NULL;
+}
+
+bool pid_exited(pid_t pid) {
+    siginfo_t info;
+    memset(&info, 0, sizeof(info));
+    return waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) != 0 ||
+           info.si_pid == pid;
+}
+
+/* Starts a session on an fd already connected to QMP: reads the greeting
+ * and enters command mode. On failure the fd is closed. */
+bool qmp_attach(st_qmp *q, int fd, int timeout_ms) {
+    memset(q, 0, sizeof(st_qmp));
+    q->fd = fd;
+    fcntl(q->fd, F_SETFL, fcntl(q->fd, F_GETFL) | O_NONBLOCK);
+    if (!qmp_read_line(q, timeout_ms) || !json_member(q->buf, "QMP") ||
+        !qmp_execute(q, "qmp_capabilities", NULL, timeout_ms)) {
+        qmp_close(q);
+        return 0;
+    }
+    return 1;
+}
+
+/* Connects to a QMP socket, retrying while QEMU starts up and creates it,
+ * and leaves the session in command mode. Gives up early if qemu_pid (when
+ * > 0) exits, and at once if it is 0 and nobody listens. */
+bool qmp_connect(st_qmp *q, const char *path, pid_t qemu_pid,
+                 int timeout_ms) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    double deadline = now_ms() + timeout_ms;
+    memset(q, 0, sizeof(st_qmp));
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        q->fd = -1;
+        return 0;
+    }
+    strcpy(addr.sun_path, path);
+    for (;;) {
+        if ((q->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+            return 0;
+        }
+        if (connect(q->fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            break;
+        }
+        close(q->fd);
+        q->fd = -1;
+        if (qemu_pid == 0 || now_ms() > deadline ||
+            (qemu_pid > 0 && pid_exited(qemu_pid))) {
+            return 0;
+        }
+        usleep(2000);
+    }
+    return qmp_attach(q, q->fd, (int)(deadline - now_ms()) + 1);
+}
+
+/* qemu-run <vm> qmp <command> [arguments object]: prints what the command
+ * returns as JSON, or its error on stderr and exits with 1.
+ * qemu-run <vm> qmp --events: prints events, one per line, until the VM
+ * exits. Runs from the VM folder. */
+int program_run_qmp(char **items, int count) {
+    bool events = count && strcmp(items[0], "--events") == 0;
+    int rc = 0;
+    const char *val;
+    char *reply;
+    st_qmp q;
+    DPRINT_S();
+    if (count < 1 || count > (events ? 1 : 2)) {
+        fatal(ERR_ARGS);
+    }
+    if (!qmp_connect(&q, QMP_SOCKET, 0, 5000)) {
+        fatal(ERR_QMP);
+    }
+    if (events) {
+        while ((reply = qmp_read_line(&q, -1))) {
+            if (json_member(reply, "event")) {
+                puts(reply);
+                fflush(stdout);
+            }
+        }
+        qmp_close(&q);
+        return 0;
+    }
+    if (!(reply = qmp_execute(&q, items[0], count > 1 ? items[1] : NULL,
+                              30000))) {
+        fatal(ERR_QMP);
+    }
+    if ((val = json_member(reply, "return"))) {
+        printf("%.*s\n", (int)(json_skip(val) - val), val);
+    } else if ((val = json_member(reply, "error"))) {
+        fprintf(stderr, "%.*s\n", (int)(json_skip(val) - val), val);
+        rc = 1;
+    }
+    qmp_close(&q);
+    return rc;
+}
@@ -0,0 +1,231 @@
+/* Serial console log: serial_log=yes gives the guest a serial port (the
+ * first one, ttyS0 or COM1) whose output goes to SERIAL_LOG_FILE in the VM
+ * folder, or to the file serial_log= names, so boot logs and panics of
+ * headless VMs are kept. qemu-run <vm> console prints it, and with
+ * --follow keeps printing it as the guest writes.
+ *
+ * A logger process listens on SERIAL_SOCKET before QEMU starts, so not a
+ * byte is lost, and moves what QEMU sends to the log with splice(),
+ * through a pipe, without copying it through user space. serial_log_time=yes
+ * puts the time in front of every line; that means reading the bytes, so
+ * it costs a copy.
+ *
+ * Every launch starts a new log and moves the previous one to <log>.1,
+ * and so does a log reaching serial_log_size=, so the log never takes more
+ * than twice that. */
+
+#include <sys/uio.h>
+
+#define SERIAL_LOG_FILE "serial.log"
+#define SERIAL_SOCKET "console.sock"
+#define SERIAL_CHUNK (64 << 10)
+#define SERIAL_FOLLOW_MS 200
+
+/* The log file, NULL with serial_log=no. */
+const char *serial_log(void) {
+    long long on = 0;
+    const char *val = cfg[KEY_SERIAL_LOG].val;
+    if (!val[0] || cfg_convert(CFG_BOOL, val, &on)) {
+        return on ? SERIAL_LOG_FILE : NULL;
+    }
+    return val;
+}
+
+bool serial_log_requested(void) {
+    return serial_log() != NULL;
+}
+
+void program_build_serial(st_argv *out_args) {
+    if (!serial_log_requested()) {
+        return;
+    }
+    argv_push(out_args, "-chardev");
+    argv_push(out_args, "socket,id=console0,path=" SERIAL_SOCKET);
+    argv_push(out_args, "-serial");
+    argv_push(out_args, "chardev:console0");
+}
+
+/* Moves the log to <log>.1 and opens a new, empty one. */
+static int serial_rotate(void) {
+    char old[PATH_MAX + 2];
+    snprintf(old, sizeof(old), "%s.1", serial_log());
+    rename(serial_log(), old);
+    return open(serial_log(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+}
+
+/* Writes a chunk read from the guest, with the time in front of every
+ * line if asked to. One stamp does for the whole chunk: it was read at
+ * once. Returns the bytes written. */
+static long long serial_write(int log_fd, const char *buf, size_t len,
+                              bool *line_start) {
+    struct iovec iov[128];
+    char stamp[40];
+    long long total = 0;
+    int n = 0;
+    ssize_t r;
+    if (!cfg[KEY_SERIAL_LOG_TIME].num) {
+        return (r = write(log_fd, buf, len)) > 0 ? r : 0;
+    }
+    {
+        struct timespec ts;
+        struct tm tm;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        localtime_r(&ts.tv_sec, &tm);
+        strftime(stamp, sizeof(stamp), "[%Y-%m-%d %H:%M:%S", &tm);
+        snprintf(stamp + strlen(stamp), sizeof(stamp) - strlen(stamp),
+                 ".%03ld] ", ts.tv_nsec / 1000000);
+    }
+    while (len) {
+        const char *nl = memchr(buf, '\n', len);
+        size_t line = nl ? (size_t)(nl - buf) + 1 : len;
+        if (*line_start) {
+            iov[n].iov_base = stamp;
+            iov[n++].iov_len = strlen(stamp);
+        }
+        iov[n].iov_base = (char *)buf;
+        iov[n++].iov_len = line;
+        *line_start = nl != NULL;
+        buf += line;
+        len -= line;
+        if (n >= 126 || !len) {
+            total += (r = writev(log_fd, iov, n)) > 0 ? r : 0;
+            n = 0;
+        }
+    }
+    return total;
+}
+
+/* The logger process: copies the guest's output until QEMU hangs up. */
+static void serial_logger(int listen_fd, int log_fd) {
+    char buf[SERIAL_CHUNK];
+    long long max = cfg[KEY_SERIAL_LOG_SIZE].num, size = 0;
+    int sock = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    bool line_start = 1;
+    ssize_t len;
+    close(listen_fd);
+    if (sock < 0) {
+        return;
+    }
+#ifdef __linux__
+    int pipe_fds[2];
+    if (!cfg[KEY_SERIAL_LOG_TIME].num && pipe2(pipe_fds, O_CLOEXEC) == 0) {
+        fcntl(pipe_fds[1], F_SETPIPE_SZ, SERIAL_CHUNK);
+        while ((len = splice(sock, NULL, pipe_fds[1], NULL, SERIAL_CHUNK,
+                             SPLICE_F_MOVE)) > 0 ||
+               (len < 0 && errno == EINTR)) {
+            while (len > 0) {
+                ssize_t out = splice(pipe_fds[0], NULL, log_fd, NULL, len,
+                                     SPLICE_F_MOVE);
+                if (out <= 0) { // The log's file system cannot splice.
+                    out = read(pipe_fds[0], buf, len);
+                    if (out <= 0) {
+                        break;
+                    }
+                    serial_write(log_fd, buf, out, &line_start);
+                }
+                len -= out;
+                size += out;
+            }
+            if (max && size >= max) {
+                close(log_fd);
+                log_fd = serial_rotate();
+                size = 0;
+            }
+        }
+        return;
+    }
+#endif
+    while ((len = read(sock, buf, sizeof(buf))) > 0 ||
+           (len < 0 && errno == EINTR)) {
+        size += serial_write(log_fd, buf, len > 0 ? len : 0, &line_start);
+        if (max && size >= max) {
+            close(log_fd);
+            log_fd = serial_rotate();
+            size = 0;
+        }
+    }
+}
+
+/* Runs in the supervisor before QEMU starts. Returns the logger's pid. */
+pid_t serial_spawn(void) {
+    int listen_fd = trace_listen(SERIAL_SOCKET), log_fd = serial_rotate();
+    pid_t pid;
+    DPRINT_S();
+    if (log_fd < 0) {
+        printf("qemu-run: Cannot write %s: %s\n", serial_log(),
+               strerror(errno));
+    }
+    fflush(stdout);
+    if ((pid = fork()) == 0) {
+        serial_logger(listen_fd, log_fd);
+        _exit(0);
+    }
+    close(listen_fd);
+    if (log_fd >= 0) {
+        close(log_fd);
+    }
+    return pid;
+}
+
+/* The logger exits by itself once QEMU is gone and the rest is written. */
+void serial_stop(pid_t logger) {
+    for (int i = 0; i < 100 && !pid_exited(logger); i++) {
+        usleep(10000);
+    }
+    kill(logger, SIGTERM);
+    waitpid(logger, NULL, 0);
+    unlink(SERIAL_SOCKET);
+}
+
+/* qemu-run <vm> console [--follow]: prints the log. --follow keeps going,
+ * onto the new log after a rotation or relaunch, until interrupted. */
+int program_console(char **args, int count) {
+    char buf[SERIAL_CHUNK];
+    struct stat now, open_st;
+    bool follow = 0;
+    ssize_t len;
+    int fd;
+    for (int i = 0; i < count; i++) {
+        if (strcmp(args[i], "--follow") != 0 && strcmp(args[i], "-f") != 0) {
+            fatal(ERR_ARGS);
+        }
+        follow = 1;
+    }
+    if (!serial_log_requested()) {
+        puts("qemu-run: This VM has no serial_log=");
+        return 1;
+    }
+    if ((fd = open(serial_log(), O_RDONLY | O_CLOEXEC)) < 0 && !follow) {
+        printf("qemu-run: Cannot read %s: %s\n", serial_log(),
+               strerror(errno));
+        return 1;
+    }
+    for (;;) {
+        while (fd >= 0 && (len = read(fd, buf, sizeof(buf))) > 0) {
+            if (write(STDOUT_FILENO, buf, len) != len) {
+                close(fd);
+                return 1;
+            }
+        }
+        if (!follow) {
+            break;
+        }
+        if (stat(serial_log(), &now) == 0 &&
+            (fd < 0 || fstat(fd, &open_st) != 0 ||
+             now.st_ino != open_st.st_ino || now.st_dev != open_st.st_dev)) {
+            while (fd >= 0 && (len = read(fd, buf, sizeof(buf))) > 0 &&
+                   write(STDOUT_FILENO, buf, len) == len)
+                ; // Rotated: the rest of the old log first.
+            if (fd >= 0) {
+                close(fd);
+            }
+            fd = open(serial_log(), O_RDONLY | O_CLOEXEC);
+            continue;
+        }
+        usleep(SERIAL_FOLLOW_MS * 1000);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    return 0;
+}
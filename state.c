@@ -0,0 +1,226 @@
+/* Warm starts: qemu-run <vm> --suspend saves the running VM to STATE_FILE
+ * in its folder through a QMP migration to a file, and makes QEMU quit.
+ * The next qemu-run <vm> starts QEMU with -incoming defer and restores
+ * it, instead of booting. The state is used once, then removed.
+ *
+ * With a QEMU that has it (9.0+), the state is written with mapped-ram
+ * and multifd, one channel per vCPU, so both save and restore run in
+ * parallel at disk speed. STATE_META holds a fingerprint of the QEMU
+ * argv and of the disk images (size and mtime): if the config or a disk
+ * changed since, the state is ignored and the VM boots normally. A state
+ * that still fails to load is put aside, and QEMU is started again
+ * without -incoming to boot the VM. */
+
+#define STATE_FILE "state.bin"
+#define STATE_META "state.meta"
+
+static bool state_restoring;
+static bool state_mapped_ram;
+
+static uint64_t state_hash(uint64_t h, const void *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ ((const unsigned char *)data)[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+static uint64_t state_hash_file(uint64_t h, const char *fpath) {
+    struct stat st;
+    long long id[3] = {0};
+    if (fpath[0] && stat(fpath, &st) == 0) {
+        id[0] = (long long)st.st_size;
+        id[1] = (long long)st.st_mtim.tv_sec;
+        id[2] = (long long)st.st_mtim.tv_nsec;
+    }
+    return state_hash(h, id, sizeof(id));
+}
+
+/* Hashes the QEMU argv (everything the config decides) and the identity
+ * of every image the VM writes to or boots from. */
+uint64_t state_fingerprint(const st_argv *args) {
+    char disk_fpath[BUFF_AVG];
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < args->n; i++) {
+        h = state_hash(h, args->v[i], strlen(args->v[i]) + 1);
+    }
+    h = state_hash_file(h, cfg[KEY_FLOPPY].val);
+    h = state_hash_file(h, cfg[KEY_CDROM].val);
+    for (int i = 0; i < cfg[KEY_DISK].num; i++) {
+        cfg_list_item(KEY_DISK, i, disk_fpath, sizeof(disk_fpath));
+        h = state_hash_file(h, disk_fpath);
+    }
+    return h;
+}
+
+static bool state_meta_read(uint64_t *out_fp, int *out_mapped_ram) {
+    unsigned long long fp;
+    FILE *fh = fopen(STATE_META, "r");
+    bool ok;
+    if (!fh) {
+        return 0;
+    }
+    ok = fscanf(fh, "fingerprint=%llx mapped_ram=%d", &fp, out_mapped_ram) ==
+         2;
+    fclose(fh);
+    *out_fp = fp;
+    return ok;
+}
+
+static void state_discard(void) {
+    unlink(STATE_FILE);
+    unlink(STATE_META);
+}
+
+/* Appends -incoming defer when a saved state matches this VM as built. */
+void program_build_restore(st_argv *out_args) {
+    uint64_t fp;
+    int mapped_ram;
+    DPRINT_S();
+    if (!filetype(STATE_FILE, FT_FILE) || !state_meta_read(&fp, &mapped_ram)) {
+        return;
+    }
+    if (fp != state_fingerprint(out_args)) {
+        puts("qemu-run: The config or disks changed since the VM was "
+             "suspended, ignoring its saved state");
+        return;
+    }
+    state_restoring = 1;
+    state_mapped_ram = mapped_ram;
+    argv_push(out_args, "-incoming");
+    argv_push(out_args, "defer");
+}
+
+bool state_restore_requested(void) {
+    return state_restoring;
+}
+
+/* mapped-ram and multifd, or plain stream if this QEMU lacks them. Both
+ * sides of a migration have to agree on it. */
+static bool state_set_caps(st_qmp *q, bool mapped_ram) {
+    char params[BUFF_AVG];
+    char *reply;
+    if (!mapped_ram) {
+        return 1;
+    }
+    reply = qmp_execute(q, "migrate-set-capabilities",
+                        "{\"capabilities\": ["
+                        "{\"capability\": \"mapped-ram\", \"state\": true}, "
+                        "{\"capability\": \"multifd\", \"state\": true}]}",
+                        5000);
+    if (!reply || !json_member(reply, "return")) {
+        return 0;
+    }
+    snprintf(params, sizeof(params), "{\"multifd-channels\": %lld}",
+             cfg[KEY_CORES].num > 0 ? cfg[KEY_CORES].num : 1);
+    reply = qmp_execute(q, "migrate-set-parameters", params, 5000);
+    return reply && json_member(reply, "return");
+}
+
+/* Polls query-migrate until the migration ends. True if it completed. */
+static bool state_wait_migration(st_qmp *q, pid_t qemu_pid) {
+    for (;;) {
+        char *reply = qmp_execute(q, "query-migrate", NULL, 5000);
+        const char *ret, *status;
+        if (!reply || (qemu_pid > 0 && pid_exited(qemu_pid))) {
+            return 0;
+        }
+        if ((ret = json_member(reply, "return")) &&
+            (status = json_member(ret, "status"))) {
+            if (json_is(status, "completed")) {
+                return 1;
+            }
+            if (json_is(status, "failed") || json_is(status, "cancelled")) {
+                return 0;
+            }
+        }
+        usleep(20000);
+    }
+}
+
+/* Runs in the supervisor, on a QEMU started with -incoming defer. On
+ * failure QEMU is made to quit, for state_cold_boot(). */
+bool state_restore(st_qmp *q, pid_t qemu_pid) {
+    double t = now_ms();
+    const char *val;
+    char *reply;
+    DPRINT_S();
+    if (!state_set_caps(q, state_mapped_ram) ||
+        !(reply = qmp_execute(q, "migrate-incoming",
+                              "{\"uri\": \"file:" STATE_FILE "\"}", 5000)) ||
+        !json_member(reply, "return") || !state_wait_migration(q, qemu_pid)) {
+        puts("qemu-run: Cannot restore the saved state, it is left in "
+             STATE_FILE ".failed, booting the VM instead");
+        rename(STATE_FILE, STATE_FILE ".failed");
+        unlink(STATE_META);
+        qmp_execute(q, "quit", NULL, 5000);
+        return 0;
+    }
+    reply = qmp_execute(q, "query-status", NULL, 5000);
+    if (reply && (val = json_member(reply, "return")) &&
+        (val = json_member(val, "running")) && strncmp(val, "false", 5) == 0) {
+        qmp_execute(q, "cont", NULL, 5000);
+    }
+    state_discard(); // The disks move on from here.
+    printf("qemu-run: Restored in %.0f ms\n", now_ms() - t);
+    return 1;
+}
+
+/* Takes -incoming defer back out of args once a restore failed, so that
+ * QEMU can be started again to boot the VM. */
+void state_cold_boot(st_argv *args) {
+    for (size_t i = 0; i + 1 < args->n; i++) {
+        if (strcmp(args->v[i], "-incoming") == 0) {
+            free(args->v[i]);
+            free(args->v[i + 1]);
+            memmove(&args->v[i], &args->v[i + 2],
+                    (args->n - i - 1) * sizeof(char *)); // And the NULL.
+            args->n -= 2;
+            break;
+        }
+    }
+    state_restoring = 0;
+}
+
+/* qemu-run <vm> --suspend, run from the VM folder with its config loaded. */
+int program_suspend(const char *vm_name) {
+    st_argv args = {0};
+    st_qmp q;
+    FILE *fh;
+    bool mapped_ram = 1;
+    double t = now_ms();
+    char *reply;
+    DPRINT_S();
+    if (!qmp_connect(&q, QMP_SOCKET, 0, 5000)) {
+        fatal(ERR_QMP);
+    }
+    if (!qemu_has(CAP_MAPPED_RAM) || !state_set_caps(&q, 1)) {
+        puts("qemu-run: This QEMU has no mapped-ram, saving as a stream");
+        mapped_ram = 0;
+    }
+    state_discard();
+    qmp_execute(&q, "stop", NULL, 5000);
+    if (!(reply = qmp_execute(&q, "migrate",
+                              "{\"uri\": \"file:" STATE_FILE "\"}", 5000)) ||
+        !json_member(reply, "return") || !state_wait_migration(&q, -1)) {
+        qmp_execute(&q, "cont", NULL, 5000);
+        unlink(STATE_FILE);
+        fatal(ERR_STATE);
+    }
+    qmp_send(&q, "quit", NULL);
+    while (qmp_read_line(&q, 30000)) // EOF: QEMU closed its disks and left.
+        ;
+    qmp_close(&q);
+    ports_reuse(); // Its ports may not be free again yet, QEMU just left.
+    program_build_cmd_line((char *)vm_name, &args);
+    if (!(fh = fopen(STATE_META ".tmp", "w"))) {
+        fatal(ERR_STATE);
+    }
+    fprintf(fh, "fingerprint=%016llx\nmapped_ram=%d\n",
+            (unsigned long long)state_fingerprint(&args), mapped_ram);
+    if (fclose(fh) != 0 || rename(STATE_META ".tmp", STATE_META) != 0) {
+        fatal(ERR_STATE);
+    }
+    argv_free(&args);
+    printf("qemu-run: %s suspended in %.0f ms\n", vm_name, now_ms() - t);
+    return 0;
+}
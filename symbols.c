@@ -2,6 +2,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "cfghash.h"
+
 #ifndef ERR
 #define ERR (0)
 #define OK !ERR
@@ -14,6 +16,7 @@
 typedef struct st_symbols {
     struct st_symbols *next; /**< Link List Next Element */
     int hash;                /**<  Hash Value*/
+    int type;                /**<  Value Type (CFG_*) */
     char *key,               /**<  Symbol Name */
         *val;                /**<  Symbol Value */
 } st_symbols;
@@ -54,30 +57,6 @@ st_symbols *sym_base(void) {
     return base;
 }
 
-/**
- * @brief Find a symbol by its hash
- * @param hash - symbol hash we looking for
- * @return     - pointer to symbol
- * @return     - NULL if not found
- *
- *
- */
-st_symbols *sym_find_hash(int hash) {
-    int count = 0;
-    st_syminfo *si;
-    st_symbols *sym = NULL;
-
-    si = sym_base();
-    while (count < si->count) {
-        if (si->hashmap[count].hash == hash) {
-            sym = si->hashmap[count].symbol;
-            break;
-        }
-        count++;
-    }
-    return sym;
-}
-
 /**
  * @brief Generate a hash based on string characters
  * @param str  - string to generare hash from
@@ -85,34 +64,27 @@ st_symbols *sym_find_hash(int hash) {
  *
  *
  */
-int sym_hash_generate(char *str, int exists) {
-    int pos, hash = 0xCAFEBABE;
-    for (;;) {
-        pos = 0;
-        while (str[pos]) {
-            hash = ~(((((hash & 0xFF) ^ str[pos]) << 5) |
-                      (((hash >> 26) & 0x1f) ^ (pos & 31))) |
-                     (hash << 18));
-            pos++;
-        }
-        hash &= 0xFFFFFFFF;
-        if (!exists && sym_find_hash(hash)) {
-            printf("Hash Collision (%s)\n", str);
-            exit(1);
-            continue;
-        } else if (exists)
-            hash = sym_find_hash(hash) ? hash : 0;
-        break;
-    }
-    return hash;
-}
+int sym_hash_generate(char *str) { return cfg_hash(str, strlen(str), 0); }
 
+/**
+ * @brief Find a symbol by its name
+ * @param name - symbol name we looking for
+ * @return     - pointer to symbol
+ * @return     - NULL if not found
+ *
+ * Hashes only narrow the search, so colliding keys are still told apart.
+ */
 st_symbols *sym_find_key(char *name) {
-    int hash;
+    int hash = sym_hash_generate(name);
+    st_syminfo *si = sym_base();
 
-    hash = sym_hash_generate(name, 1);
-
-    return hash ? sym_find_hash(hash) : NULL;
+    for (int count = 0; count < si->count; count++) {
+        if (si->hashmap[count].hash == hash &&
+            strcmp(si->hashmap[count].symbol->key, name) == 0) {
+            return si->hashmap[count].symbol;
+        }
+    }
+    return NULL;
 }
 
 int sym_add(char *key, char *val) {
@@ -123,7 +95,7 @@ int sym_add(char *key, char *val) {
     if (!val)
         val = empty_str;
     si = sym_base();
-    hash = sym_hash_generate(key, 0);
+    hash = sym_hash_generate(key);
     if (!si->count) {
         sym = si->symbols = calloc(1, sizeof(st_symbols));
         if (sym)
@@ -0,0 +1,404 @@
+/* Launch tracing: with QEMURUN_TRACE=<folder> set, qemu-run <vm> records
+ * when each launch phase ends, on the monotonic clock, and writes them
+ * to <folder>/<vm>.<pid>.json in the Chrome trace format (chrome://tracing,
+ * Perfetto). qemu-run --trace-summary [files...] aggregates many of them.
+ *
+ * The launcher phases (find, defaults, load, build, exec) are followed
+ * by QEMU's: QMP ready, firmware start and handoff to the boot loader
+ * (the firmware debug console, port 0x402, read from a socket), then
+ * guest ready: the first of ready_marker= showing up on the serial port
+ * (read from the serial log with serial_log=), or the guest agent
+ * (guest_agent=yes) answering a guest-ping. QEMU runs supervised while
+ * traced, and the trace is written at guest ready, or when QEMU exits or
+ * TRACE_READY_TIMEOUT_MS passes without it.
+ *
+ * guest_agent=yes also works untraced: the agent socket is qga.sock in
+ * the VM folder. */
+
+#define TRACE_DEBUGCON "debugcon.sock"
+#define TRACE_SERIAL "serial.sock"
+#define TRACE_QGA "qga.sock"
+#define TRACE_MAX_MARKS 16
+#define TRACE_READY_TIMEOUT_MS 300000
+
+#ifdef __NIX__
+static struct {
+    const char *name;
+    double ms;
+} trace_marks[TRACE_MAX_MARKS];
+static int trace_nmarks;
+static double trace_t0;
+static char trace_fpath[PATH_MAX], trace_vm[BUFF_AVG];
+static int trace_listen_fds[2] = {-1, -1}; // Debug console, serial.
+
+bool serial_log_requested(void); // serial.c, which owns the serial port
+const char *serial_log(void);    // then; the marker is read from its log.
+
+bool trace_requested(void) {
+    return trace_fpath[0];
+}
+
+/* Starts the clock, if QEMURUN_TRACE asks for it. Call before chdir(). */
+void trace_start(const char *vm_name) {
+    char dir[PATH_MAX];
+    const char *env = getenv("QEMURUN_TRACE");
+    trace_t0 = now_ms();
+    if (!env || !env[0]) {
+        return;
+    }
+    if (!realpath(env, dir) || !filetype(dir, FT_PATH)) {
+        printf("qemu-run: QEMURUN_TRACE=%s is not a folder, not tracing\n",
+               env);
+        return;
+    }
+    snprintf(trace_fpath, sizeof(trace_fpath), "%.*s/%s.%ld.json",
+             PATH_MAX - BUFF_AVG - 32, dir, vm_name, (long)getpid());
+    snprintf(trace_vm, sizeof(trace_vm), "%s", vm_name);
+}
+
+void trace_mark(const char *name) {
+    if (trace_requested() && trace_nmarks < TRACE_MAX_MARKS) {
+        trace_marks[trace_nmarks].name = name;
+        trace_marks[trace_nmarks++].ms = now_ms();
+    }
+}
+
+static double trace_find(const char *name) {
+    for (int i = 0; i < trace_nmarks; i++) {
+        if (strcmp(trace_marks[i].name, name) == 0) {
+            return trace_marks[i].ms;
+        }
+    }
+    return -1;
+}
+
+static void trace_span(FILE *fh, const char *name, double from, double to) {
+    if (from >= 0 && to >= from) {
+        fprintf(fh,
+                "{\"name\": \"%s\", \"cat\": \"qemu-run\", \"ph\": \"X\", "
+                "\"ts\": %.0f, \"dur\": %.0f, \"pid\": %ld, \"tid\": 1},\n",
+                name, from * 1000, (to - from) * 1000, (long)getpid());
+    }
+}
+
+static void trace_write(void) {
+    static const char *launcher[] = {"find", "defaults", "load", "build",
+                                     "exec"};
+    double prev = trace_t0, boot_from = trace_find("handoff"),
+           end = trace_marks[trace_nmarks - 1].ms;
+    FILE *fh = fopen(trace_fpath, "w");
+    if (!fh) {
+        printf("qemu-run: Cannot write %s: %s\n", trace_fpath,
+               strerror(errno));
+        return;
+    }
+    fputs("{\"traceEvents\": [\n", fh);
+    for (size_t i = 0; i < sizeof(launcher) / sizeof(launcher[0]); i++) {
+        double t = trace_find(launcher[i]);
+        if (t >= 0) {
+            trace_span(fh, launcher[i], prev, t);
+            prev = t;
+        }
+    }
+    trace_span(fh, "qemu_init", trace_find("exec"), trace_find("qmp_ready"));
+    trace_span(fh, "firmware", trace_find("firmware"), boot_from);
+    trace_span(fh, "guest_boot",
+               boot_from >= 0 ? boot_from : trace_find("exec"),
+               trace_find("guest_ready"));
+    trace_span(fh, "launch", trace_t0, end);
+    for (int i = 0; i < trace_nmarks; i++) {
+        fprintf(fh,
+                "{\"name\": \"%s\", \"cat\": \"qemu-run\", \"ph\": \"i\", "
+                "\"s\": \"p\", \"ts\": %.0f, \"pid\": %ld, \"tid\": 1},\n",
+                trace_marks[i].name, trace_marks[i].ms * 1000,
+                (long)getpid());
+    }
+    fprintf(fh, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %ld, "
+                "\"args\": {\"name\": \"",
+            (long)getpid());
+    for (const char *c = trace_vm; *c; c++) {
+        fprintf(fh, *c == '"' || *c == '\\' ? "\\%c" : "%c", *c);
+    }
+    fputs("\"}}\n], \"displayTimeUnit\": \"ms\"}\n", fh);
+    if (fclose(fh) == 0) {
+        printf("qemu-run: Launch trace written to %s\n", trace_fpath);
+    }
+}
+
+void program_build_trace(st_argv *out_args) {
+    if (cfg[KEY_GUEST_AGENT].num) {
+        argv_push(out_args, "-device");
+        argv_push(out_args, virtio_dev("virtio-serial-pci"));
+        argv_push(out_args, "-chardev");
+        argv_push(out_args, "socket,id=qga0,path=" TRACE_QGA
+                            ",server=on,wait=off");
+        argv_push(out_args, "-device");
+        argv_push(out_args,
+                  "virtserialport,chardev=qga0,name=org.qemu.guest_agent.0");
+    }
+    if (!trace_requested()) {
+        return;
+    }
+    argv_push(out_args, "-chardev");
+    argv_push(out_args, "socket,id=trace0,path=" TRACE_DEBUGCON);
+    argv_push(out_args, "-device");
+    argv_push(out_args, "isa-debugcon,iobase=0x402,chardev=trace0");
+    if (cfg[KEY_READY_MARKER].val[0] && !serial_log_requested()) {
+        argv_push(out_args, "-chardev");
+        argv_push(out_args, "socket,id=trace1,path=" TRACE_SERIAL);
+        argv_push(out_args, "-serial");
+        argv_push(out_args, "chardev:trace1");
+    }
+}
+
+static int trace_listen(const char *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(fd, 1) != 0) {
+        printf("qemu-run: Cannot create %s: %s\n", path, strerror(errno));
+        fatal(ERR_EXEC);
+    }
+    return fd;
+}
+
+/* Runs in the supervisor before QEMU starts: QEMU connects to these as a
+ * client, so not a byte of early firmware or serial output is lost. */
+void trace_prepare(void) {
+    trace_listen_fds[0] = trace_listen(TRACE_DEBUGCON);
+    if (cfg[KEY_READY_MARKER].val[0] && !serial_log_requested()) {
+        trace_listen_fds[1] = trace_listen(TRACE_SERIAL);
+    }
+    trace_mark("exec");
+}
+
+/* Looks for needle in a stream read in chunks: tail keeps the end of the
+ * previous chunk, so a needle split across two reads still matches. */
+static bool trace_scan(char *tail, size_t tail_size, const char *chunk,
+                       size_t len, const char *needle) {
+    char buf[BUFF_MAX + BUFF_AVG];
+    size_t keep = strlen(tail), total;
+    memcpy(buf, tail, keep);
+    memcpy(buf + keep, chunk, len);
+    total = keep + len;
+    buf[total] = '\0';
+    for (size_t i = 0; i < total; i++) { // Firmware output has NULs.
+        buf[i] = buf[i] ? buf[i] : ' ';
+    }
+    keep = total < tail_size - 1 ? total : tail_size - 1;
+    memcpy(tail, buf + total - keep, keep);
+    tail[keep] = '\0';
+    return strstr(buf, needle) != NULL;
+}
+
+/* Watches the firmware, serial and agent channels until the guest is
+ * ready, then writes the trace. Runs in the supervisor. */
+void trace_watch(pid_t qemu_pid) {
+    struct pollfd pfds[3];
+    char chunk[BUFF_MAX], con_tail[16] = {0}, ser_tail[BUFF_AVG] = {0};
+    const char *marker = cfg[KEY_READY_MARKER].val;
+    bool agent = cfg[KEY_GUEST_AGENT].num, ready = 0;
+    double deadline = now_ms() + TRACE_READY_TIMEOUT_MS, next_ping = 0;
+    int qga = -1, log_fd = -1;
+    DPRINT_S();
+    if (strlen(marker) >= sizeof(ser_tail)) {
+        puts("qemu-run: ready_marker= is too long, ignoring it");
+        marker = "";
+    }
+    if (marker[0] && serial_log_requested()) {
+        log_fd = open(serial_log(), O_RDONLY | O_CLOEXEC);
+    }
+    pfds[0].fd = trace_listen_fds[0];
+    pfds[1].fd = trace_listen_fds[1];
+    while (!ready && now_ms() < deadline && !pid_exited(qemu_pid)) {
+        if (!agent && !marker[0] && trace_find("handoff") >= 0) {
+            break; // Nothing tells when the guest is up.
+        }
+        if (agent && now_ms() >= next_ping) {
+            struct sockaddr_un addr = {.sun_family = AF_UNIX};
+            strcpy(addr.sun_path, TRACE_QGA);
+            if (qga < 0 &&
+                (qga = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) >= 0 &&
+                connect(qga, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+                close(qga);
+                qga = -1;
+            }
+            if (qga >= 0 && write(qga, "{\"execute\": \"guest-ping\"}\n", 26) <
+                                0) {
+                close(qga);
+                qga = -1;
+            }
+            next_ping = now_ms() + 500;
+        }
+        if (log_fd >= 0) { // A file is always readable, no use polling it.
+            ssize_t len = read(log_fd, chunk, sizeof(chunk));
+            if (len > 0 && trace_scan(ser_tail, strlen(marker) + 1, chunk,
+                                      len, marker)) {
+                ready = 1;
+                break;
+            }
+        }
+        pfds[2].fd = qga;
+        for (int i = 0; i < 3; i++) {
+            pfds[i].events = POLLIN;
+            pfds[i].revents = 0;
+        }
+        if (poll(pfds, 3, 100) <= 0) {
+            continue;
+        }
+        for (int i = 0; i < 3; i++) {
+            ssize_t len;
+            if (!(pfds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+            if (i < 2 && pfds[i].fd == trace_listen_fds[i]) { // QEMU is in.
+                pfds[i].fd = accept4(pfds[i].fd, NULL, NULL, SOCK_CLOEXEC);
+                close(trace_listen_fds[i]);
+                trace_listen_fds[i] = -1;
+                continue;
+            }
+            if ((len = read(pfds[i].fd, chunk, sizeof(chunk))) <= 0) {
+                close(pfds[i].fd);
+                pfds[i].fd = -1;
+                if (i == 2) {
+                    qga = -1;
+                }
+                continue;
+            }
+            if (i == 0) {
+                if (trace_find("firmware") < 0) {
+                    trace_mark("firmware");
+                }
+                if (trace_find("handoff") < 0 &&
+                    trace_scan(con_tail, sizeof(con_tail), chunk, len,
+                               "Booting")) { // SeaBIOS and OVMF both say so.
+                    trace_mark("handoff");
+                }
+            } else if (i == 1) {
+                ready = trace_scan(ser_tail, strlen(marker) + 1, chunk, len,
+                                   marker);
+            } else {
+                ready = memmem(chunk, len, "\"return\"", 8) != NULL;
+            }
+        }
+    }
+    if (ready) {
+        trace_mark("guest_ready");
+    }
+    for (int i = 0; i < 3; i++) {
+        if (pfds[i].fd >= 0) {
+            close(pfds[i].fd);
+        }
+    }
+    if (log_fd >= 0) {
+        close(log_fd);
+    }
+    trace_write();
+    unlink(TRACE_DEBUGCON);
+    unlink(TRACE_SERIAL);
+}
+
+typedef struct {
+    char name[32];
+    double *ms;
+    size_t n, cap;
+} st_trace_phase;
+
+static int trace_cmp_ms(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void trace_summary_file(const char *fpath, st_trace_phase *phases,
+                               int *nphases) {
+    const char *events, *ev;
+    char *data = NULL, name[32];
+    size_t len = 0;
+    FILE *fh = fopen(fpath, "r");
+    if (!fh) {
+        printf("qemu-run: Cannot read %s: %s\n", fpath, strerror(errno));
+        return;
+    }
+    for (size_t r = BUFF_MAX; r == BUFF_MAX;) {
+        if (!(data = realloc(data, len + BUFF_MAX + 1))) {
+            fatal(ERR_MEM);
+        }
+        len += (r = fread(data + len, 1, BUFF_MAX, fh));
+    }
+    fclose(fh);
+    data[len] = '\0';
+    events = json_member(data, "traceEvents");
+    for (int i = 0; events && (ev = json_item(events, i)); i++) {
+        long long dur;
+        int p;
+        if (!json_is(json_member(ev, "ph"), "X") ||
+            !json_int(ev, "dur", &dur)) {
+            continue;
+        }
+        json_str(json_member(ev, "name"), name, sizeof(name));
+        for (p = 0; p < *nphases && strcmp(phases[p].name, name) != 0; p++)
+            ;
+        if (p == *nphases) {
+            if (p == TRACE_MAX_MARKS) {
+                continue;
+            }
+            strcpy(phases[(*nphases)++].name, name);
+        }
+        if (phases[p].n == phases[p].cap) {
+            phases[p].cap = phases[p].cap ? phases[p].cap * 2 : 64;
+            phases[p].ms =
+                realloc(phases[p].ms, phases[p].cap * sizeof(double));
+            if (!phases[p].ms) {
+                fatal(ERR_MEM);
+            }
+        }
+        phases[p].ms[phases[p].n++] = dur / 1000.0;
+    }
+    free(data);
+}
+
+/* qemu-run --trace-summary [trace files...]: min, median, p95 and max of
+ * every phase, over the given traces or all of those in QEMURUN_TRACE. */
+int program_trace_summary(char **fpaths, int count) {
+    st_trace_phase phases[TRACE_MAX_MARKS] = {0};
+    char fpath[PATH_MAX + BUFF_AVG];
+    const char *env = getenv("QEMURUN_TRACE");
+    int nphases = 0;
+    DPRINT_S();
+    for (int i = 0; i < count; i++) {
+        trace_summary_file(fpaths[i], phases, &nphases);
+    }
+    if (!count) {
+        struct dirent *de;
+        DIR *dh = env && env[0] ? opendir(env) : NULL;
+        if (!dh) {
+            fatal(ERR_ARGS);
+        }
+        while ((de = readdir(dh))) {
+            size_t len = strlen(de->d_name);
+            if (len > 5 && strcmp(de->d_name + len - 5, ".json") == 0) {
+                snprintf(fpath, sizeof(fpath), "%s/%s", env, de->d_name);
+                trace_summary_file(fpath, phases, &nphases);
+            }
+        }
+        closedir(dh);
+    }
+    printf("%-12s %7s %10s %10s %10s %10s\n", "phase (ms)", "count", "min",
+           "p50", "p95", "max");
+    for (int p = 0; p < nphases; p++) {
+        size_t n = phases[p].n;
+        qsort(phases[p].ms, n, sizeof(double), trace_cmp_ms);
+        printf("%-12s %7zu %10.2f %10.2f %10.2f %10.2f\n", phases[p].name, n,
+               phases[p].ms[0], phases[p].ms[(n - 1) / 2],
+               phases[p].ms[(n - 1) * 95 / 100], phases[p].ms[n - 1]);
+        free(phases[p].ms);
+    }
+    return 0;
+}
+#else
+void trace_mark(const char *name) {
+    (void)name;
+}
+#endif
@@ -0,0 +1,103 @@
+/* Shared folders: shared_backend=smb (the default) serves shared= over
+ * slirp's built-in SMB server, and needs net_backend=user and samba on the
+ * host. shared_backend=virtiofs runs virtiofsd on a socket in the VM
+ * folder and gives the guest a vhost-user-fs device, with guest RAM in a
+ * shared memory backend so virtiofsd can map it. It works with net=no;
+ * the guest mounts it with "mount -t virtiofs shared /mnt". */
+
+#define VIRTIOFS_SOCKET "virtiofsd.sock"
+
+bool shared_virtiofs(void) {
+    char *val = cfg[KEY_SHARED_BACKEND].val;
+    if (!val[0] || stricmp(val, "smb") == 0) {
+        return 0;
+    }
+    if (stricmp(val, "virtiofs") != 0) {
+        printf("qemu-run: shared_backend=%s is not smb or virtiofs\n", val);
+        fatal(ERR_SHAREDF);
+    }
+#ifndef __linux__
+    puts("qemu-run: shared_backend=virtiofs needs a Linux host");
+    fatal(ERR_SHAREDF);
+#endif
+    if (!qemu_has(CAP_VIRTIOFS)) {
+        static bool warned;
+        if (!warned) {
+            printf("qemu-run: Warning: This %s has no virtiofs, sharing the "
+                   "folder over smb\n",
+                   qemu_binary());
+            warned = 1;
+        }
+        return 0;
+    }
+    return 1;
+}
+
+/* True once a shared folder is actually exported through virtiofs. */
+bool virtiofs_requested(void) {
+    return cfg[KEY_SHARED].val[0] && filetype(cfg[KEY_SHARED].val, FT_PATH) &&
+           shared_virtiofs();
+}
+
+void program_build_virtiofs(st_argv *out_args) {
+    argv_push(out_args, "-chardev");
+    argv_push(out_args, "socket,id=fs0,path=" VIRTIOFS_SOCKET);
+    argv_push(out_args, "-device");
+    argv_pushx(out_args, virtio_dev("vhost-user-fs-pci"),
+               ",chardev=fs0,tag=shared", NULL);
+}
+
+#ifdef __linux__
+/* Distribution packages put virtiofsd in libexec, out of PATH. */
+static const char *virtiofsd_binary(void) {
+    static const char *paths[] = {"/usr/libexec/virtiofsd",
+                                  "/usr/lib/qemu/virtiofsd",
+                                  "/usr/local/libexec/virtiofsd"};
+    static char found[PATH_MAX];
+    for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+        if (filetype(paths[i], FT_FILE)) {
+            return paths[i];
+        }
+    }
+    if (get_binary_full_path("virtiofsd", found, NULL)) {
+        return found;
+    }
+    puts("qemu-run: Cannot find virtiofsd, needed for "
+         "shared_backend=virtiofs");
+    fatal(ERR_SHAREDF);
+    return "";
+}
+
+/* Starts virtiofsd on a listening socket bound here, so QEMU can connect
+ * right away without waiting for virtiofsd to get there. Returns its pid. */
+pid_t virtiofs_spawn(void) {
+    const char *binary = virtiofsd_binary();
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    char fd_arg[24];
+    pid_t pid;
+    int fd;
+    DPRINT_S();
+    strcpy(addr.sun_path, VIRTIOFS_SOCKET);
+    unlink(VIRTIOFS_SOCKET); // Left over by a crashed run.
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+        bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(fd, 1) != 0) {
+        printf("qemu-run: Cannot create %s: %s\n", VIRTIOFS_SOCKET,
+               strerror(errno));
+        fatal(ERR_SHAREDF);
+    }
+    if ((pid = fork()) < 0) {
+        fatal(ERR_EXEC);
+    }
+    if (pid == 0) {
+        char *argv[] = {(char *)binary, fd_arg, "--shared-dir",
+                        cfg[KEY_SHARED].val, "--cache=auto", NULL};
+        snprintf(fd_arg, sizeof(fd_arg), "--fd=%d", fd);
+        signal(SIGINT, SIG_IGN); // It stops when QEMU hangs up, not on ^C.
+        execv(binary, argv);
+        _exit(127);
+    }
+    close(fd);
+    return pid;
+}
+#endif
@@ -0,0 +1,409 @@
+/* Persistent VM index: maps a VM name to the directory a QEMURUN_VM_PATH
+ * walk would find, plus its config file name.
+ *
+ * The index lives in $XDG_CACHE_HOME/qemu-run (or ~/.cache/qemu-run), one
+ * file per QEMURUN_VM_PATH value, and is mmap()ed read only. It records the
+ * mtime of every root: adding, removing or renaming a VM directory changes
+ * its root mtime, which makes the index stale and triggers a rebuild. The
+ * mtime of every VM directory is kept too, for a config added or renamed
+ * inside it. A lookup is a single open addressing probe, plus one stat()
+ * per root up to the one holding the VM (an earlier root could now shadow
+ * it) and one for the VM directory. */
+
+#include <stdint.h>
+#include <sys/mman.h>
+
+#define VMINDEX_MAGIC "QRUNIDX2"
+
+typedef struct {
+    char magic[8];
+    uint32_t env_off, nroots, nslots, nentries, strings_len, pad;
+} st_vmindex_hdr;
+
+typedef struct {
+    int64_t mtime_sec, mtime_nsec;
+    uint32_t path_off, pad;
+} st_vmindex_root;
+
+typedef struct {
+    int64_t mtime_sec, mtime_nsec; /**< Of the VM directory */
+    uint32_t hash, root, name_off, dir_off, cfg_off; /**< 0 = empty slot */
+    uint32_t pad;
+} st_vmindex_slot;
+
+typedef struct {
+    void *map;
+    size_t len;
+    const st_vmindex_hdr *hdr;
+    const st_vmindex_root *roots;
+    const st_vmindex_slot *slots;
+    const char *str;
+} st_vmindex;
+
+typedef struct {
+    char *buf;
+    size_t len, cap;
+} st_strtab;
+
+static uint32_t vmindex_hash(const char *str) {
+    uint32_t hash = 2166136261u; // FNV-1a
+    while (*str) {
+        hash = (hash ^ (unsigned char)*str++) * 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t strtab_add(st_strtab *t, const char *str) {
+    size_t len = strlen(str) + 1;
+    uint32_t off = (uint32_t)t->len;
+    if (t->len + len > t->cap) {
+        t->cap = (t->len + len) * 2;
+        if (!(t->buf = realloc(t->buf, t->cap))) {
+            fatal(ERR_MEM);
+        }
+    }
+    memcpy(t->buf + t->len, str, len);
+    t->len += len;
+    return off;
+}
+
+/* $XDG_CACHE_HOME/qemu-run, or ~/.cache/qemu-run, made if mkdirs. */
+bool cache_dir(char *out_fpath, bool mkdirs) {
+    char *base = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+    if (base && base[0]) {
+        snprintf(out_fpath, PATH_MAX, "%s", base);
+    } else if (home && home[0]) {
+        snprintf(out_fpath, PATH_MAX, "%s/.cache", home);
+    } else {
+        return 0;
+    }
+    if (mkdirs) {
+        mkdir(out_fpath, 0700);
+    }
+    strcat(out_fpath, "/qemu-run");
+    if (mkdirs) {
+        mkdir(out_fpath, 0700);
+    }
+    return 1;
+}
+
+static bool vmindex_file(const char *env, char *out_fpath, bool mkdirs) {
+    if (!cache_dir(out_fpath, mkdirs)) {
+        return 0;
+    }
+    snprintf(out_fpath + strlen(out_fpath), 32, "/vms-%08x.idx",
+             vmindex_hash(env));
+    return 1;
+}
+
+static bool vmindex_fresh(const char *path, int64_t mtime_sec,
+                          int64_t mtime_nsec) {
+    struct stat sb;
+    if (stat(path, &sb) != 0) {
+        return mtime_sec == -1;
+    }
+    return mtime_sec == (int64_t)sb.st_mtim.tv_sec &&
+           mtime_nsec == (int64_t)sb.st_mtim.tv_nsec;
+}
+
+static bool vmindex_root_fresh(const st_vmindex *ix, uint32_t root) {
+    const st_vmindex_root *r = &ix->roots[root];
+    return vmindex_fresh(ix->str + r->path_off, r->mtime_sec, r->mtime_nsec);
+}
+
+static bool vmindex_slot_fresh(const st_vmindex *ix,
+                               const st_vmindex_slot *slot) {
+    return vmindex_fresh(ix->str + slot->dir_off, slot->mtime_sec,
+                         slot->mtime_nsec);
+}
+
+void vmindex_close(st_vmindex *ix) {
+    if (ix->map) {
+        munmap(ix->map, ix->len);
+    }
+    memset(ix, 0, sizeof(st_vmindex));
+}
+
+static bool vmindex_map(st_vmindex *ix, const char *env, const char *fpath) {
+    struct stat sb;
+    const st_vmindex_hdr *hdr;
+    int fd = open(fpath, O_RDONLY | O_CLOEXEC);
+    memset(ix, 0, sizeof(st_vmindex));
+    if (fd < 0) {
+        return 0;
+    }
+    if (fstat(fd, &sb) != 0 || sb.st_size < (off_t)sizeof(st_vmindex_hdr)) {
+        close(fd);
+        return 0;
+    }
+    ix->len = sb.st_size;
+    ix->map = mmap(NULL, ix->len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ix->map == MAP_FAILED) {
+        ix->map = NULL;
+        return 0;
+    }
+    hdr = ix->hdr = ix->map;
+    ix->roots = (const st_vmindex_root *)(hdr + 1);
+    ix->slots = (const st_vmindex_slot *)(ix->roots + hdr->nroots);
+    ix->str = (const char *)(ix->slots + hdr->nslots);
+    if (memcmp(hdr->magic, VMINDEX_MAGIC, 8) != 0 || !hdr->nslots ||
+        (hdr->nslots & (hdr->nslots - 1)) != 0 || // The lookup mask.
+        (const char *)ix->str + hdr->strings_len !=
+            (const char *)ix->map + ix->len ||
+        hdr->env_off >= hdr->strings_len ||
+        strcmp(ix->str + hdr->env_off, env) != 0) {
+        vmindex_close(ix);
+        return 0;
+    }
+    return 1;
+}
+
+/* Walks every root once and atomically replaces the index file. */
+static bool vmindex_build(const char *env, const char *fpath) {
+    char root[PATH_MAX] = {0}, path[PATH_MAX + BUFF_AVG], tmp[PATH_MAX + 32],
+         *slice, *root_q, *env_c = l_str_dup(env);
+    bool have_slice = 0, ok;
+    size_t slice_len, nroots = 0, nentries = 0, nslots = 8;
+    st_vmindex_hdr hdr;
+    st_vmindex_root *roots = NULL;
+    st_vmindex_slot *ents = NULL, *slots;
+    st_strtab t = {0};
+    struct stat sb;
+    DIR *dir;
+    struct dirent *de;
+    FILE *fh;
+    DPRINT_S();
+    strtab_add(&t, ""); // Offset 0 means "none".
+    slice = env_c;
+    do {
+        have_slice = l_str_slice(slice, PSEP_C, &slice_len);
+        mzero_ca(root);
+        strncpy(root, slice, slice_len);
+        root_q = l_str_rm_surrc(root, '\"');
+        slice = slice + slice_len + 1;
+        if (!(roots = realloc(roots, (nroots + 1) * sizeof(*roots)))) {
+            fatal(ERR_MEM);
+        }
+        memset(&roots[nroots], 0, sizeof(*roots));
+        roots[nroots].path_off = strtab_add(&t, root_q);
+        roots[nroots].mtime_sec = -1; // Missing root, fresh while missing.
+        if (stat(root_q, &sb) == 0) {
+            roots[nroots].mtime_sec = sb.st_mtim.tv_sec;
+            roots[nroots].mtime_nsec = sb.st_mtim.tv_nsec;
+        }
+        if ((dir = opendir(root_q))) {
+            while ((de = readdir(dir))) {
+                if (strcmp(de->d_name, ".") == 0 ||
+                    strcmp(de->d_name, "..") == 0 ||
+                    strlen(de->d_name) >= BUFF_AVG) {
+                    continue;
+                }
+                snprintf(path, sizeof(path), "%s" DSEP "%s", root_q,
+                         de->d_name);
+                if (de->d_type != DT_DIR &&
+                    ((de->d_type != DT_UNKNOWN && de->d_type != DT_LNK) ||
+                     !filetype(path, FT_PATH))) {
+                    continue;
+                }
+                if (!(ents = realloc(ents, (nentries + 1) * sizeof(*ents)))) {
+                    fatal(ERR_MEM);
+                }
+                memset(&ents[nentries], 0, sizeof(*ents));
+                ents[nentries].mtime_sec = -1;
+                if (stat(path, &sb) == 0) {
+                    ents[nentries].mtime_sec = sb.st_mtim.tv_sec;
+                    ents[nentries].mtime_nsec = sb.st_mtim.tv_nsec;
+                }
+                ents[nentries].hash = vmindex_hash(de->d_name);
+                ents[nentries].root = (uint32_t)nroots;
+                ents[nentries].name_off = strtab_add(&t, de->d_name);
+                ents[nentries].dir_off = strtab_add(&t, path);
+                strcat(path, DSEP "config");
+                if (filetype(path, FT_FILE)) {
+                    ents[nentries].cfg_off = strtab_add(&t, "config");
+                } else if (strcat(path, ".ini"), filetype(path, FT_FILE)) {
+                    ents[nentries].cfg_off = strtab_add(&t, "config.ini");
+                }
+                nentries++;
+            }
+            closedir(dir);
+        }
+        nroots++;
+    } while (have_slice);
+    while (nslots < nentries * 2) {
+        nslots *= 2;
+    }
+    if (!(slots = calloc(nslots, sizeof(*slots)))) {
+        fatal(ERR_MEM);
+    }
+    for (size_t i = 0; i < nentries; i++) {
+        uint32_t s = ents[i].hash & (nslots - 1);
+        bool dup = 0;
+        for (; slots[s].name_off; s = (s + 1) & (nslots - 1)) {
+            if (slots[s].hash == ents[i].hash &&
+                strcmp(t.buf + slots[s].name_off,
+                       t.buf + ents[i].name_off) == 0) {
+                dup = 1; // Shadowed by an earlier root.
+                break;
+            }
+        }
+        if (!dup) {
+            slots[s] = ents[i];
+        }
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, VMINDEX_MAGIC, 8);
+    hdr.env_off = strtab_add(&t, env);
+    hdr.nroots = (uint32_t)nroots;
+    hdr.nslots = (uint32_t)nslots;
+    hdr.nentries = (uint32_t)nentries;
+    hdr.strings_len = (uint32_t)t.len;
+    snprintf(tmp, sizeof(tmp), "%s.%ld", fpath, (long)getpid());
+    if ((ok = (fh = fopen(tmp, "wb")) != NULL)) {
+        ok = fwrite(&hdr, sizeof(hdr), 1, fh) == 1 &&
+             fwrite(roots, sizeof(*roots), nroots, fh) == nroots &&
+             fwrite(slots, sizeof(*slots), nslots, fh) == nslots &&
+             fwrite(t.buf, 1, t.len, fh) == t.len;
+        ok = (fclose(fh) == 0) && ok;
+        ok = ok && rename(tmp, fpath) == 0;
+        if (!ok) {
+            unlink(tmp);
+        }
+    }
+    free(slots);
+    free(ents);
+    free(roots);
+    free(t.buf);
+    free(env_c);
+    return ok;
+}
+
+/* Maps an up to date index for QEMURUN_VM_PATH, rebuilding it if needed.
+ * When check_roots is set every root and VM directory mtime is validated
+ * up front, which is what listing needs; lookups validate lazily in
+ * vmindex_find(). */
+bool vmindex_open(st_vmindex *ix, bool check_roots) {
+    char fpath[PATH_MAX];
+    char *env = getenv("QEMURUN_VM_PATH");
+    if (!env || strcmp(env, "") == 0) {
+        fatal(ERR_ENV);
+    }
+    if (!vmindex_file(env, fpath, 0)) {
+        return 0;
+    }
+    if (vmindex_map(ix, env, fpath)) {
+        bool fresh = 1;
+        for (uint32_t i = 0; check_roots && fresh && i < ix->hdr->nroots;
+             i++) {
+            fresh = vmindex_root_fresh(ix, i);
+        }
+        for (uint32_t i = 0; check_roots && fresh && i < ix->hdr->nslots;
+             i++) {
+            fresh = !ix->slots[i].name_off ||
+                    vmindex_slot_fresh(ix, &ix->slots[i]);
+        }
+        if (fresh) {
+            return 1;
+        }
+        vmindex_close(ix);
+    }
+    vmindex_file(env, fpath, 1);
+    return vmindex_build(env, fpath) && vmindex_map(ix, env, fpath);
+}
+
+/* Returns the slot for vm_name, NULL if it does not exist, or sets
+ * *out_stale when a root or the VM directory changed since the index was
+ * written. */
+const st_vmindex_slot *vmindex_find(const st_vmindex *ix, const char *vm_name,
+                                    bool *out_stale) {
+    uint32_t hash = vmindex_hash(vm_name), mask = ix->hdr->nslots - 1,
+             s = hash & mask, last_root = ix->hdr->nroots - 1;
+    const st_vmindex_slot *found = NULL;
+    for (; ix->slots[s].name_off; s = (s + 1) & mask) {
+        if (ix->slots[s].hash == hash &&
+            strcmp(ix->str + ix->slots[s].name_off, vm_name) == 0) {
+            found = &ix->slots[s];
+            last_root = found->root;
+            break;
+        }
+    }
+    *out_stale = 0;
+    for (uint32_t i = 0; i <= last_root && !*out_stale; i++) {
+        *out_stale = !vmindex_root_fresh(ix, i);
+    }
+    if (found && !*out_stale) {
+        *out_stale = !vmindex_slot_fresh(ix, found);
+    }
+    return *out_stale ? NULL : found;
+}
+
+/* Fills out_vm_dir (and out_cfg_file, "" if the VM has no config yet)
+ * through the index. Returns 0 if the index cannot be used at all. A VM
+ * whose entries do not fit the buffers is not found. */
+bool vmindex_lookup(const char *vm_name, char *out_vm_dir, size_t dir_size,
+                    char *out_cfg_file, size_t cfg_size, bool *out_found) {
+    st_vmindex ix;
+    const st_vmindex_slot *slot;
+    bool stale;
+    if (!vmindex_open(&ix, 0)) {
+        return 0;
+    }
+    slot = vmindex_find(&ix, vm_name, &stale);
+    if (stale) {
+        char fpath[PATH_MAX];
+        vmindex_close(&ix);
+        vmindex_file(getenv("QEMURUN_VM_PATH"), fpath, 1);
+        if (!vmindex_build(getenv("QEMURUN_VM_PATH"), fpath) ||
+            !vmindex_open(&ix, 0)) {
+            return 0;
+        }
+        slot = vmindex_find(&ix, vm_name, &stale);
+    }
+    *out_found = slot != NULL &&
+                 snprintf(out_vm_dir, dir_size, "%s",
+                          ix.str + slot->dir_off) < (int)dir_size &&
+                 snprintf(out_cfg_file, cfg_size, "%s",
+                          ix.str + slot->cfg_off) < (int)cfg_size;
+    if (!*out_found) {
+        out_vm_dir[0] = out_cfg_file[0] = '\0';
+    }
+    vmindex_close(&ix);
+    return !stale;
+}
+
+static const char *vmindex_sort_str;
+
+static int vmindex_cmp_name(const void *a, const void *b) {
+    const st_vmindex_slot *x = *(const st_vmindex_slot *const *)a,
+                          *y = *(const st_vmindex_slot *const *)b;
+    return strcmp(vmindex_sort_str + x->name_off,
+                  vmindex_sort_str + y->name_off);
+}
+
+int program_list_vms(void) {
+    st_vmindex ix;
+    const st_vmindex_slot **slots;
+    uint32_t n = 0;
+    DPRINT_S();
+    if (!vmindex_open(&ix, 1)) {
+        fatal(ERR_INDEX);
+    }
+    if (!(slots = calloc(ix.hdr->nentries + 1, sizeof(*slots)))) {
+        fatal(ERR_MEM);
+    }
+    for (uint32_t i = 0; i < ix.hdr->nslots; i++) {
+        if (ix.slots[i].name_off && ix.slots[i].cfg_off) {
+            slots[n++] = &ix.slots[i];
+        }
+    }
+    vmindex_sort_str = ix.str;
+    qsort(slots, n, sizeof(*slots), vmindex_cmp_name);
+    for (uint32_t i = 0; i < n; i++) {
+        printf("%s\t%s" DSEP "%s\n", ix.str + slots[i]->name_off,
+               ix.str + slots[i]->dir_off, ix.str + slots[i]->cfg_off);
+    }
+    free(slots);
+    vmindex_close(&ix);
+    return 0;
+}